@@ -0,0 +1,88 @@
+// count heap allocations for bench::allocations by replacing the global
+// operator new, and on glibc malloc, calloc and realloc
+#include "bench.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+std::atomic<uint64_t> allocation_count{0};
+std::atomic<uint64_t> allocation_bytes{0};
+thread_local bool counting = true;
+
+void count(size_t size) {
+  if (!counting)
+    return;
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+} // namespace
+
+namespace bench {
+AllocationCounts allocations() {
+  return {allocation_count.load(std::memory_order_relaxed),
+          allocation_bytes.load(std::memory_order_relaxed)};
+}
+
+void count_allocations_on_this_thread(bool enable) { counting = enable; }
+} // namespace bench
+
+// sanitizers replace malloc themselves
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) &&                   \
+    !defined(__SANITIZE_THREAD__)
+#define COUNT_MALLOC
+#endif
+
+#ifdef COUNT_MALLOC
+// msgpack::zone and others use malloc directly, so count that too; operator
+// new uses malloc, so doesn't need to count separately
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) noexcept {
+  count(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) noexcept {
+  count(n * size);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) noexcept {
+  count(size);
+  return __libc_realloc(p, size);
+}
+}
+#endif
+
+void *operator new(size_t size) {
+#ifndef COUNT_MALLOC
+  count(size);
+#endif
+  void *p = std::malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return operator new(size);
+  } catch (std::bad_alloc &) {
+    return nullptr;
+  }
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return operator new(size, std::nothrow);
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
@@ -0,0 +1,161 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/// a minimal benchmark harness
+///
+/// Benchmarks are ran repeatedly until they take at least --min-time seconds,
+/// and report time, heap allocations and allocated bytes per operation, as
+/// text or (with --json) as JSON for comparison between commits.
+namespace bench {
+
+struct AllocationCounts {
+  uint64_t count;
+  uint64_t bytes;
+};
+
+/// number and total size of heap allocations since the program started;
+/// counted by alloc_count.cpp, which must be linked into each benchmark
+AllocationCounts allocations();
+
+/// enable or disable counting of allocations made by the calling thread, for
+/// threads which are not part of what is being measured
+void count_allocations_on_this_thread(bool enable);
+
+/// steady_clock time in nanoseconds
+inline uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/// stop the compiler from optimising away the computation of value
+template <typename T> inline void do_not_optimize(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Result {
+  std::string name;
+  uint64_t iterations;
+  double ns_per_op;
+  double allocs_per_op;
+  double alloc_bytes_per_op;
+  /// throughput, if the benchmark processes some number of bytes
+  double mb_per_s;
+};
+
+class Runner {
+public:
+  Runner(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg == "--json")
+        json = true;
+      else if (arg == "--filter" && i + 1 < argc)
+        filter = argv[++i];
+      else if (arg == "--min-time" && i + 1 < argc)
+        min_time = std::atof(argv[++i]);
+      else {
+        fprintf(stderr,
+                "usage: %s [--json] [--filter SUBSTRING] [--min-time "
+                "SECONDS]\n",
+                argv[0]);
+        std::exit(1);
+      }
+    }
+  }
+
+  bool json = false;
+  std::string filter;
+  double min_time = 0.2;
+
+  /// should the benchmark called name be ran?
+  bool enabled(const std::string &name) const {
+    return name.find(filter) != std::string::npos;
+  }
+
+  /// run f repeatedly; each call does ops operations, processing bytes bytes
+  /// in total
+  template <typename F>
+  void run(const std::string &name, F &&f, size_t ops = 1, size_t bytes = 0) {
+    if (!enabled(name))
+      return;
+
+    // warm up caches and any lazily-allocated state
+    f();
+
+    using clock = std::chrono::steady_clock;
+    uint64_t iterations = 1;
+    while (true) {
+      AllocationCounts allocs_before = allocations();
+      auto start = clock::now();
+      for (uint64_t i = 0; i < iterations; i++)
+        f();
+      auto end = clock::now();
+      AllocationCounts allocs_after = allocations();
+
+      double seconds = std::chrono::duration<double>(end - start).count();
+      if (seconds >= min_time || iterations >= (uint64_t(1) << 40)) {
+        double n_ops = (double)iterations * ops;
+        add(Result{
+            name, iterations, seconds * 1e9 / n_ops,
+            (allocs_after.count - allocs_before.count) / n_ops,
+            (allocs_after.bytes - allocs_before.bytes) / n_ops,
+            bytes ? (double)bytes * iterations / seconds / 1e6 : 0.0});
+        return;
+      }
+
+      // aim for 1.5x min_time to avoid another round
+      double scale = seconds > 0 ? min_time * 1.5 / seconds : 100;
+      if (scale > 100)
+        scale = 100;
+      if (scale < 2)
+        scale = 2;
+      iterations = (uint64_t)(iterations * scale);
+    }
+  }
+
+  /// add a result computed outside of run()
+  void add(Result result) {
+    if (!json)
+      print_text(result);
+    results.push_back(std::move(result));
+  }
+
+  /// print the results in JSON mode; returns the exit code for main
+  int report() const {
+    if (!json)
+      return 0;
+
+    printf("{\"benchmarks\": [");
+    for (size_t i = 0; i < results.size(); i++) {
+      const Result &r = results[i];
+      printf("%s\n  {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": "
+             "%.3f, \"allocs_per_op\": %.3f, \"alloc_bytes_per_op\": %.3f, "
+             "\"mb_per_s\": %.3f}",
+             i ? "," : "", r.name.c_str(), (unsigned long long)r.iterations,
+             r.ns_per_op, r.allocs_per_op, r.alloc_bytes_per_op, r.mb_per_s);
+    }
+    printf("\n]}\n");
+    return 0;
+  }
+
+private:
+  static void print_text(const Result &r) {
+    printf("%-40s %12.1f ns/op %8.2f allocs/op %10.1f B/op", r.name.c_str(),
+           r.ns_per_op, r.allocs_per_op, r.alloc_bytes_per_op);
+    if (r.mb_per_s)
+      printf(" %10.1f MB/s", r.mb_per_s);
+    printf("\n");
+    fflush(stdout);
+  }
+
+  std::vector<Result> results;
+};
+
+} // namespace bench
@@ -0,0 +1,231 @@
+// microbenchmarks for message encoding and decoding
+#include "bench.hpp"
+#include "eshet/msgpack_to_string.hpp"
+#include "eshet/parse.hpp"
+#include "eshet/unpack.hpp"
+#include "json.hpp"
+#include <map>
+
+using namespace eshet;
+using namespace eshet::detail;
+
+static const std::string path = "/bench/some/state";
+
+static std::vector<uint8_t> frame(const SendBuf &buf) {
+  const uint8_t *data = (const uint8_t *)buf.sbuf.data();
+  return {data, data + buf.sbuf.size()};
+}
+
+// the part of a frame after the header, as passed to handle_message
+static std::vector<uint8_t> payload(const SendBuf &buf) {
+  const uint8_t *data = (const uint8_t *)buf.sbuf.data();
+  return {data + 3, data + buf.sbuf.size()};
+}
+
+static msgpack::object_handle make_value(size_t string_size) {
+  auto z = std::make_unique<msgpack::zone>();
+  std::map<std::string, msgpack::object> m;
+  m["value"] = msgpack::object(1.5);
+  m["name"] = msgpack::object(std::string(string_size, 'x'), *z);
+  msgpack::object o(m, *z);
+  return {o, std::move(z)};
+}
+
+static void bench_unpacker(bench::Runner &runner) {
+  msgpack::object_handle value = make_value(8);
+  SendBuf buf(128);
+  buf.write_state_changed(0, path, Known(msgpack::clone(*value)));
+
+  const size_t n_frames = 256;
+  std::vector<uint8_t> stream;
+  for (size_t i = 0; i < n_frames; i++) {
+    std::vector<uint8_t> f = frame(buf);
+    stream.insert(stream.end(), f.begin(), f.end());
+  }
+
+  for (size_t chunk_size : {1, 64, 1024, 65536}) {
+    std::vector<std::vector<uint8_t>> chunks;
+    for (size_t pos = 0; pos < stream.size(); pos += chunk_size)
+      chunks.emplace_back(stream.begin() + pos,
+                          stream.begin() +
+                              std::min(pos + chunk_size, stream.size()));
+
+    runner.run(
+        "unpacker/chunk_" + std::to_string(chunk_size),
+        [&]() {
+          Unpacker unpacker;
+          size_t frames = 0;
+          for (auto &chunk : chunks) {
+            unpacker.push(chunk);
+            while (auto message = unpacker.read()) {
+              bench::do_not_optimize(*message);
+              frames++;
+            }
+          }
+          if (frames != n_frames)
+            abort();
+        },
+        n_frames, stream.size());
+  }
+}
+
+// parse each message type in the same way as ESHETClientActor::handle_message
+static void bench_parser(bench::Runner &runner) {
+  msgpack::object_handle value = make_value(8);
+  msgpack::object_handle large_value = make_value(1024);
+  SendBuf buf(128);
+
+  auto run = [&](const std::string &name, std::vector<uint8_t> msg,
+                 auto parse) {
+    runner.run(
+        "parser/" + name,
+        [&]() {
+          Parser p(&msg[1], msg.size() - 1);
+          parse(p);
+          p.check_empty();
+        },
+        1, msg.size());
+  };
+
+  auto parse_reply = [](Parser &p) {
+    bench::do_not_optimize(p.read16());
+    msgpack::object_handle oh = p.read_msgpack();
+    bench::do_not_optimize(oh.get());
+  };
+
+  buf.write_reply(1, Success(msgpack::clone(*value)));
+  run("reply", payload(buf), parse_reply);
+
+  buf.write_reply(1, Success(msgpack::clone(*large_value)));
+  run("reply_1k", payload(buf), parse_reply);
+
+  buf.start_msg(0x0a);
+  buf.write16(1);
+  buf.sbuf.write("\x00\x00\x00\x01", 4);
+  buf.write_msgpack(*value);
+  buf.write_size();
+  run("reply_state_time", payload(buf), [](Parser &p) {
+    bench::do_not_optimize(p.read16());
+    bench::do_not_optimize(p.read32());
+    msgpack::object_handle oh = p.read_msgpack();
+    bench::do_not_optimize(oh.get());
+  });
+
+  auto parse_path_value = [](Parser &p) {
+    std::string path = p.read_string();
+    msgpack::object_handle oh = p.read_msgpack();
+    bench::do_not_optimize(path);
+    bench::do_not_optimize(oh.get());
+  };
+
+  buf.write_action_call(1, path, *value);
+  run("action_call", payload(buf), [](Parser &p) {
+    bench::do_not_optimize(p.read16());
+    std::string path = p.read_string();
+    msgpack::object_handle oh = p.read_msgpack();
+    bench::do_not_optimize(path);
+    bench::do_not_optimize(oh.get());
+  });
+
+  buf.start_msg(0x33);
+  buf.write_string(path);
+  buf.write_msgpack(*value);
+  buf.write_size();
+  run("event_notify", payload(buf), parse_path_value);
+
+  buf.start_msg(0x44);
+  buf.write_string(path);
+  buf.write_msgpack(*value);
+  buf.write_size();
+  run("state_changed", payload(buf), parse_path_value);
+
+  buf.start_msg(0x44);
+  buf.write_string(path);
+  buf.write_msgpack(*large_value);
+  buf.write_size();
+  run("state_changed_1k", payload(buf), parse_path_value);
+
+  buf.start_msg(0x45);
+  buf.write_string(path);
+  buf.write_size();
+  run("state_unknown", payload(buf), [](Parser &p) {
+    std::string path = p.read_string();
+    bench::do_not_optimize(path);
+  });
+}
+
+static void bench_sendbuf(bench::Runner &runner) {
+  msgpack::object_handle value = make_value(8);
+  msgpack::object_handle large_value = make_value(1024);
+  Known known(msgpack::clone(*value));
+  Known large_known(msgpack::clone(*large_value));
+  Success success(msgpack::clone(*value));
+  SendBuf buf(128);
+
+  auto run = [&](const std::string &name, auto write) {
+    runner.run("sendbuf/" + name, [&]() {
+      write();
+      bench::do_not_optimize(buf.sbuf.data());
+    });
+  };
+
+  run("ping", [&]() { buf.write_ping(1); });
+  run("state_register", [&]() { buf.write_state_register(1, path); });
+  run("state_changed", [&]() { buf.write_state_changed(1, path, known); });
+  run("state_changed_1k",
+      [&]() { buf.write_state_changed(1, path, large_known); });
+  run("state_unknown",
+      [&]() { buf.write_state_changed(1, path, Unknown()); });
+  run("event_emit", [&]() { buf.write_event_emit(1, path, *value); });
+  run("action_call", [&]() { buf.write_action_call(1, path, *value); });
+  run("reply", [&]() { buf.write_reply(1, success); });
+}
+
+static void bench_msgpack_to_string(bench::Runner &runner) {
+  msgpack::object_handle value = make_value(8);
+  runner.run("msgpack_to_string/small", [&]() {
+    bench::do_not_optimize(msgpack_to_string(*value));
+  });
+
+  msgpack::zone z;
+  std::vector<msgpack::object> arr(100, *value);
+  msgpack::object large(arr, z);
+  runner.run("msgpack_to_string/array_100", [&]() {
+    bench::do_not_optimize(msgpack_to_string(large));
+  });
+}
+
+static void bench_json_to_msgpack(bench::Runner &runner) {
+  std::string small = "{\"value\": 1.5, \"name\": \"xxxxxxxx\"}";
+  runner.run(
+      "json_to_msgpack/small",
+      [&]() {
+        msgpack::zone z;
+        bench::do_not_optimize(json_str_to_msgpack(small, z));
+      },
+      1, small.size());
+
+  std::string large = "[";
+  for (int i = 0; i < 100; i++)
+    large += std::string(i ? "," : "") + small;
+  large += "]";
+  runner.run(
+      "json_to_msgpack/array_100",
+      [&]() {
+        msgpack::zone z;
+        bench::do_not_optimize(json_str_to_msgpack(large, z));
+      },
+      1, large.size());
+}
+
+int main(int argc, char **argv) {
+  bench::Runner runner(argc, argv);
+
+  bench_unpacker(runner);
+  bench_parser(runner);
+  bench_sendbuf(runner);
+  bench_msgpack_to_string(runner);
+  bench_json_to_msgpack(runner);
+
+  return runner.report();
+}
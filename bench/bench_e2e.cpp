@@ -0,0 +1,355 @@
+// end-to-end throughput and latency through the client, over loopback
+#include "eshet.hpp"
+#include "eshet/histogram.hpp"
+#include "standin_server.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <unistd.h>
+
+using namespace eshet;
+using bench::now_ns;
+
+struct Options {
+  std::string workload = "all";
+  /// messages per second, or 0 to send as fast as possible
+  double rate = 0;
+  /// size of the padding string in each message
+  size_t size = 16;
+  double duration = 2;
+  /// maximum number of messages waiting for a reply
+  size_t window = 1000;
+  bool json = false;
+  /// how to connect to the stand-in server: tcp (over loopback), unix or shm;
+  /// set from --server when that is given
+  std::string transport = "tcp";
+  /// how clients use their sockets
+  SocketConfig socket_config;
+  /// external server to use instead of the stand-in
+  std::string host;
+  int port = 11236;
+};
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [--workload state|event|action|all] [--rate MSG_PER_S] "
+          "[--size BYTES] [--duration S] [--window N] "
+          "[--transport tcp|unix|shm] [--backend threads|uring] "
+          "[--server HOST[:PORT]|unix:PATH|shm:PATH] [--json]\n",
+          argv0);
+  exit(1);
+}
+
+static Options parse_args(int argc, char **argv) {
+  Options opts;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--json")
+      opts.json = true;
+    else if (arg == "--workload" && has_value)
+      opts.workload = argv[++i];
+    else if (arg == "--rate" && has_value)
+      opts.rate = atof(argv[++i]);
+    else if (arg == "--size" && has_value)
+      opts.size = atol(argv[++i]);
+    else if (arg == "--duration" && has_value)
+      opts.duration = atof(argv[++i]);
+    else if (arg == "--window" && has_value)
+      opts.window = atol(argv[++i]);
+    else if (arg == "--transport" && has_value) {
+      opts.transport = argv[++i];
+      if (opts.transport != "tcp" && opts.transport != "unix" &&
+          opts.transport != "shm")
+        usage(argv[0]);
+    } else if (arg == "--backend" && has_value) {
+      std::string backend = argv[++i];
+      if (backend == "threads")
+        opts.socket_config.backend = SocketBackend::Threads;
+      else if (backend == "uring")
+        opts.socket_config.backend = SocketBackend::Uring;
+      else
+        usage(argv[0]);
+    } else if (arg == "--server" && has_value) {
+      std::string server = argv[++i];
+      opts.transport = is_unix_endpoint(server)  ? "unix"
+                       : is_shm_endpoint(server) ? "shm"
+                                                 : "tcp";
+      if (opts.transport != "tcp") {
+        opts.host = server;
+        continue;
+      }
+      size_t colon = server.find(':');
+      opts.host = server.substr(0, colon);
+      if (colon != std::string::npos)
+        opts.port = std::stoi(server.substr(colon + 1));
+    } else
+      usage(argv[0]);
+  }
+  return opts;
+}
+
+// each message is sent as (send time in ns, padding); a send time of 0 tells
+// the receiver to stop
+using Payload = std::tuple<uint64_t, std::string>;
+
+static uint64_t payload_time(const msgpack::object &o) {
+  if (o.type != msgpack::type::ARRAY || o.via.array.size < 1)
+    throw std::runtime_error("unexpected payload");
+  return o.via.array.ptr[0].as<uint64_t>();
+}
+
+struct Measurement {
+  std::string workload;
+  uint64_t sent = 0;
+  uint64_t start_ns = 0;
+  LatencyHistogram latency;
+  std::atomic<uint64_t> received{0};
+  std::atomic<uint64_t> last_received_ns{0};
+
+  void record(uint64_t sent_ns) {
+    uint64_t now = now_ns();
+    latency.record(now - sent_ns);
+    received++;
+    last_received_ns = now;
+  }
+};
+
+// call send(payload, result_chan) at opts.rate until opts.duration has
+// passed, with at most opts.window results outstanding; on_result is called
+// with each result
+template <typename Send, typename OnResult>
+static uint64_t produce(const Options &opts, Send send, OnResult on_result) {
+  Channel<Result> results;
+  size_t in_flight = 0;
+  auto read_result = [&]() {
+    on_result(results.read());
+    in_flight--;
+  };
+
+  std::string padding(opts.size, 'x');
+  uint64_t start = now_ns();
+  uint64_t end = start + (uint64_t)(opts.duration * 1e9);
+  double interval_ns = opts.rate > 0 ? 1e9 / opts.rate : 0;
+
+  uint64_t sent = 0;
+  for (uint64_t now = start; now < end; now = now_ns()) {
+    if (interval_ns > 0) {
+      uint64_t next = start + (uint64_t)(sent * interval_ns);
+      if (next > now) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(next - now));
+        continue;
+      }
+    }
+
+    while (in_flight >= opts.window)
+      read_result();
+    send(Payload{now_ns(), padding}, results);
+    in_flight++;
+    sent++;
+  }
+
+  while (in_flight)
+    read_result();
+
+  // tell the receiver to stop
+  send(Payload{0, ""}, results);
+  on_result(results.read());
+
+  return sent;
+}
+
+static void check_success(Channel<Result> &chan) {
+  Result r = chan.read();
+  if (!std::holds_alternative<Success>(r))
+    throw std::runtime_error("command failed");
+}
+
+static void ignore_result(Result) {}
+
+static void run_state(const Options &opts, const std::string &host, int port,
+                      Measurement &m) {
+  const std::string path = "/bench/e2e/state";
+  ESHETClient publisher(host, port, std::nullopt, TimeoutConfig{},
+                        opts.socket_config);
+  ESHETClient observer(host, port, std::nullopt, TimeoutConfig{},
+                       opts.socket_config);
+
+  Channel<Result> result;
+  publisher.state_register(path, result);
+  check_success(result);
+
+  Channel<StateResult> observe_result;
+  Channel<StateUpdate> changes;
+  observer.state_observe(path, observe_result, changes);
+  observe_result.read();
+
+  std::thread receiver([&]() {
+    while (true) {
+      StateUpdate update = changes.read();
+      if (!std::holds_alternative<Known>(update))
+        continue;
+      uint64_t t = payload_time(std::get<Known>(update).value.get());
+      if (t == 0)
+        return;
+      m.record(t);
+    }
+  });
+
+  m.start_ns = now_ns();
+  m.sent = produce(
+      opts,
+      [&](const Payload &p, Channel<Result> &results) {
+        publisher.state_changed(path, p, results);
+      },
+      ignore_result);
+  receiver.join();
+}
+
+static void run_event(const Options &opts, const std::string &host, int port,
+                      Measurement &m) {
+  const std::string path = "/bench/e2e/event";
+  ESHETClient emitter(host, port, std::nullopt, TimeoutConfig{},
+                      opts.socket_config);
+  ESHETClient listener(host, port, std::nullopt, TimeoutConfig{},
+                       opts.socket_config);
+
+  Channel<Result> result;
+  emitter.event_register(path, result);
+  check_success(result);
+
+  Channel<msgpack::object_handle> events;
+  listener.event_listen(path, events, result);
+  check_success(result);
+
+  std::thread receiver([&]() {
+    while (true) {
+      uint64_t t = payload_time(events.read().get());
+      if (t == 0)
+        return;
+      m.record(t);
+    }
+  });
+
+  m.start_ns = now_ns();
+  m.sent = produce(
+      opts,
+      [&](const Payload &p, Channel<Result> &results) {
+        emitter.event_emit(path, p, results);
+      },
+      ignore_result);
+  receiver.join();
+}
+
+static void run_action(const Options &opts, const std::string &host, int port,
+                       Measurement &m) {
+  const std::string path = "/bench/e2e/action";
+  ESHETClient server(host, port, std::nullopt, TimeoutConfig{},
+                     opts.socket_config);
+  ESHETClient caller(host, port, std::nullopt, TimeoutConfig{},
+                     opts.socket_config);
+
+  Channel<Result> result;
+  Channel<Call> calls;
+  server.action_register(path, result, calls);
+  check_success(result);
+
+  // echo the arguments back, so the caller can measure the round trip
+  std::thread handler([&]() {
+    while (true) {
+      Call call = calls.read();
+      bool stop = payload_time(call.value.get()) == 0;
+      call.reply(Success(msgpack::clone(call.value.get())));
+      if (stop)
+        return;
+    }
+  });
+
+  m.start_ns = now_ns();
+  m.sent = produce(
+      opts,
+      [&](const Payload &p, Channel<Result> &results) {
+        caller.action_call_pack(path, results, p);
+      },
+      [&](Result r) {
+        if (!std::holds_alternative<Success>(r))
+          throw std::runtime_error("action call failed");
+        uint64_t t = payload_time(std::get<Success>(r).value.get());
+        if (t)
+          m.record(t);
+      });
+  handler.join();
+}
+
+static void report(const Options &opts, Measurement &m, bool first) {
+  HistogramSnapshot s = m.latency.snapshot();
+  double elapsed = (m.last_received_ns - m.start_ns) / 1e9;
+  double throughput = elapsed > 0 ? m.received / elapsed : 0;
+
+  if (opts.json)
+    printf("%s\n  {\"workload\": \"%s\", \"transport\": \"%s\", "
+           "\"rate\": %.1f, \"size\": %zu, \"sent\": %llu, "
+           "\"received\": %llu, \"msg_per_s\": %.1f, \"p50_us\": %.3f, "
+           "\"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f}",
+           first ? "" : ",", m.workload.c_str(), opts.transport.c_str(),
+           opts.rate, opts.size, (unsigned long long)m.sent,
+           (unsigned long long)m.received.load(), throughput,
+           s.percentile(50) / 1e3, s.percentile(99) / 1e3,
+           s.percentile(99.9) / 1e3, s.max / 1e3);
+  else
+    printf("%-8s sent %9llu received %9llu %12.1f msg/s  p50 %9.1f us  p99 "
+           "%9.1f us  p999 %9.1f us  max %9.1f us\n",
+           m.workload.c_str(), (unsigned long long)m.sent,
+           (unsigned long long)m.received.load(), throughput,
+           s.percentile(50) / 1e3, s.percentile(99) / 1e3,
+           s.percentile(99.9) / 1e3, s.max / 1e3);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  Options opts = parse_args(argc, argv);
+
+  std::unique_ptr<bench::StandinServer> standin;
+  std::string host = opts.host;
+  int port = opts.port;
+  std::string path = "/tmp/eshet_bench_" + std::to_string(getpid()) + ".sock";
+  if (host.empty() && opts.transport == "unix") {
+    standin = std::make_unique<bench::StandinServer>(path);
+    host = unix_endpoint_prefix + path;
+  } else if (host.empty() && opts.transport == "shm") {
+    standin = std::make_unique<bench::StandinServer>("", path);
+    host = shm_endpoint_prefix + path;
+  } else if (host.empty()) {
+    standin = std::make_unique<bench::StandinServer>();
+    host = "127.0.0.1";
+    port = standin->port();
+  }
+
+  using RunFn = void (*)(const Options &, const std::string &, int,
+                         Measurement &);
+  std::vector<std::pair<std::string, RunFn>> workloads = {
+      {"state", run_state}, {"event", run_event}, {"action", run_action}};
+
+  if (opts.json)
+    printf("{\"results\": [");
+
+  bool first = true;
+  for (auto &workload : workloads) {
+    if (opts.workload != "all" && opts.workload != workload.first)
+      continue;
+
+    Measurement m;
+    m.workload = workload.first;
+    workload.second(opts, host, port, m);
+    report(opts, m, first);
+    first = false;
+  }
+
+  if (opts.json)
+    printf("\n]}\n");
+
+  if (first)
+    usage(argv[0]);
+  return 0;
+}
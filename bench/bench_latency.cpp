@@ -0,0 +1,233 @@
+// round-trip latency and CPU cost of each LatencyProfile setting, for one
+// action call at a time over loopback
+#include "eshet.hpp"
+#include "eshet/histogram.hpp"
+#include "standin_server.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace eshet;
+using bench::now_ns;
+
+struct Options {
+  /// name of the setting to measure, or all
+  std::string setting = "all";
+  double duration = 2;
+  /// spin time used by the recv_spin, actor_spin and all settings
+  std::chrono::microseconds spin{200};
+  /// tcp or unix; set from --server when that is given
+  std::string transport = "tcp";
+  bool json = false;
+  /// external server to use instead of the stand-in
+  std::string host;
+  int port = 11236;
+};
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [--setting NAME|all] [--duration S] [--spin-us US] "
+          "[--transport tcp|unix] [--server HOST[:PORT]|unix:PATH] [--json]\n",
+          argv0);
+  exit(1);
+}
+
+static Options parse_args(int argc, char **argv) {
+  Options opts;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--json")
+      opts.json = true;
+    else if (arg == "--setting" && has_value)
+      opts.setting = argv[++i];
+    else if (arg == "--duration" && has_value)
+      opts.duration = atof(argv[++i]);
+    else if (arg == "--spin-us" && has_value)
+      opts.spin = std::chrono::microseconds(atol(argv[++i]));
+    else if (arg == "--transport" && has_value) {
+      opts.transport = argv[++i];
+      if (opts.transport != "tcp" && opts.transport != "unix")
+        usage(argv[0]);
+    } else if (arg == "--server" && has_value) {
+      std::string server = argv[++i];
+      if (is_unix_endpoint(server)) {
+        opts.transport = "unix";
+        opts.host = server;
+        continue;
+      }
+      opts.transport = "tcp";
+      size_t colon = server.find(':');
+      opts.host = server.substr(0, colon);
+      if (colon != std::string::npos)
+        opts.port = std::stoi(server.substr(colon + 1));
+    } else
+      usage(argv[0]);
+  }
+  return opts;
+}
+
+// each setting changes one thing from the default, apart from all, which is
+// LatencyProfile::low_latency with the spin time from --spin-us
+static std::vector<std::pair<std::string, LatencyProfile>>
+settings(const Options &opts) {
+  std::vector<std::pair<std::string, LatencyProfile>> settings;
+  auto add = [&](std::string name, auto modify) {
+    LatencyProfile profile;
+    modify(profile);
+    settings.emplace_back(std::move(name), profile);
+  };
+
+  add("default", [](LatencyProfile &) {});
+  add("nodelay", [](LatencyProfile &p) { p.tcp_nodelay = true; });
+  add("quickack", [](LatencyProfile &p) { p.tcp_quickack = true; });
+  add("busy_poll", [](LatencyProfile &p) { p.busy_poll_us = 50; });
+  add("buffers", [](LatencyProfile &p) {
+    p.send_buffer = 1 << 20;
+    p.recv_buffer = 1 << 20;
+  });
+  add("recv_spin", [&](LatencyProfile &p) { p.recv_spin = opts.spin; });
+  add("actor_spin", [&](LatencyProfile &p) { p.actor_spin = opts.spin; });
+  add("all", [&](LatencyProfile &p) {
+    p = LatencyProfile::low_latency();
+    p.recv_spin = opts.spin;
+    p.actor_spin = opts.spin;
+  });
+  return settings;
+}
+
+static double process_cpu_seconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+struct Measurement {
+  uint64_t calls = 0;
+  double seconds = 0;
+  double cpu_seconds = 0;
+  LatencyHistogram latency;
+};
+
+static void check_success(Channel<Result> &chan) {
+  if (!std::holds_alternative<Success>(chan.read()))
+    throw std::runtime_error("command failed");
+}
+
+// call an action in a loop, waiting for each reply before the next call; both
+// the caller and the action's owner use profile
+static void run(const Options &opts, const std::string &host, int port,
+                bench::StandinServer *standin, const LatencyProfile &profile,
+                Measurement &m) {
+  const std::string path = "/bench/latency/action";
+  SocketConfig socket_config;
+  socket_config.latency = profile;
+  ESHETClient server(host, port, std::nullopt, TimeoutConfig{},
+                     socket_config);
+  ESHETClient caller(host, port, std::nullopt, TimeoutConfig{},
+                     socket_config);
+
+  Channel<Result> result;
+  Channel<Call> calls;
+  server.action_register(path, result, calls);
+  check_success(result);
+
+  // an argument of false tells the handler to stop
+  std::thread handler([&]() {
+    while (true) {
+      Call call = calls.read();
+      bool stop = !std::get<0>(call.as<std::tuple<bool>>());
+      call.reply(Success(true));
+      if (stop)
+        return;
+    }
+  });
+
+  double cpu_start = process_cpu_seconds();
+  double server_cpu_start = standin ? standin->cpu_seconds() : 0;
+  uint64_t start = now_ns();
+  uint64_t end = start + (uint64_t)(opts.duration * 1e9);
+
+  for (uint64_t now = start; now < end;) {
+    caller.action_call_pack(path, result, std::make_tuple(true));
+    check_success(result);
+    uint64_t done = now_ns();
+    m.latency.record(done - now);
+    m.calls++;
+    now = done;
+  }
+
+  m.seconds = (now_ns() - start) / 1e9;
+  m.cpu_seconds = process_cpu_seconds() - cpu_start;
+  if (standin)
+    m.cpu_seconds -= standin->cpu_seconds() - server_cpu_start;
+
+  caller.action_call_pack(path, result, std::make_tuple(false));
+  check_success(result);
+  handler.join();
+}
+
+int main(int argc, char **argv) {
+  Options opts = parse_args(argc, argv);
+
+  std::unique_ptr<bench::StandinServer> standin;
+  std::string host = opts.host;
+  int port = opts.port;
+  std::string path = "/tmp/eshet_bench_" + std::to_string(getpid()) + ".sock";
+  if (host.empty() && opts.transport == "unix") {
+    standin = std::make_unique<bench::StandinServer>(path);
+    host = unix_endpoint_prefix + path;
+  } else if (host.empty()) {
+    standin = std::make_unique<bench::StandinServer>();
+    host = "127.0.0.1";
+    port = standin->port();
+  }
+
+  if (opts.json)
+    printf("{\"transport\": \"%s\", \"spin_us\": %lld, \"results\": [",
+           opts.transport.c_str(), (long long)opts.spin.count());
+  else
+    printf("%-10s %10s %10s %10s %10s %12s %8s\n", "setting", "calls/s",
+           "p50 us", "p99 us", "p999 us", "cpu us/call", "cores");
+
+  bool first = true;
+  for (auto &setting : settings(opts)) {
+    if (opts.setting != "all" && opts.setting != setting.first)
+      continue;
+
+    Measurement m;
+    run(opts, host, port, standin.get(), setting.second, m);
+
+    HistogramSnapshot s = m.latency.snapshot();
+    double throughput = m.calls / m.seconds;
+    double cpu_per_call = m.calls ? m.cpu_seconds * 1e6 / m.calls : 0;
+    // average number of cores kept busy by the clients
+    double cores = m.cpu_seconds / m.seconds;
+
+    if (opts.json)
+      printf("%s\n  {\"setting\": \"%s\", \"calls\": %llu, "
+             "\"calls_per_s\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+             "\"p999_us\": %.3f, \"cpu_us_per_call\": %.3f, \"cores\": %.3f}",
+             first ? "" : ",", setting.first.c_str(),
+             (unsigned long long)m.calls, throughput, s.percentile(50) / 1e3,
+             s.percentile(99) / 1e3, s.percentile(99.9) / 1e3, cpu_per_call,
+             cores);
+    else
+      printf("%-10s %10.1f %10.1f %10.1f %10.1f %12.2f %8.2f\n",
+             setting.first.c_str(), throughput, s.percentile(50) / 1e3,
+             s.percentile(99) / 1e3, s.percentile(99.9) / 1e3, cpu_per_call,
+             cores);
+    fflush(stdout);
+    first = false;
+  }
+
+  if (opts.json)
+    printf("\n]}\n");
+
+  if (first)
+    usage(argv[0]);
+  return 0;
+}
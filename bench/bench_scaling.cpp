@@ -0,0 +1,237 @@
+// throughput, producer-side latency and CPU cost of publishing from many
+// threads, through one shared client or one client per thread
+#include "eshet.hpp"
+#include "eshet/histogram.hpp"
+#include "standin_server.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/resource.h>
+#include <thread>
+
+using namespace eshet;
+using bench::now_ns;
+
+struct Options {
+  std::string workload = "state";
+  int max_threads = 64;
+  double duration = 1;
+  /// maximum number of messages per thread waiting for a reply
+  size_t window = 256;
+  bool json = false;
+  /// how clients use their sockets
+  SocketConfig socket_config;
+  /// external server to use instead of the stand-in
+  std::string host;
+  int port = 11236;
+};
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [--workload state|event] [--max-threads N] "
+          "[--duration S] [--window N] [--backend threads|uring] "
+          "[--server HOST[:PORT]|unix:PATH|shm:PATH] [--json]\n",
+          argv0);
+  exit(1);
+}
+
+static Options parse_args(int argc, char **argv) {
+  Options opts;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--json")
+      opts.json = true;
+    else if (arg == "--workload" && has_value)
+      opts.workload = argv[++i];
+    else if (arg == "--max-threads" && has_value)
+      opts.max_threads = atoi(argv[++i]);
+    else if (arg == "--duration" && has_value)
+      opts.duration = atof(argv[++i]);
+    else if (arg == "--window" && has_value)
+      opts.window = atol(argv[++i]);
+    else if (arg == "--backend" && has_value) {
+      std::string backend = argv[++i];
+      if (backend == "threads")
+        opts.socket_config.backend = SocketBackend::Threads;
+      else if (backend == "uring")
+        opts.socket_config.backend = SocketBackend::Uring;
+      else
+        usage(argv[0]);
+    } else if (arg == "--server" && has_value) {
+      std::string server = argv[++i];
+      if (is_unix_endpoint(server) || is_shm_endpoint(server)) {
+        opts.host = server;
+        continue;
+      }
+      size_t colon = server.find(':');
+      opts.host = server.substr(0, colon);
+      if (colon != std::string::npos)
+        opts.port = std::stoi(server.substr(colon + 1));
+    } else
+      usage(argv[0]);
+  }
+  if (opts.workload != "state" && opts.workload != "event")
+    usage(argv[0]);
+  return opts;
+}
+
+static double process_cpu_seconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+struct Measurement {
+  uint64_t messages = 0;
+  double seconds = 0;
+  double cpu_seconds = 0;
+  /// time spent in each state_changed or event_emit call
+  LatencyHistogram latency;
+};
+
+static void check_success(Channel<Result> &chan) {
+  if (!std::holds_alternative<Success>(chan.read()))
+    throw std::runtime_error("command failed");
+}
+
+static void run(const Options &opts, const std::string &host, int port,
+                bench::StandinServer *standin, bool shared, int n_threads,
+                Measurement &m) {
+  std::vector<std::unique_ptr<ESHETClient>> clients;
+  for (int i = 0; i < (shared ? 1 : n_threads); i++)
+    clients.push_back(std::make_unique<ESHETClient>(host, port, std::nullopt,
+                                                    TimeoutConfig{},
+                                                    opts.socket_config));
+
+  auto client_for = [&](int i) -> ESHETClient & {
+    return *clients[shared ? 0 : i];
+  };
+  auto path_for = [&](int i) {
+    return "/bench/scaling/" + opts.workload + "/" + std::to_string(i);
+  };
+
+  for (int i = 0; i < n_threads; i++) {
+    Channel<Result> result;
+    if (opts.workload == "state")
+      client_for(i).state_register(path_for(i), result);
+    else
+      client_for(i).event_register(path_for(i), result);
+    check_success(result);
+  }
+
+  std::atomic<int> ready{0};
+  std::atomic<bool> go{false};
+  std::atomic<uint64_t> messages{0};
+
+  auto producer = [&](int idx) {
+    ESHETClient &client = client_for(idx);
+    std::string path = path_for(idx);
+    Channel<Result> results;
+    size_t in_flight = 0;
+    uint64_t sent = 0;
+
+    ready++;
+    while (!go)
+      ;
+
+    uint64_t end = now_ns() + (uint64_t)(opts.duration * 1e9);
+    for (uint64_t now = now_ns(); now < end;) {
+      while (in_flight >= opts.window) {
+        results.read();
+        in_flight--;
+      }
+
+      uint64_t start = now_ns();
+      if (opts.workload == "state")
+        client.state_changed(path, sent, results);
+      else
+        client.event_emit(path, sent, results);
+      now = now_ns();
+      m.latency.record(now - start);
+
+      in_flight++;
+      sent++;
+    }
+
+    while (in_flight) {
+      results.read();
+      in_flight--;
+    }
+    messages += sent;
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < n_threads; i++)
+    threads.emplace_back(producer, i);
+  while (ready < n_threads)
+    std::this_thread::yield();
+
+  double cpu_start = process_cpu_seconds();
+  double server_cpu_start = standin ? standin->cpu_seconds() : 0;
+  uint64_t start = now_ns();
+  go = true;
+
+  for (auto &thread : threads)
+    thread.join();
+
+  m.seconds = (now_ns() - start) / 1e9;
+  m.cpu_seconds = process_cpu_seconds() - cpu_start;
+  if (standin)
+    m.cpu_seconds -= standin->cpu_seconds() - server_cpu_start;
+  m.messages = messages;
+}
+
+int main(int argc, char **argv) {
+  Options opts = parse_args(argc, argv);
+
+  std::unique_ptr<bench::StandinServer> standin;
+  std::string host = opts.host;
+  int port = opts.port;
+  if (host.empty()) {
+    standin = std::make_unique<bench::StandinServer>();
+    host = "127.0.0.1";
+    port = standin->port();
+  }
+
+  if (opts.json)
+    printf("{\"workload\": \"%s\", \"results\": [", opts.workload.c_str());
+  else
+    printf("%-10s %7s %14s %10s %10s %10s %12s\n", "mode", "threads",
+           "msg/s", "p50 ns", "p99 ns", "p999 ns", "cpu ns/msg");
+
+  bool first = true;
+  for (int n_threads = 1; n_threads <= opts.max_threads; n_threads *= 2) {
+    for (bool shared : {true, false}) {
+      Measurement m;
+      run(opts, host, port, standin.get(), shared, n_threads, m);
+
+      HistogramSnapshot s = m.latency.snapshot();
+      const char *mode = shared ? "shared" : "per_thread";
+      double throughput = m.messages / m.seconds;
+      double cpu_per_msg = m.messages ? m.cpu_seconds * 1e9 / m.messages : 0;
+
+      if (opts.json)
+        printf("%s\n  {\"mode\": \"%s\", \"threads\": %d, \"messages\": %llu, "
+               "\"msg_per_s\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+               "\"p999_ns\": %llu, \"cpu_ns_per_msg\": %.1f}",
+               first ? "" : ",", mode, n_threads,
+               (unsigned long long)m.messages, throughput,
+               (unsigned long long)s.percentile(50),
+               (unsigned long long)s.percentile(99),
+               (unsigned long long)s.percentile(99.9), cpu_per_msg);
+      else
+        printf("%-10s %7d %14.1f %10llu %10llu %10llu %12.1f\n", mode,
+               n_threads, throughput, (unsigned long long)s.percentile(50),
+               (unsigned long long)s.percentile(99),
+               (unsigned long long)s.percentile(99.9), cpu_per_msg);
+      fflush(stdout);
+      first = false;
+    }
+  }
+
+  if (opts.json)
+    printf("\n]}\n");
+  return 0;
+}
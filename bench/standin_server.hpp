@@ -0,0 +1,65 @@
+#pragma once
+#include "bench.hpp"
+#include "eshet/server/server.hpp"
+#include <pthread.h>
+#include <thread>
+#include <time.h>
+
+namespace bench {
+
+/// runs the built-in eshet::server::Server on a free loopback port, so that
+/// benchmarks don't need an external eshetsrv
+///
+/// If unix_path or shm_path are given, the server also listens on a Unix socket
+/// or accepts shared memory connections there, so that transports can be
+/// compared.
+///
+/// Allocations made by the server thread are not counted by
+/// bench::allocations.
+class StandinServer {
+public:
+  explicit StandinServer(const std::string &unix_path = {},
+                         const std::string &shm_path = {})
+      : server(config(unix_path, shm_path)), thread([this]() {
+          // the server isn't part of what is being measured
+          count_allocations_on_this_thread(false);
+          server.run();
+        }) {}
+
+  StandinServer(const StandinServer &) = delete;
+  StandinServer &operator=(const StandinServer &) = delete;
+
+  ~StandinServer() {
+    server.stop();
+    thread.join();
+  }
+
+  int port() const { return server.port(); }
+
+  /// CPU time used by the server thread, so that it can be excluded from
+  /// measurements of the whole process
+  double cpu_seconds() {
+    clockid_t clock;
+    timespec ts;
+    if (pthread_getcpuclockid(thread.native_handle(), &clock) != 0 ||
+        clock_gettime(clock, &ts) != 0)
+      return 0;
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+private:
+  static eshet::server::ServerConfig config(const std::string &unix_path,
+                                            const std::string &shm_path) {
+    eshet::server::ServerConfig config;
+    config.bind_address = "127.0.0.1";
+    config.port = 0;
+    config.unix_path = unix_path;
+    config.shm_path = shm_path;
+    return config;
+  }
+
+  eshet::server::Server server;
+  std::thread thread;
+};
+
+} // namespace bench
@@ -3,10 +3,21 @@
 #include "actorpp/net.hpp"
 #include "eshet/commands.hpp"
 #include "eshet/data.hpp"
+#include "eshet/endpoint.hpp"
+#include "eshet/flight_recorder.hpp"
+#include "eshet/latency.hpp"
 #include "eshet/log.hpp"
+#include "eshet/metrics.hpp"
 #include "eshet/msgpack_to_string.hpp"
+#include "eshet/probes.hpp"
+#include "eshet/publish_policy.hpp"
+#include "eshet/recv_thread.hpp"
+#include "eshet/shm_recv.hpp"
+#include "eshet/typed.hpp"
 #include "eshet/unpack.hpp"
 #include "eshet/util.hpp"
+#include "eshet/writer.hpp"
+#include <fstream>
 #include <string>
 
 namespace eshet {
@@ -22,6 +33,36 @@ struct TimeoutConfig {
   std::chrono::seconds ping_timeout{5};
 };
 
+enum class SocketBackend {
+  /// a thread per connection doing blocking reads, and blocking sends from
+  /// the sending thread
+  Threads,
+  /// one io_uring thread shared by all clients in the process, if the kernel
+  /// supports it (see detail::UringReactor); otherwise Threads. Sends don't
+  /// block; instead the connection is dropped if too much is waiting to be
+  /// sent
+  Uring,
+};
+
+struct SocketConfig {
+  /// how to send and receive on TCP and Unix sockets; shared memory
+  /// connections are not affected
+  SocketBackend backend = SocketBackend::Threads;
+  /// socket options and busy-polling to trade CPU time for latency
+  LatencyProfile latency;
+  /// the buffers which data is received into; messages and values refer to
+  /// these until they have been handled, so a consumer which holds on to
+  /// received values holds on to buffers
+  BufferPoolConfig receive_buffers;
+  /// ask the kernel for software receive timestamps, which are attached to
+  /// received states (Known::rx_time) and events (TimestampedEvent), and on
+  /// TCP, transmit timestamps, which are compared with the time each frame was
+  /// written in ClientMetrics::tx_delay_ns
+  ///
+  /// Only used with SocketBackend::Threads.
+  bool timestamping = false;
+};
+
 namespace detail {
 
 /// ESHET client
@@ -36,37 +77,82 @@ class ESHETClientActor : public Actor {
   using time_point = std::chrono::time_point<clock>;
 
 public:
+  /// connect to hostname:port over TCP, to a Unix socket if hostname is of
+  /// the form "unix:/path", or through shared memory if it is "shm:/path"
   explicit ESHETClientActor(const std::string &hostname, int port,
                             std::optional<msgpack::object_handle> id = {},
-                            TimeoutConfig timeout_config = {})
+                            TimeoutConfig timeout_config = {},
+                            SocketConfig socket_config = {})
       : hostname(hostname), port(port), id(std::move(id)),
-        timeout_config(std::move(timeout_config)), ping_result(*this),
-        should_exit(*this), on_message(*this), on_close(*this),
-        on_command(*this), on_reply(*this), send_buf(128) {}
+        timeout_config(std::move(timeout_config)),
+        socket_config(std::move(socket_config)), ping_result(*this),
+        publish_result(*this), should_exit(*this), on_message(*this),
+        on_close(*this), on_control(*this, "control"), on_reply(*this, "reply"),
+        on_state(*this, "state"), on_event(*this, "event"), send_buf(128) {
+    client_metrics->set_lanes({&on_control.get_stats(), &on_reply.get_stats(),
+                               &on_state.get_stats(), &on_event.get_stats()});
+  }
 
   explicit ESHETClientActor(const std::pair<std::string, int> &hostport,
                             std::optional<msgpack::object_handle> id = {},
-                            TimeoutConfig timeout_config = {})
+                            TimeoutConfig timeout_config = {},
+                            SocketConfig socket_config = {})
       : ESHETClientActor(hostport.first, hostport.second, std::move(id),
-                         std::move(timeout_config)) {}
+                         std::move(timeout_config), std::move(socket_config)) {
+  }
 
   template <typename T>
   void action_call_pack(std::string path, Channel<Result> result_chan,
                         const T &args) {
     std::unique_ptr<msgpack::zone> z = std::make_unique<msgpack::zone>();
     msgpack::object_handle oh(msgpack::object(args, *z), std::move(z));
-    on_command.emplace(
+    on_state.emplace(
         ActionCall{std::move(path), std::move(result_chan), std::move(oh)});
   }
 
   void action_register(std::string path, Channel<Result> result_chan,
-                       Channel<Call> call_chan) {
-    on_command.emplace(ActionRegister{std::move(path), std::move(result_chan),
-                                      std::move(call_chan)});
+                       Channel<Call> call_chan, ActionOptions options = {}) {
+    on_state.emplace(ActionRegister{std::move(path), std::move(result_chan),
+                                    std::move(call_chan), std::move(options)});
+  }
+
+  /// register an action whose calls are delivered in batches; all calls
+  /// which are received together are delivered in one CallBatch
+  void action_register(std::string path, Channel<Result> result_chan,
+                       Channel<CallBatch> call_chan,
+                       ActionOptions options = {}) {
+    on_state.emplace(ActionRegister{std::move(path), std::move(result_chan),
+                                    BatchChannel<Call>(std::move(call_chan)),
+                                    std::move(options)});
+  }
+
+  /// register an action whose call arguments are only unpacked when they are
+  /// used
+  void action_register(std::string path, Channel<Result> result_chan,
+                       Channel<LazyCall> call_chan,
+                       ActionOptions options = {}) {
+    on_state.emplace(ActionRegister{std::move(path), std::move(result_chan),
+                                    std::move(call_chan), std::move(options)});
   }
 
-  void state_register(std::string path, Channel<Result> result_chan) {
-    on_command.emplace(StateRegister{std::move(path), std::move(result_chan)});
+  /// register an action whose calls are handled by handler on pool, with at
+  /// most options.max_concurrency calls running at once; pool must outlive
+  /// this client
+  void action_register(std::string path, Channel<Result> result_chan,
+                       ThreadPool &pool, ActionHandler handler,
+                       ActionOptions options = {}) {
+    auto dispatcher =
+        std::make_shared<ActionDispatcher>(pool, std::move(handler), options);
+    on_state.emplace(ActionRegister{std::move(path), std::move(result_chan),
+                                    std::move(dispatcher), std::move(options)});
+  }
+
+  /// register a state; calls to state_changed for this path are filtered
+  /// and rate-limited according to policy
+  void state_register(std::string path, Channel<Result> result_chan,
+                      PublishPolicy policy = {}) {
+    on_state.emplace(StateRegister{std::move(path), std::move(result_chan),
+                                   std::move(policy)});
   }
 
   template <typename T>
@@ -74,23 +160,31 @@ public:
                      Channel<Result> result_chan) {
     std::unique_ptr<msgpack::zone> z = std::make_unique<msgpack::zone>();
     msgpack::object_handle oh(msgpack::object(value, *z), std::move(z));
-    on_command.push(StateChanged{std::move(path), std::move(result_chan),
-                                 Known{std::move(oh)}});
+    on_state.push(StateChanged{std::move(path), std::move(result_chan),
+                               Known{std::move(oh)}});
   }
 
   void state_unknown(std::string path, Channel<Result> result_chan) {
-    on_command.push(
+    on_state.push(
         StateChanged{std::move(path), std::move(result_chan), Unknown{}});
   }
 
   void state_observe(std::string path, Channel<StateResult> result_chan,
-                     Channel<StateUpdate> changed_chan) {
-    on_command.push(StateObserve{std::move(path), std::move(result_chan),
-                                 std::move(changed_chan)});
+                     Channel<StateUpdate> changed_chan,
+                     SubscribeOptions options = {}) {
+    on_state.push(StateObserve{std::move(path), std::move(result_chan),
+                               std::move(changed_chan), options});
+  }
+
+  /// observe a state, with each known value only unpacked when it is used
+  void state_observe(std::string path, Channel<StateResult> result_chan,
+                     Channel<LazyStateUpdate> changed_chan) {
+    on_state.push(StateObserve{std::move(path), std::move(result_chan),
+                               std::move(changed_chan)});
   }
 
   void event_register(std::string path, Channel<Result> result_chan) {
-    on_command.push(EventRegister{std::move(path), std::move(result_chan)});
+    on_event.push(EventRegister{std::move(path), std::move(result_chan)});
   }
 
   template <typename T>
@@ -98,30 +192,154 @@ public:
                   Channel<Result> result_chan) {
     std::unique_ptr<msgpack::zone> z = std::make_unique<msgpack::zone>();
     msgpack::object_handle oh(msgpack::object(value, *z), std::move(z));
-    on_command.push(
+    on_event.push(
         EventEmit{std::move(path), std::move(result_chan), std::move(oh)});
   }
 
   void event_listen(std::string path,
                     Channel<msgpack::object_handle> event_chan,
+                    Channel<Result> result_chan,
+                    SubscribeOptions options = {}) {
+    on_state.push(EventListen{std::move(path), std::move(result_chan),
+                              std::move(event_chan), options});
+  }
+
+  /// listen to an event, with each event delivered with the time it was
+  /// received (see SocketConfig::timestamping)
+  void event_listen(std::string path, Channel<TimestampedEvent> event_chan,
+                    Channel<Result> result_chan,
+                    SubscribeOptions options = {}) {
+    on_state.push(EventListen{std::move(path), std::move(result_chan),
+                              std::move(event_chan), options});
+  }
+
+  /// listen to an event, with each event only unpacked when it is used
+  void event_listen(std::string path, Channel<LazyValue> event_chan,
+                    Channel<Result> result_chan) {
+    on_state.push(EventListen{std::move(path), std::move(result_chan),
+                              std::move(event_chan)});
+  }
+
+  /// listen to an event, with events which are received together delivered
+  /// in one EventBatch
+  void event_listen(std::string path, Channel<EventBatch> event_chan,
+                    Channel<Result> result_chan,
+                    SubscribeOptions options = {}) {
+    on_state.push(EventListen{
+        std::move(path), std::move(result_chan),
+        BatchChannel<msgpack::object_handle>(std::move(event_chan)), options});
+  }
+
+  // methods for typed states and events; see TypedState and TypedEvent
+
+  template <typename T>
+  void state_register(const TypedState<T> &state, Channel<Result> result_chan,
+                      PublishPolicy policy = {}) {
+    state_register(std::string(state.path().str()), std::move(result_chan),
+                   std::move(policy));
+  }
+
+  template <typename T>
+  void state_changed(const TypedState<T> &state,
+                     const typename TypedState<T>::value_type &value,
+                     Channel<Result> result_chan) {
+    state_changed(std::string(state.path().str()), value,
+                  std::move(result_chan));
+  }
+
+  /// observe a typed state; changes are decoded directly into T, and are
+  /// empty when the state is unknown
+  template <typename T>
+  void state_observe(const TypedState<T> &state,
+                     Channel<StateResult> result_chan,
+                     Channel<std::optional<T>> changed_chan) {
+    on_state.push(StateObserve{
+        std::string(state.path().str()), std::move(result_chan),
+        std::make_shared<detail::TypedStateSink<T>>(state.path().str(),
+                                                    std::move(changed_chan))});
+  }
+
+  template <typename T>
+  void event_register(const TypedEvent<T> &event, Channel<Result> result_chan) {
+    event_register(std::string(event.path().str()), std::move(result_chan));
+  }
+
+  /// emit a typed event; the value is packed directly, without building a
+  /// msgpack::object
+  template <typename T>
+  void event_emit(const TypedEvent<T> &event,
+                  const typename TypedEvent<T>::value_type &value,
+                  Channel<Result> result_chan) {
+    on_event.push(EventEmit{std::string(event.path().str()),
+                            std::move(result_chan),
+                            detail::encode_msgpack(value)});
+  }
+
+  /// listen to a typed event; events are decoded directly into T
+  template <typename T>
+  void event_listen(const TypedEvent<T> &event, Channel<T> event_chan,
                     Channel<Result> result_chan) {
-    on_command.push(EventListen{std::move(path), std::move(result_chan),
-                                std::move(event_chan)});
+    on_state.push(EventListen{
+        std::string(event.path().str()), std::move(result_chan),
+        std::make_shared<detail::TypedEventSink<T>>(event.path().str(),
+                                                    std::move(event_chan))});
   }
 
   void get(std::string path, Channel<Result> result_chan) {
-    on_command.push(Get{std::move(path), std::move(result_chan)});
+    on_state.push(Get{std::move(path), std::move(result_chan)});
   }
 
   template <typename T>
   void set(std::string path, const T &value, Channel<Result> result_chan) {
     std::unique_ptr<msgpack::zone> z = std::make_unique<msgpack::zone>();
     msgpack::object_handle oh(msgpack::object(value, *z), std::move(z));
-    on_command.push(
-        Set{std::move(path), std::move(result_chan), std::move(oh)});
+    on_state.push(Set{std::move(path), std::move(result_chan), std::move(oh)});
   }
 
-  void test_disconnect() { on_command.push(Disconnect{}); }
+  void test_disconnect() { on_control.push(Disconnect{}); }
+
+  /// set the relative number of messages sent from each lane when there is a
+  /// backlog of outgoing messages; throws std::invalid_argument if any weight
+  /// is zero
+  void set_lane_weights(LaneWeights weights) {
+    detail::check_lane_weights(weights);
+    on_control.push(SetLaneWeights{weights});
+  }
+
+  /// get performance counters for this client; these can be read and reset
+  /// from any thread
+  ClientMetrics &metrics() { return *client_metrics; }
+
+  /// get the recent frames sent and received by this client, which are dumped
+  /// on protocol errors; this can be used and configured from any thread
+  FlightRecorder &flight_recorder() { return *recorder; }
+
+  /// register states under config.prefix, and periodically publish some of
+  /// this client's metrics to them:
+  ///
+  /// - frames_in, frames_out: messages received and sent per second
+  /// - latency_p99_ms: 99th percentile reply latency over all commands
+  /// - in_flight: number of commands waiting for a reply
+  /// - reconnects: total number of reconnections
+  void publish_metrics(SelfMetricsConfig config) {
+    on_control.push(PublishMetrics{std::move(config)});
+  }
+
+  /// get statistics for outgoing messages in a lane; the result can be read
+  /// from any thread
+  const LaneStats &lane_stats(Lane lane) const {
+    switch (lane) {
+    case Lane::Control:
+      return on_control.get_stats();
+    case Lane::Reply:
+      return on_reply.get_stats();
+    case Lane::State:
+      return on_state.get_stats();
+    case Lane::Event:
+      return on_event.get_stats();
+    }
+    throw std::logic_error("invalid lane");
+  }
 
   // disconnect and stop the threads. It's not necessary to call this, but it
   // may help the destructor run faster
@@ -137,12 +355,27 @@ protected:
     const std::chrono::seconds reset_thresh(10);
 
     std::chrono::seconds delay(min_delay);
+    TraceSink::global().set_thread_name("eshet client");
 
     while (true) {
       auto start = clock::now();
-      loop();
+      uint16_t last_connection_id = connection_id;
+      try {
+        loop();
+      } catch (ProtocolError &) {
+        dump_flight_recorder("protocol error");
+        throw;
+      }
       auto end = clock::now();
 
+      // connection_id only changes once connected, so this skips failed
+      // connection attempts
+      if (connection_id != last_connection_id) {
+        ESHET_PROBE1(disconnected, connection_id);
+        if (recorder->config().dump_on_disconnect)
+          dump_flight_recorder("disconnected");
+      }
+
       if ((end - start) >= reset_thresh)
         delay = min_delay;
 
@@ -161,24 +394,53 @@ private:
   // connect, say hello, then loop receiving messages; returns if there was
   // an error, or if we should exit
   void loop() {
+    ESHET_PROBE0(connect_start);
     if (!connect())
       return;
     connection_id++;
+    writer->connect(sockfd, connection_id, shm, uring, timestamps);
     if (!do_hello())
       return;
-    if (!reregister())
+
+    auto reregister_start = clock::now();
+    bool reregistered = reregister();
+    client_metrics->reregister_time_ns +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() -
+                                                             reregister_start)
+            .count();
+    if (!reregistered)
       return;
+    ESHET_PROBE1(connect_done, connection_id);
 
     while (true) {
+      std::optional<time_point> timer = run_timers();
+
       time_point timeout =
           ping_timeout ? std::min(*ping_timeout, idle_timeout) : idle_timeout;
+      bool timer_timeout = false;
+      if (timer && *timer < timeout) {
+        timeout = *timer;
+        timer_timeout = true;
+      }
 
-      switch (wait_until(timeout, ping_result, on_close, on_message, on_reply,
-                         on_command, should_exit)) {
+      switch (spin_wait_until(timeout, ping_result, on_close, on_message,
+                              on_control.channel(), on_reply.channel(),
+                              on_state.channel(), on_event.channel(),
+                              should_exit, publish_result)) {
       case -1: { // timeout
-        if (timeout == idle_timeout) {
-          CommandVisitor{*this}(Ping{ping_result});
-          ping_timeout = clock::now() + timeout_config.ping_timeout;
+        if (timer_timeout) {
+          // handled at the start of the next iteration
+        } else if (timeout == idle_timeout) {
+          // direct replies are sent without going through this thread, so
+          // don't ping if one has been sent since
+          time_point direct_idle =
+              writer->last_sent() + timeout_config.idle_ping;
+          if (direct_idle > clock::now()) {
+            idle_timeout = direct_idle;
+          } else {
+            CommandVisitor{*this}(Ping{ping_result});
+            ping_timeout = clock::now() + timeout_config.ping_timeout;
+          }
         } else { // ping_timeout
           return;
         }
@@ -194,33 +456,58 @@ private:
         return;
       } break;
       case 2: { // on_message
-        unpacker.push(on_message.read());
-
-        std::optional<std::vector<uint8_t>> message;
-        while ((message = unpacker.read())) {
-          handle_message(*message);
-        }
-      } break;
-      case 3: { // on_reply
-        uint16_t call_connection_id;
-        uint16_t id;
-        Result result;
-        std::tie(call_connection_id, id, result) = on_reply.read();
-
-        if (call_connection_id == connection_id) {
-          send_buf.write_reply(id, result);
-          send_send_buf();
-        }
+        handle_messages(on_message.read());
       } break;
-      case 4: { // on_command
-        Command c = on_command.read();
-        std::visit(CommandVisitor{*this}, std::move(c));
+      case 3:   // on_control
+      case 4:   // on_reply
+      case 5:   // on_state
+      case 6: { // on_event
+        send_next_message();
       } break;
-      case 5: { // should_exit
+      case 7: { // should_exit
         return;
       } break;
+      case 8: { // publish_result
+        Result r = publish_result.read();
+        if (std::holds_alternative<Error>(r))
+          log.error(std::string("error while publishing state: ") +
+                    std::get<Error>(r).what());
+      } break;
+      }
+    }
+  }
+
+  // wait_until, but first poll chans without blocking for up to
+  // socket_config.latency.actor_spin
+  template <typename... C>
+  int spin_wait_until(time_point timeout, C &...chans) {
+    auto spin = socket_config.latency.actor_spin;
+    if (spin.count() > 0) {
+      time_point spin_until = std::min(clock::now() + spin, timeout);
+      while (clock::now() < spin_until) {
+        int idx = wait_until(time_point{}, chans...);
+        if (idx != -1)
+          return idx;
+        cpu_relax();
       }
     }
+    return wait_until(timeout, chans...);
+  }
+
+  void dump_flight_recorder(const std::string &reason) {
+    FlightRecorderConfig config = recorder->config();
+    std::string dump = "flight recorder dump after " + reason + ", " +
+                       recorder->dump();
+
+    if (config.dump_path.empty()) {
+      log.error(dump);
+      return;
+    }
+
+    std::ofstream out(config.dump_path, std::ios::app);
+    out << dump;
+    if (!out)
+      log.error("could not write flight recorder dump to " + config.dump_path);
   }
 
   // methods relating to connection setup and teardown
@@ -229,14 +516,52 @@ private:
     cleanup_connection();
 
     try {
-      sockfd = actorpp::connect(hostname, port);
+      if (is_unix_endpoint(hostname))
+        sockfd = detail::connect_unix(unix_endpoint_path(hostname));
+      else if (is_shm_endpoint(hostname)) {
+        sockfd = detail::connect_unix(shm_endpoint_path(hostname));
+        shm = detail::ShmConnection::receive(sockfd);
+      } else
+        sockfd = actorpp::connect(hostname, port);
     } catch (std::runtime_error &e) {
       log.error(e.what());
+      client_metrics->connect_failures++;
       return false;
     }
 
-    recv_thread = std::make_unique<actorpp::ActorThread<actorpp::RecvThread>>(
-        sockfd, on_message, on_close);
+    if (has_connected)
+      client_metrics->reconnects++;
+    has_connected = true;
+
+    const LatencyProfile &latency = socket_config.latency;
+    bool tcp = !shm && !is_unix_endpoint(hostname);
+    if (!shm)
+      for (auto &error : apply_latency_profile(sockfd, latency, tcp))
+        log.error(error);
+
+    std::shared_ptr<UringReactor> reactor;
+    if (!shm && socket_config.backend == SocketBackend::Uring)
+      reactor = UringReactor::get();
+
+    if (!shm && !reactor && socket_config.timestamping) {
+      try {
+        timestamps =
+            std::make_shared<SocketTimestamps>(sockfd, tcp, client_metrics);
+      } catch (std::system_error &e) {
+        log.error(e.what());
+      }
+    }
+
+    if (shm)
+      shm_recv_thread = std::make_unique<ActorThread<ShmRecvThread>>(
+          shm, sockfd, receive_pool, on_message, on_close);
+    else if (reactor)
+      uring = std::make_shared<UringConnection>(
+          std::move(reactor), sockfd, receive_pool, on_message, on_close);
+    else
+      recv_thread = std::make_unique<ActorThread<SocketRecvThread>>(
+          sockfd, receive_pool, latency.recv_spin, tcp && latency.tcp_quickack,
+          timestamps, on_message, on_close);
     return true;
   }
 
@@ -244,25 +569,42 @@ private:
     if (recv_thread) {
       recv_thread.reset();
     }
+    shm_recv_thread.reset();
     if (sockfd != -1) {
+      writer->disconnect();
+      // after the writer has let go, this waits for the kernel to finish with
+      // the socket
+      uring.reset();
+      timestamps.reset();
       if (close(sockfd) != 0)
         throw std::runtime_error("close(sockfd) failed");
       sockfd = -1;
     }
+    shm.reset();
 
     for (auto &pair : reply_channels)
-      std::visit([](auto &c) { c.push(Error("disconnected")); }, pair.second);
+      std::visit([](auto &c) { c.push(Error("disconnected")); },
+                 pair.second.chan);
+    client_metrics->in_flight -= reply_channels.size();
     reply_channels.clear();
 
     for (auto &state : observed_states)
-      state.second.push(Unknown{});
+      deliver(state.second.chan, Unknown{});
+
+    // nothing should be left here, but if it were it would be delivered after
+    // reconnecting, with calls that can't be replied to
+    for (BatchBase *batch : pending_batches)
+      batch->discard();
+    pending_batches.clear();
 
     ping_timeout.reset();
     // make sure to clear this after sending the disconnected messages,
     // otherwise there may still be a disconnect message left over
     ping_result.clear();
+    publish_result.clear();
     on_close.clear();
     on_message.clear();
+    unpacker.clear();
   }
 
   // send and receive hello messages, returns success
@@ -277,8 +619,10 @@ private:
         return false;
       case 1: {
         unpacker.push(on_message.read());
+        if (timestamps)
+          timestamps->pop_rx();
 
-        std::optional<std::vector<uint8_t>> message;
+        std::optional<Frame> message;
         if ((message = unpacker.read())) {
           handle_hello_message(*message);
 
@@ -294,7 +638,7 @@ private:
     }
   }
 
-  void handle_hello_message(const std::vector<uint8_t> &msg) {
+  void handle_hello_message(const Frame &msg) {
     if (msg.size() < 1)
       throw ProtocolError();
 
@@ -322,7 +666,7 @@ private:
       uint16_t id = get_id();
       send_buf.write_action_register(id, path);
       send_send_buf();
-      if (!check_success(id, path))
+      if (!check_success(id, CommandType::ActionRegister, path))
         return false;
     }
 
@@ -331,13 +675,21 @@ private:
       const std::string &path = state.first;
       send_buf.write_state_register(id, path);
       send_send_buf();
-      if (!check_success(id, path))
+      if (!check_success(id, CommandType::StateRegister, path))
         return false;
 
+      // send the latest value, even if it was waiting for min_interval
+      RegisteredState &rs = state.second;
+      if (rs.pending) {
+        rs.published = std::move(*rs.pending);
+        rs.pending.reset();
+      }
+      rs.next_publish = clock::now() + rs.policy.min_interval;
+
       id = get_id();
-      send_buf.write_state_changed(id, path, state.second);
+      send_buf.write_state_changed(id, path, rs.published);
       send_send_buf();
-      if (!check_success(id, path))
+      if (!check_success(id, CommandType::StateChanged, path))
         return false;
     }
 
@@ -346,10 +698,10 @@ private:
       const std::string &path = state.first;
       send_buf.write_state_observe(id, path);
       send_send_buf();
-      auto reply = wait_for_reply<StateResult>(id);
+      auto reply = wait_for_reply<StateResult>(id, CommandType::StateObserve);
       if (!reply)
         return false;
-      if (!std::visit(HandleStateReplyVisitor{*this, path, state.second},
+      if (!std::visit(HandleStateReplyVisitor{*this, path, state.second.chan},
                       std::move(*reply)))
         return false;
     }
@@ -358,7 +710,7 @@ private:
       uint16_t id = get_id();
       send_buf.write_event_register(id, path);
       send_send_buf();
-      if (!check_success(id, path))
+      if (!check_success(id, CommandType::EventRegister, path))
         return false;
     }
 
@@ -367,7 +719,7 @@ private:
       const std::string &path = event.first;
       send_buf.write_event_listen(id, path);
       send_send_buf();
-      if (!check_success(id, path))
+      if (!check_success(id, CommandType::EventListen, path))
         return false;
     }
 
@@ -376,8 +728,8 @@ private:
 
   // wait for a reply message, and check that it is not an error, while
   // processing other messages normally
-  bool check_success(uint16_t id, const std::string &path) {
-    auto reply = wait_for_reply<Result>(id);
+  bool check_success(uint16_t id, CommandType type, const std::string &path) {
+    auto reply = wait_for_reply<Result>(id, type);
     if (reply)
       return std::visit(CheckResultSuccessVisitor{*this, path},
                         std::move(*reply));
@@ -386,9 +738,9 @@ private:
   }
 
   template <typename ResultT>
-  std::optional<ResultT> wait_for_reply(uint16_t id) {
+  std::optional<ResultT> wait_for_reply(uint16_t id, CommandType type) {
     Channel<ResultT> result_chan(*this);
-    reply_channels.emplace(id, result_chan);
+    expect_reply(id, type, result_chan);
 
     while (true) {
       switch (wait(on_close, on_message, result_chan, should_exit)) {
@@ -396,12 +748,7 @@ private:
         on_close.read();
         return {};
       case 1: { // on_message
-        unpacker.push(on_message.read());
-
-        std::optional<std::vector<uint8_t>> message;
-        while ((message = unpacker.read())) {
-          handle_message(*message);
-        }
+        handle_messages(on_message.read());
       } break;
       case 2: { // result_chan
         return result_chan.read();
@@ -431,14 +778,14 @@ private:
 
   struct HandleStateReplyVisitor : public CheckResultBase {
     using CheckResultBase::operator();
-    Channel<StateUpdate> &channel;
+    StateTarget &target;
 
     bool operator()(Known s) {
-      channel.push(std::move(s));
+      c.deliver(target, std::move(s));
       return true;
     }
     bool operator()(Unknown s) {
-      channel.push(std::move(s));
+      c.deliver(target, std::move(s));
       return true;
     }
   };
@@ -451,7 +798,7 @@ private:
     void operator()(ActionCall cmd) {
       uint16_t id = c.get_id();
 
-      c.reply_channels.emplace(id, std::move(cmd.result_chan));
+      c.expect_reply(id, CommandType::ActionCall, std::move(cmd.result_chan));
 
       c.send_buf.write_action_call(id, cmd.path, *cmd.args);
       c.send_send_buf();
@@ -459,9 +806,14 @@ private:
 
     void operator()(ActionRegister cmd) {
       uint16_t id = c.get_id();
-      c.reply_channels.emplace(id, std::move(cmd.result_chan));
+      c.expect_reply(id, CommandType::ActionRegister,
+                     std::move(cmd.result_chan));
+      SubscriberStats &stats =
+          c.client_metrics->subscriber("action:" + cmd.path);
       auto it = c.action_channels
-                    .emplace(std::move(cmd.path), std::move(cmd.call_chan))
+                    .emplace(std::move(cmd.path),
+                             RegisteredAction{std::move(cmd.target),
+                                              std::move(cmd.options), &stats})
                     .first;
 
       c.send_buf.write_action_register(id, it->first);
@@ -470,28 +822,53 @@ private:
 
     void operator()(StateRegister cmd) {
       uint16_t id = c.get_id();
-      c.reply_channels.emplace(id, std::move(cmd.result_chan));
+      c.expect_reply(id, CommandType::StateRegister,
+                     std::move(cmd.result_chan));
       auto it =
-          c.registered_states.emplace(std::move(cmd.path), Unknown{}).first;
+          c.registered_states.emplace(std::move(cmd.path), RegisteredState{})
+              .first;
+      it->second.policy = std::move(cmd.policy);
 
       c.send_buf.write_state_register(id, it->first);
       c.send_send_buf();
     }
 
     void operator()(StateChanged cmd) {
-      uint16_t id = c.get_id();
-      c.reply_channels.emplace(id, std::move(cmd.result_chan));
-      c.registered_states[cmd.path] = std::move(cmd.value);
+      auto it = c.registered_states.find(cmd.path);
+      if (it == c.registered_states.end())
+        it = c.registered_states.emplace(cmd.path, RegisteredState{}).first;
+      RegisteredState &state = it->second;
+
+      if (!detail::should_publish(state.policy, state.published, cmd.value)) {
+        // drop any coalesced value, as we're back to the published value
+        state.pending.reset();
+        cmd.result_chan.push(Success{});
+        return;
+      }
 
-      c.send_buf.write_state_changed(id, cmd.path, cmd.value);
-      c.send_send_buf();
+      auto now = clock::now();
+      if (now < state.next_publish) {
+        if (!state.pending)
+          c.flush_queue.emplace(state.next_publish, it->first);
+        state.pending = std::move(cmd.value);
+        cmd.result_chan.push(Success{});
+        return;
+      }
+
+      uint16_t id = c.get_id();
+      c.expect_reply(id, CommandType::StateChanged, std::move(cmd.result_chan));
+      c.publish_state(id, it->first, state, std::move(cmd.value), now);
     }
 
     void operator()(StateObserve cmd) {
       uint16_t id = c.get_id();
-      c.reply_channels.emplace(id, std::move(cmd.result_chan));
+      c.expect_reply(id, CommandType::StateObserve, std::move(cmd.result_chan));
+      SubscriberStats &stats =
+          c.client_metrics->subscriber("state:" + cmd.path);
       auto it = c.observed_states
-                    .emplace(std::move(cmd.path), std::move(cmd.changed_chan))
+                    .emplace(std::move(cmd.path),
+                             ObservedState{std::move(cmd.changed_chan),
+                                           cmd.options, &stats})
                     .first;
 
       c.send_buf.write_state_observe(id, it->first);
@@ -500,7 +877,8 @@ private:
 
     void operator()(EventRegister cmd) {
       uint16_t id = c.get_id();
-      c.reply_channels.emplace(id, std::move(cmd.result_chan));
+      c.expect_reply(id, CommandType::EventRegister,
+                     std::move(cmd.result_chan));
 
       auto it = c.registered_events.emplace(std::move(cmd.path)).first;
 
@@ -510,18 +888,26 @@ private:
 
     void operator()(EventEmit cmd) {
       uint16_t id = c.get_id();
-      c.reply_channels.emplace(id, std::move(cmd.result_chan));
+      c.expect_reply(id, CommandType::EventEmit, std::move(cmd.result_chan));
 
-      c.send_buf.write_event_emit(id, cmd.path, *cmd.value);
+      if (auto *encoded = std::get_if<std::string>(&cmd.value))
+        c.send_buf.write_event_emit(id, cmd.path, std::string_view(*encoded));
+      else
+        c.send_buf.write_event_emit(
+            id, cmd.path, *std::get<msgpack::object_handle>(cmd.value));
       c.send_send_buf();
     }
 
     void operator()(EventListen cmd) {
       uint16_t id = c.get_id();
-      c.reply_channels.emplace(id, std::move(cmd.result_chan));
+      c.expect_reply(id, CommandType::EventListen, std::move(cmd.result_chan));
 
+      SubscriberStats &stats =
+          c.client_metrics->subscriber("event:" + cmd.path);
       auto it = c.listened_events
-                    .emplace(std::move(cmd.path), std::move(cmd.event_chan))
+                    .emplace(std::move(cmd.path),
+                             ListenedEvent{std::move(cmd.target), cmd.options,
+                                           &stats})
                     .first;
 
       c.send_buf.write_event_listen(id, it->first);
@@ -530,7 +916,7 @@ private:
 
     void operator()(Get cmd) {
       uint16_t id = c.get_id();
-      c.reply_channels.emplace(id, std::move(cmd.result_chan));
+      c.expect_reply(id, CommandType::Get, std::move(cmd.result_chan));
 
       c.send_buf.write_get(id, cmd.path);
       c.send_send_buf();
@@ -538,7 +924,7 @@ private:
 
     void operator()(Set cmd) {
       uint16_t id = c.get_id();
-      c.reply_channels.emplace(id, std::move(cmd.result_chan));
+      c.expect_reply(id, CommandType::Set, std::move(cmd.result_chan));
 
       c.send_buf.write_set(id, cmd.path, *cmd.value);
       c.send_send_buf();
@@ -546,29 +932,231 @@ private:
 
     void operator()(Ping cmd) {
       uint16_t id = c.get_id();
-      c.reply_channels.emplace(id, std::move(cmd.result_chan));
+      c.expect_reply(id, CommandType::Ping, std::move(cmd.result_chan));
 
       c.send_buf.write_ping(id);
       c.send_send_buf();
     }
 
     void operator()(Disconnect d) { c.on_close.push(CloseReason::Error); }
+
+    void operator()(SetLaneWeights cmd) {
+      c.lane_scheduler.set_weights(cmd.weights);
+    }
+
+    void operator()(PublishMetrics cmd) {
+      PublishPolicy policy;
+      policy.dedupe = true;
+      policy.min_interval = cmd.config.interval;
+
+      for (const char *name : self_metrics_names)
+        (*this)(StateRegister{cmd.config.prefix + "/" + name,
+                              c.publish_result, policy});
+
+      c.self_metrics = std::move(cmd.config);
+      c.next_self_metrics = clock::now();
+    }
   };
 
+  // send one message from the lane picked by lane_scheduler
+  void send_next_message() {
+    std::array<bool, num_lanes> ready = {on_control.ready(), on_reply.ready(),
+                                         on_state.ready(), on_event.ready()};
+
+    switch (lane_scheduler.pick(ready)) {
+    case (int)Lane::Control: {
+      std::visit(CommandVisitor{*this}, on_control.read());
+    } break;
+    case (int)Lane::Reply: {
+      uint16_t call_connection_id;
+      uint16_t id;
+      Result result;
+      std::tie(call_connection_id, id, result) = on_reply.read();
+
+      if (call_connection_id == connection_id) {
+        send_buf.write_reply(id, result);
+        send_send_buf();
+      }
+    } break;
+    case (int)Lane::State: {
+      std::visit(CommandVisitor{*this}, on_state.read());
+    } break;
+    case (int)Lane::Event: {
+      std::visit(CommandVisitor{*this}, on_event.read());
+    } break;
+    }
+  }
+
   uint16_t get_id() { return next_id++; }
 
+  // send the reply to command id to chan when it arrives
+  template <typename ChannelT>
+  void expect_reply(uint16_t id, CommandType type, ChannelT chan) {
+    // if id is still in use the old reply channel is kept, so only count
+    // replies which were actually added
+    if (reply_channels
+            .emplace(id, PendingReply{std::move(chan), type, clock::now()})
+            .second)
+      client_metrics->in_flight++;
+  }
+
+  // state publishing; registered_states holds the last value sent to the
+  // server, and the latest value if it is being held back by min_interval
+  struct RegisteredState {
+    StateUpdate published = Unknown{};
+    std::optional<StateUpdate> pending;
+    PublishPolicy policy;
+    time_point next_publish;
+  };
+
+  void publish_state(uint16_t id, const std::string &path,
+                     RegisteredState &state, StateUpdate value,
+                     time_point now) {
+    state.published = std::move(value);
+    state.pending.reset();
+    state.next_publish = now + state.policy.min_interval;
+
+    send_buf.write_state_changed(id, path, state.published);
+    send_send_buf();
+  }
+
+  // run anything scheduled for now or earlier, and return the time that the
+  // next thing is scheduled for
+  std::optional<time_point> run_timers() {
+    if (flush_queue.empty() && !self_metrics)
+      return std::nullopt;
+
+    auto now = clock::now();
+    if (self_metrics && next_self_metrics <= now)
+      publish_self_metrics(now);
+    if (!flush_queue.empty() && flush_queue.begin()->first <= now)
+      flush_states();
+
+    std::optional<time_point> next;
+    if (self_metrics)
+      next = next_self_metrics;
+    if (!flush_queue.empty() && (!next || flush_queue.begin()->first < *next))
+      next = flush_queue.begin()->first;
+    return next;
+  }
+
+  static constexpr const char *self_metrics_names[] = {
+      "frames_in", "frames_out", "latency_p99_ms", "in_flight", "reconnects"};
+
+  void publish_self_metrics(time_point now) {
+    MetricsSnapshot snapshot = client_metrics->snapshot();
+
+    HistogramSnapshot latency;
+    for (auto &h : snapshot.latency_ns)
+      latency.add(h);
+
+    double seconds =
+        std::chrono::duration<double>(now - last_self_metrics_time).count();
+    auto rate = [&](uint64_t count, uint64_t last) {
+      return count >= last ? (count - last) / seconds : 0.0;
+    };
+
+    double values[] = {
+        rate(snapshot.frames_in, last_self_metrics.frames_in),
+        rate(snapshot.frames_out, last_self_metrics.frames_out),
+        latency.since(last_self_metrics_latency).percentile(99) / 1e6,
+        (double)snapshot.in_flight,
+        (double)snapshot.reconnects,
+    };
+
+    // the first call just takes a baseline
+    if (last_self_metrics_time != time_point{}) {
+      for (size_t i = 0; i < std::size(values); i++)
+        CommandVisitor{*this}(
+            StateChanged{self_metrics->prefix + "/" + self_metrics_names[i],
+                         publish_result, Known(values[i])});
+    }
+
+    last_self_metrics = std::move(snapshot);
+    last_self_metrics_latency = latency;
+    last_self_metrics_time = now;
+    next_self_metrics = now + self_metrics->interval;
+  }
+
+  // publish coalesced values whose min_interval has expired
+  void flush_states() {
+    auto now = clock::now();
+    while (!flush_queue.empty() && flush_queue.begin()->first <= now) {
+      auto nh = flush_queue.extract(flush_queue.begin());
+
+      auto it = registered_states.find(nh.mapped());
+      if (it == registered_states.end() || !it->second.pending)
+        continue;
+
+      uint16_t id = get_id();
+      expect_reply(id, CommandType::StateChanged, publish_result);
+      publish_state(id, it->first, it->second, std::move(*it->second.pending),
+                    now);
+    }
+  }
+
+  // the id of the message in send_buf, or -1 for hello messages which don't
+  // have one
+  int send_buf_id() const {
+    const uint8_t *data = (const uint8_t *)send_buf.sbuf.data();
+    if (data[3] == 0x01 || data[3] == 0x02 || send_buf.sbuf.size() < 6)
+      return -1;
+    return (data[4] << 8) | data[5];
+  }
+
   void send_send_buf() {
     idle_timeout = clock::now() + timeout_config.idle_ping;
-    if (send(sockfd, send_buf.sbuf.data(), send_buf.sbuf.size(), MSG_NOSIGNAL) <
-        0)
-      throw Disconnected{};
+    ESHET_PROBE3(send, (uint8_t)send_buf.sbuf.data()[3], send_buf_id(),
+                 send_buf.sbuf.size());
+    writer->send(send_buf.sbuf.data(), send_buf.sbuf.size());
   }
 
   // methods for handling incoming messages
 
-  void handle_message(const std::vector<uint8_t> &msg) {
+  // flushes pending batches when it goes out of scope, including when
+  // handling a message throws, so that values received before the error are
+  // delivered before the connection is cleaned up
+  struct FlushBatches {
+    std::vector<BatchBase *> &batches;
+    ~FlushBatches() {
+      for (BatchBase *batch : batches)
+        batch->flush();
+      batches.clear();
+    }
+  };
+
+  // handle all complete messages after receiving some data; values for batch
+  // channels are pushed after all messages have been handled
+  void handle_messages(BufferRef data) {
+    FlushBatches flush{pending_batches};
+    client_metrics->bytes_in.fetch_add(data.size(), std::memory_order_relaxed);
+    unpacker.push(std::move(data));
+    // frames completed by this data were received when it was
+    rx_time.reset();
+    if (timestamps)
+      rx_time = timestamps->pop_rx();
+
+    std::optional<Frame> message;
+    while ((message = unpacker.read())) {
+      client_metrics->frames_in.fetch_add(1, std::memory_order_relaxed);
+      if (rx_time) {
+        auto delay = std::chrono::system_clock::now() - *rx_time;
+        client_metrics->rx_delay_ns.record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(delay)
+                .count());
+      }
+      recorder->record(FrameDirection::In, message->data(), message->size());
+      handle_message(*message);
+    }
+  }
+
+  void handle_message(const Frame &msg) {
     if (msg.size() < 1)
       throw ProtocolError();
+    ESHET_PROBE2(message, msg[0], msg.size());
+    bool is_reply = msg[0] >= 0x05 && msg[0] <= 0x0b;
+    detail::TraceSpan span(is_reply ? "reply parse" : "dispatch", "dispatch",
+                           "type", msg[0]);
 
     switch (msg[0]) {
     case 0x03:
@@ -596,7 +1184,7 @@ private:
       uint16_t id = p.read16();
       msgpack::object_handle oh = p.read_msgpack();
       p.check_empty();
-      handle_reply(id, Known(std::move(oh)));
+      handle_reply(id, received(Known(std::move(oh))));
     } break;
     case 0x08: {
       // {reply_state, Id, unknown}
@@ -612,7 +1200,7 @@ private:
       uint32_t t = p.read32();
       msgpack::object_handle oh = p.read_msgpack();
       p.check_empty();
-      handle_reply(id, Known(std::move(oh), Time{t}));
+      handle_reply(id, received(Known(std::move(oh), Time{t})));
     } break;
     case 0x0b: {
       // {reply_state, Id, unknown, T}
@@ -627,67 +1215,202 @@ private:
       Parser p(&msg[1], msg.size() - 1);
       uint16_t id = p.read16();
       std::string path = p.read_string();
-      msgpack::object_handle oh = p.read_msgpack();
-      p.check_empty();
+      ESHET_PROBE2(deliver, msg[0], path.c_str());
 
       auto it = action_channels.find(path);
       if (it == action_channels.end())
         // missing callback
         throw ProtocolError();
 
-      it->second.emplace(connection_id, id, std::move(oh), on_reply);
+      RegisteredAction &action = it->second;
+      action.stats->delivered.fetch_add(1, std::memory_order_relaxed);
+      std::shared_ptr<DirectReplier> direct_replier;
+      if (action.options.direct_reply)
+        direct_replier = writer;
+
+      if (auto *lazy = std::get_if<Channel<LazyCall>>(&action.target)) {
+        ReplyHandle handle(connection_id, id, on_reply,
+                           std::move(direct_replier));
+        lazy->push(LazyCall(std::move(handle), read_lazy(p, msg)));
+      } else {
+        msgpack::object_handle oh =
+            read_value(p, msg, action.options.zero_copy);
+        std::visit(
+            [&](auto &target) {
+              deliver(target, Call(connection_id, id, std::move(oh), on_reply,
+                                   std::move(direct_replier)));
+            },
+            action.target);
+      }
+      p.check_empty();
     } break;
     case 0x33: {
       // {event_notify, Path, Msg}
       Parser p(&msg[1], msg.size() - 1);
       std::string path = p.read_string();
-      msgpack::object_handle oh = p.read_msgpack();
-      p.check_empty();
+      ESHET_PROBE2(deliver, msg[0], path.c_str());
 
       auto it = listened_events.find(path);
       if (it == listened_events.end())
         // unknown event
         throw ProtocolError();
 
-      it->second.emplace(std::move(oh));
+      ListenedEvent &event = it->second;
+      event.stats->delivered.fetch_add(1, std::memory_order_relaxed);
+      if (auto *lazy = std::get_if<Channel<LazyValue>>(&event.target)) {
+        lazy->push(read_lazy(p, msg));
+      } else if (auto *typed =
+                     std::get_if<std::shared_ptr<TypedSink>>(&event.target)) {
+        std::string_view raw = p.read_rest();
+        deliver_typed(**typed, [&](TypedSink &sink) {
+          sink.deliver(raw.data(), raw.size());
+        });
+      } else {
+        msgpack::object_handle oh = read_value(p, msg, event.options.zero_copy);
+        std::visit([&](auto &target) { deliver(target, std::move(oh)); },
+                   event.target);
+      }
+      p.check_empty();
     } break;
     case 0x44: {
       // {state_changed, Path, {known, State}}
       Parser p(&msg[1], msg.size() - 1);
       std::string path = p.read_string();
-      msgpack::object_handle oh = p.read_msgpack();
-      p.check_empty();
+      ESHET_PROBE2(deliver, msg[0], path.c_str());
 
       auto it = observed_states.find(path);
       if (it == observed_states.end())
         // unknown state
         throw ProtocolError();
 
-      it->second.emplace(Known(std::move(oh)));
+      ObservedState &state = it->second;
+      state.stats->delivered.fetch_add(1, std::memory_order_relaxed);
+      if (auto *lazy = std::get_if<Channel<LazyStateUpdate>>(&state.chan)) {
+        lazy->push(LazyKnown{read_lazy(p, msg), Time{0}, rx_time});
+      } else if (auto *typed =
+                     std::get_if<std::shared_ptr<TypedSink>>(&state.chan)) {
+        std::string_view raw = p.read_rest();
+        deliver_typed(**typed, [&](TypedSink &sink) {
+          sink.deliver(raw.data(), raw.size());
+        });
+      } else {
+        msgpack::object_handle oh = read_value(p, msg, state.options.zero_copy);
+        deliver(state.chan, received(Known(std::move(oh))));
+      }
+      p.check_empty();
     } break;
     case 0x45: {
       // {state_changed, Path, unknown}
       Parser p(&msg[1], msg.size() - 1);
       std::string path = p.read_string();
       p.check_empty();
+      ESHET_PROBE2(deliver, msg[0], path.c_str());
 
       auto it = observed_states.find(path);
       if (it == observed_states.end())
         // unknown state
         throw ProtocolError();
 
-      it->second.emplace(Unknown());
+      it->second.stats->delivered.fetch_add(1, std::memory_order_relaxed);
+      deliver(it->second.chan, Unknown());
     } break;
     }
   }
 
+  // read the msgpack value at the end of msg, referring to its buffer if
+  // zero_copy is set
+  static msgpack::object_handle read_value(Parser &p, const Frame &msg,
+                                           bool zero_copy) {
+    return zero_copy ? p.read_msgpack_ref(msg.buf) : p.read_msgpack();
+  }
+
+  // check the msgpack value at the end of msg, without unpacking it
+  static LazyValue read_lazy(Parser &p, const Frame &msg) {
+    return LazyValue(msg.buf, p.read_msgpack_raw());
+  }
+
+  // set the receive timestamp of a value from the current frame
+  Known received(Known known) {
+    known.rx_time = rx_time;
+    return known;
+  }
+
+  void deliver(Channel<TimestampedEvent> &chan, msgpack::object_handle value) {
+    chan.push(TimestampedEvent{std::move(value), rx_time});
+  }
+
+  template <typename T> void deliver(Channel<T> &chan, T value) {
+    chan.push(std::move(value));
+  }
+
+  // values which were unpacked anyway (e.g. the initial state sent when
+  // re-observing after a reconnection) can still go to lazy targets
+
+  void deliver(Channel<LazyValue> &chan, msgpack::object_handle value) {
+    chan.push(LazyValue(std::move(value)));
+  }
+
+  void deliver(Channel<LazyCall> &chan, Call call) {
+    LazyValue args(std::move(call.value));
+    chan.push(LazyCall(std::move(call), std::move(args)));
+  }
+
+  void deliver(Channel<LazyStateUpdate> &chan, StateUpdate update) {
+    if (Known *known = std::get_if<Known>(&update))
+      chan.push(LazyKnown{LazyValue(std::move(known->value)),
+                          known->t_since_change, known->rx_time});
+    else
+      chan.push(std::get<Unknown>(update));
+  }
+
+  void deliver(std::shared_ptr<TypedSink> &sink, msgpack::object_handle value) {
+    deliver_typed(*sink, [&](TypedSink &s) { s.deliver(value.get()); });
+  }
+
+  void deliver(std::shared_ptr<TypedSink> &sink, StateUpdate update) {
+    if (Known *known = std::get_if<Known>(&update))
+      deliver_typed(*sink,
+                    [&](TypedSink &s) { s.deliver(known->value.get()); });
+    else
+      sink->unknown();
+  }
+
+  // pass a value to a typed subscription with f, logging and dropping values
+  // which don't match its type rather than failing
+  template <typename F> void deliver_typed(TypedSink &sink, F f) {
+    try {
+      f(sink);
+    } catch (msgpack::type_error &) {
+      log.error("received value does not match the type of " + sink.path);
+    }
+  }
+
+  void deliver(StateTarget &target, StateUpdate update) {
+    std::visit([&](auto &chan) { deliver(chan, std::move(update)); }, target);
+  }
+
+  template <typename T> void deliver(BatchChannel<T> &batch, T value) {
+    if (batch.add(std::move(value)))
+      pending_batches.push_back(&batch);
+  }
+
+  void deliver(std::shared_ptr<ActionDispatcher> &dispatcher, Call call) {
+    dispatcher->dispatch(std::move(call));
+  }
+
   void handle_reply(uint16_t id, AnyResult result) {
+    ESHET_PROBE1(reply, id);
     auto it = reply_channels.find(id);
     if (it == reply_channels.end())
       // missing callback
       throw ProtocolError();
 
     auto nh = reply_channels.extract(it);
+    PendingReply &pending = nh.mapped();
+    client_metrics->record_latency(pending.type, clock::now() - pending.sent);
+    client_metrics->in_flight--;
+
+    detail::TraceSpan span("result push", "result", "id", id);
     if (!std::visit(
             [&](auto &cb) {
               using T =
@@ -696,7 +1419,7 @@ private:
                   std::move(result),
                   [&](T result_t) { return cb.push(std::move(result_t)); });
             },
-            nh.mapped()))
+            pending.chan))
       // wrong type of return
       throw ProtocolError();
   }
@@ -705,35 +1428,92 @@ private:
   int port;
   std::optional<msgpack::object_handle> id;
   TimeoutConfig timeout_config;
+  SocketConfig socket_config;
+  std::shared_ptr<ClientMetrics> client_metrics =
+      std::make_shared<ClientMetrics>();
+  std::shared_ptr<FlightRecorder> recorder =
+      std::make_shared<FlightRecorder>();
 
   std::optional<time_point> ping_timeout;
   time_point idle_timeout;
   Channel<Result> ping_result;
+  Channel<Result> publish_result;
 
   Logger log;
 
   Channel<bool> should_exit;
 
   int sockfd = -1;
-  Channel<std::vector<uint8_t>> on_message;
+  std::shared_ptr<SocketWriter> writer =
+      std::make_shared<SocketWriter>(client_metrics, recorder);
+  /// receive buffers, which are shared by the receive thread, and the
+  /// messages and values which refer to them
+  std::shared_ptr<BufferPool> receive_pool = std::make_shared<BufferPool>(
+      socket_config.receive_buffers, client_metrics->receive_buffers);
+  Channel<BufferRef> on_message;
   Channel<CloseReason> on_close;
-  std::unique_ptr<ActorThread<RecvThread>> recv_thread;
+  std::unique_ptr<ActorThread<SocketRecvThread>> recv_thread;
+  /// set instead of recv_thread for shared memory connections
+  std::shared_ptr<ShmConnection> shm;
+  std::unique_ptr<ActorThread<ShmRecvThread>> shm_recv_thread;
+  /// set with SocketConfig::timestamping
+  std::shared_ptr<SocketTimestamps> timestamps;
+  /// receive timestamp of the frames being handled
+  std::optional<Timestamp> rx_time;
+  /// set instead of recv_thread when using io_uring
+  std::shared_ptr<UringConnection> uring;
   uint16_t connection_id = 0;
+  bool has_connected = false;
 
-  Unpacker unpacker;
+  Unpacker unpacker{receive_pool};
 
   using ReplyChannel = std::variant<Channel<Result>, Channel<StateResult>>;
-  std::map<uint16_t, ReplyChannel> reply_channels;
-  std::map<std::string, Channel<Call>> action_channels;
+  struct PendingReply {
+    ReplyChannel chan;
+    CommandType type;
+    time_point sent;
+  };
+  std::map<uint16_t, PendingReply> reply_channels;
 
-  std::map<std::string, StateUpdate> registered_states;
-  std::map<std::string, Channel<StateUpdate>> observed_states;
+  struct RegisteredAction {
+    ActionTarget target;
+    ActionOptions options;
+    SubscriberStats *stats;
+  };
+  std::map<std::string, RegisteredAction> action_channels;
+
+  std::map<std::string, RegisteredState> registered_states;
+  std::multimap<time_point, std::string> flush_queue;
+
+  std::optional<SelfMetricsConfig> self_metrics;
+  time_point next_self_metrics;
+  MetricsSnapshot last_self_metrics;
+  HistogramSnapshot last_self_metrics_latency;
+  time_point last_self_metrics_time;
+  struct ObservedState {
+    StateTarget chan;
+    SubscribeOptions options;
+    SubscriberStats *stats;
+  };
+  std::map<std::string, ObservedState> observed_states;
 
   std::set<std::string> registered_events;
-  std::map<std::string, Channel<msgpack::object_handle>> listened_events;
+  struct ListenedEvent {
+    EventTarget target;
+    SubscribeOptions options;
+    SubscriberStats *stats;
+  };
+  std::map<std::string, ListenedEvent> listened_events;
+
+  // batches with values which need flushing at the end of handle_messages
+  std::vector<BatchBase *> pending_batches;
 
-  Channel<Command> on_command;
-  Channel<std::tuple<uint16_t, uint16_t, Result>> on_reply;
+  // outgoing messages, one channel per Lane
+  CountedChannel<Command> on_control;
+  CallReplyChannel on_reply;
+  CountedChannel<Command> on_state;
+  CountedChannel<Command> on_event;
+  LaneScheduler lane_scheduler;
 
   SendBuf send_buf;
   uint16_t next_id = 0;
@@ -0,0 +1,109 @@
+#pragma once
+#include "data.hpp"
+#include "thread_pool.hpp"
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+namespace eshet {
+
+/// options for registered actions
+struct ActionOptions {
+  /// for actions handled on a ThreadPool, the maximum number of calls to this
+  /// action which can run at once
+  size_t max_concurrency = 1;
+  /// for actions handled on a ThreadPool, the maximum number of calls waiting
+  /// to run; further calls are rejected with an error
+  size_t max_queued = 64;
+  /// send replies directly from the thread calling Call::reply, rather than
+  /// passing them to the client thread; this saves a thread hop, but
+  /// Call::reply may block if the socket is busy
+  bool direct_reply = false;
+  /// decode call arguments without copying their strings, binaries and
+  /// extensions, as in SubscribeOptions::zero_copy
+  bool zero_copy = false;
+};
+
+/// handles a call to an action, returning the result to send back to the
+/// caller; exceptions are converted to errors
+using ActionHandler = std::function<Result(Call &)>;
+
+namespace detail {
+
+/// runs calls to one action on a ThreadPool, limiting the number running at
+/// once and the number waiting
+class ActionDispatcher
+    : public std::enable_shared_from_this<ActionDispatcher> {
+public:
+  ActionDispatcher(ThreadPool &pool, ActionHandler handler,
+                   ActionOptions options)
+      : pool(pool), handler(std::move(handler)), options(std::move(options)) {}
+
+  // called from the client thread for each incoming call
+  void dispatch(Call call) {
+    std::unique_lock<std::mutex> lock(mut);
+    if (running >= options.max_concurrency &&
+        queue.size() >= options.max_queued) {
+      lock.unlock();
+      call.reply(Error("busy"));
+      return;
+    }
+
+    queue.push_back(std::move(call));
+    if (running < options.max_concurrency) {
+      running++;
+      lock.unlock();
+      submit();
+    }
+  }
+
+private:
+  void submit() {
+    pool.submit([self = shared_from_this()]() { self->run_one(); });
+  }
+
+  // run the call at the front of the queue, then either resubmit to run the
+  // next one, or release the slot; resubmitting rather than looping lets
+  // calls to other actions share the pool fairly
+  void run_one() {
+    std::unique_lock<std::mutex> lock(mut);
+    Call call = std::move(queue.front());
+    queue.pop_front();
+    lock.unlock();
+
+    call.reply(run_handler(call));
+
+    lock.lock();
+    if (queue.empty()) {
+      running--;
+    } else {
+      lock.unlock();
+      submit();
+    }
+  }
+
+  Result run_handler(Call &call) {
+    try {
+      return handler(call);
+    } catch (Error &e) {
+      return std::move(e);
+    } catch (std::exception &e) {
+      return Error(oh_with_zone(std::string(e.what())));
+    } catch (...) {
+      // anything escaping a worker would terminate the process
+      return Error(oh_with_zone(std::string("unknown exception")));
+    }
+  }
+
+  ThreadPool &pool;
+  ActionHandler handler;
+  ActionOptions options;
+
+  std::mutex mut;
+  std::deque<Call> queue;
+  size_t running = 0;
+};
+
+} // namespace detail
+} // namespace eshet
@@ -0,0 +1,57 @@
+#pragma once
+#include "actorpp/actor.hpp"
+#include <vector>
+
+namespace eshet {
+namespace detail {
+using namespace actorpp;
+
+struct BatchBase {
+  virtual void flush() = 0;
+  virtual void discard() = 0;
+  virtual ~BatchBase() {}
+};
+
+/// collects values which are pushed to a channel together when flush is
+/// called, so that the receiver is woken once per batch rather than once per
+/// value
+template <typename T> class BatchChannel : public BatchBase {
+public:
+  explicit BatchChannel(Channel<std::vector<T>> chan) : chan(std::move(chan)) {}
+
+  // copies share the channel, but not the pending values, which may not be
+  // copyable
+  BatchChannel(const BatchChannel &other) : chan(other.chan) {}
+  BatchChannel &operator=(const BatchChannel &other) {
+    chan = other.chan;
+    pending.clear();
+    return *this;
+  }
+
+  /// add a value to the batch; returns true if it was previously empty, in
+  /// which case flush must be called later
+  bool add(T value) {
+    pending.push_back(std::move(value));
+    return pending.size() == 1;
+  }
+
+  void flush() override {
+    if (pending.empty())
+      return;
+
+    size_t size = pending.size();
+    chan.push(std::move(pending));
+    pending = std::vector<T>();
+    pending.reserve(size);
+  }
+
+  /// drop any values which have been added but not flushed
+  void discard() override { pending.clear(); }
+
+private:
+  Channel<std::vector<T>> chan;
+  std::vector<T> pending;
+};
+
+} // namespace detail
+} // namespace eshet
@@ -0,0 +1,192 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace eshet {
+
+/// sizing of the pool of buffers which a client receives into
+struct BufferPoolConfig {
+  /// size of each buffer, which limits how much is read from the socket at
+  /// once
+  size_t buffer_size = 16384;
+  /// number of buffers; when all are in use (for example because received
+  /// values still refer to them), more are allocated individually
+  size_t buffers = 64;
+};
+
+/// BufferPool counters, which can be read from any thread
+struct BufferPoolStats {
+  /// total number of buffers handed out
+  std::atomic<uint64_t> acquired{0};
+  /// buffers currently referenced
+  std::atomic<uint64_t> in_use{0};
+  /// maximum of in_use since the stats were created or reset
+  std::atomic<uint64_t> high_water{0};
+  /// buffers allocated individually, because the pool was empty or a larger
+  /// buffer was needed
+  std::atomic<uint64_t> overflows{0};
+};
+
+class BufferPool;
+
+namespace detail {
+struct PooledBuffer {
+  explicit PooledBuffer(size_t capacity, bool pooled)
+      : capacity(capacity), pooled(pooled), data(new uint8_t[capacity]) {}
+
+  std::atomic<uint32_t> refs{0};
+  size_t size = 0;
+  const size_t capacity;
+  /// false for buffers which were allocated individually, and are deleted
+  /// rather than returned to the pool
+  const bool pooled;
+  std::unique_ptr<uint8_t[]> data;
+  /// set while the buffer is in use, so that it keeps the pool alive; null
+  /// for buffers which don't belong to a pool
+  std::shared_ptr<BufferPool> pool;
+};
+} // namespace detail
+
+/// a reference-counted handle to a buffer of received data
+///
+/// Copies refer to the same buffer, which goes back to its pool when the last
+/// one is destroyed. A buffer must not be modified once it has been shared.
+class BufferRef {
+public:
+  BufferRef() {}
+  explicit BufferRef(detail::PooledBuffer *buf) : buf(buf) {
+    if (buf)
+      buf->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+  BufferRef(const BufferRef &other) : BufferRef(other.buf) {}
+  BufferRef(BufferRef &&other) : buf(other.buf) { other.buf = nullptr; }
+  BufferRef &operator=(BufferRef other) {
+    std::swap(buf, other.buf);
+    return *this;
+  }
+  ~BufferRef() { release(); }
+
+  /// an empty buffer which doesn't belong to a pool
+  static BufferRef allocate(size_t capacity) {
+    return BufferRef(new detail::PooledBuffer(capacity, false));
+  }
+
+  /// a buffer which doesn't belong to a pool, containing a copy of data
+  static BufferRef copy_of(const uint8_t *data, size_t size) {
+    BufferRef ref = allocate(size);
+    if (size)
+      memcpy(ref.data(), data, size);
+    ref.resize(size);
+    return ref;
+  }
+
+  explicit operator bool() const { return buf != nullptr; }
+
+  uint8_t *data() const { return buf->data.get(); }
+  size_t size() const { return buf ? buf->size : 0; }
+  size_t capacity() const { return buf->capacity; }
+  /// set the amount of valid data, which must be at most capacity()
+  void resize(size_t size) { buf->size = size; }
+
+private:
+  inline void release();
+
+  detail::PooledBuffer *buf = nullptr;
+};
+
+/// a fixed number of fixed-size buffers, which are reused once the last
+/// BufferRef to them is gone; this can be used from any thread
+///
+/// This must be held in a shared_ptr; buffers which are in use keep it alive.
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+public:
+  explicit BufferPool(BufferPoolConfig config = {},
+                      std::shared_ptr<BufferPoolStats> stats =
+                          std::make_shared<BufferPoolStats>())
+      : pool_config(config), pool_stats(std::move(stats)) {
+    buffers.reserve(pool_config.buffers);
+    free_buffers.reserve(pool_config.buffers);
+    for (size_t i = 0; i < pool_config.buffers; i++) {
+      buffers.push_back(std::make_unique<detail::PooledBuffer>(
+          pool_config.buffer_size, true));
+      free_buffers.push_back(buffers.back().get());
+    }
+  }
+
+  /// get an empty buffer with a capacity of at least min_size, or
+  /// config().buffer_size if that is larger
+  BufferRef acquire(size_t min_size = 0) {
+    detail::PooledBuffer *buf = nullptr;
+    if (min_size <= pool_config.buffer_size) {
+      std::lock_guard<std::mutex> guard(mut);
+      if (!free_buffers.empty()) {
+        buf = free_buffers.back();
+        free_buffers.pop_back();
+      }
+    }
+    if (!buf) {
+      buf = new detail::PooledBuffer(
+          std::max(min_size, pool_config.buffer_size), false);
+      pool_stats->overflows.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    buf->size = 0;
+    buf->pool = shared_from_this();
+
+    BufferPoolStats &stats = *pool_stats;
+    stats.acquired.fetch_add(1, std::memory_order_relaxed);
+    uint64_t in_use = stats.in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+    uint64_t high_water = stats.high_water.load(std::memory_order_relaxed);
+    while (in_use > high_water &&
+           !stats.high_water.compare_exchange_weak(high_water, in_use,
+                                                   std::memory_order_relaxed))
+      ;
+
+    return BufferRef(buf);
+  }
+
+  const BufferPoolConfig &config() const { return pool_config; }
+  const BufferPoolStats &stats() const { return *pool_stats; }
+
+private:
+  friend class BufferRef;
+
+  // called when the last reference to buf is gone
+  void recycle(detail::PooledBuffer *buf) {
+    pool_stats->in_use.fetch_sub(1, std::memory_order_relaxed);
+    if (!buf->pooled) {
+      delete buf;
+      return;
+    }
+    std::lock_guard<std::mutex> guard(mut);
+    free_buffers.push_back(buf);
+  }
+
+  BufferPoolConfig pool_config;
+  std::shared_ptr<BufferPoolStats> pool_stats;
+
+  std::vector<std::unique_ptr<detail::PooledBuffer>> buffers;
+  std::mutex mut;
+  std::vector<detail::PooledBuffer *> free_buffers;
+};
+
+void BufferRef::release() {
+  if (!buf || buf->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    return;
+
+  // this may be the last reference to the pool, so keep it alive until
+  // recycle has returned
+  std::shared_ptr<BufferPool> pool = std::move(buf->pool);
+  if (pool)
+    pool->recycle(buf);
+  else
+    delete buf;
+  buf = nullptr;
+}
+
+} // namespace eshet
@@ -1,7 +1,12 @@
 #pragma once
+#include "action_dispatcher.hpp"
 #include "actorpp/actor.hpp"
+#include "batch.hpp"
 #include "data.hpp"
+#include "metrics.hpp"
 #include "msgpack.hpp"
+#include "publish_policy.hpp"
+#include "typed.hpp"
 
 namespace eshet {
 namespace detail {
@@ -13,15 +18,22 @@ struct ActionCall {
   msgpack::object_handle args;
 };
 
+/// where calls to a registered action are sent
+using ActionTarget = std::variant<Channel<Call>, BatchChannel<Call>,
+                                  std::shared_ptr<ActionDispatcher>,
+                                  Channel<LazyCall>>;
+
 struct ActionRegister {
   std::string path;
   Channel<Result> result_chan;
-  Channel<Call> call_chan;
+  ActionTarget target;
+  ActionOptions options;
 };
 
 struct StateRegister {
   std::string path;
   Channel<Result> result_chan;
+  PublishPolicy policy;
 };
 
 struct StateChanged {
@@ -30,10 +42,15 @@ struct StateChanged {
   StateUpdate value;
 };
 
+/// where changes to an observed state are sent
+using StateTarget = std::variant<Channel<StateUpdate>, Channel<LazyStateUpdate>,
+                                 std::shared_ptr<TypedSink>>;
+
 struct StateObserve {
   std::string path;
   Channel<StateResult> result_chan;
-  Channel<StateUpdate> changed_chan;
+  StateTarget changed_chan;
+  SubscribeOptions options;
 };
 
 struct EventRegister {
@@ -44,13 +61,21 @@ struct EventRegister {
 struct EventEmit {
   std::string path;
   Channel<Result> result_chan;
-  msgpack::object_handle value;
+  /// the value, or its encoding for values which were packed directly
+  std::variant<msgpack::object_handle, std::string> value;
 };
 
+/// where events for a listened path are sent
+using EventTarget = std::variant<Channel<msgpack::object_handle>,
+                                 BatchChannel<msgpack::object_handle>,
+                                 Channel<TimestampedEvent>, Channel<LazyValue>,
+                                 std::shared_ptr<TypedSink>>;
+
 struct EventListen {
   std::string path;
   Channel<Result> result_chan;
-  Channel<msgpack::object_handle> event_chan;
+  EventTarget target;
+  SubscribeOptions options;
 };
 
 struct Get {
@@ -70,9 +95,17 @@ struct Ping {
 
 struct Disconnect {};
 
+struct SetLaneWeights {
+  LaneWeights weights;
+};
+
+struct PublishMetrics {
+  SelfMetricsConfig config;
+};
+
 using Command =
     std::variant<ActionCall, ActionRegister, StateRegister, StateChanged,
                  StateObserve, EventRegister, EventEmit, EventListen, Get, Set,
-                 Ping, Disconnect>;
+                 Ping, Disconnect, SetLaneWeights, PublishMetrics>;
 } // namespace detail
 } // namespace eshet
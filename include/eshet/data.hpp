@@ -1,8 +1,12 @@
 #pragma once
 #include "actorpp/actor.hpp"
+#include "eshet/lanes.hpp"
+#include "eshet/lazy_value.hpp"
 #include "eshet/msgpack_to_string.hpp"
 #include "msgpack.hpp"
+#include <chrono>
 #include <functional>
+#include <optional>
 #include <variant>
 
 namespace eshet {
@@ -10,6 +14,11 @@ using namespace actorpp;
 
 using Time = std::chrono::duration<uint32_t, std::milli>;
 
+/// a kernel software timestamp, from CLOCK_REALTIME; see
+/// SocketConfig::timestamping
+using Timestamp = std::chrono::time_point<std::chrono::system_clock,
+                                          std::chrono::nanoseconds>;
+
 /// convert an arbitrary value to an object_handle with a zone; this is
 /// required if T corresponds to MessegePack format str, bin, ext, array, or
 /// map. We should avoid using this automatically as it results in an
@@ -87,6 +96,9 @@ struct Known : public HasMsgpackObject<Known> {
 
   static constexpr const char *name = "Known";
   Time t_since_change;
+  /// when the frame carrying this value was received by the kernel, if
+  /// SocketConfig::timestamping is enabled
+  std::optional<Timestamp> rx_time;
 };
 
 struct Unknown {
@@ -103,22 +115,99 @@ using StateUpdate = std::variant<Known, Unknown>;
 
 using AnyResult = std::variant<Success, Known, Unknown, Error>;
 
-struct Call : public HasMsgpackObject<Call> {
-  static constexpr const char *name = "Call";
+/// channel carrying action call replies back to the client; contains the
+/// connection ID, call ID and result
+using CallReplyChannel =
+    detail::CountedChannel<std::tuple<uint16_t, uint16_t, Result>>;
+
+namespace detail {
+/// sends action call replies directly from the thread calling Call::reply,
+/// rather than via the client actor
+struct DirectReplier {
+  virtual void reply(uint16_t connection_id, uint16_t id,
+                     const Result &result) = 0;
+  virtual ~DirectReplier() {}
+};
+} // namespace detail
+
+/// identifies a received action call, and sends its reply; this is the part
+/// of Call and LazyCall which doesn't depend on how the arguments are held
+struct ReplyHandle {
   uint16_t connection_id;
   uint16_t id;
 
+  explicit ReplyHandle(
+      uint16_t connection_id, uint16_t id, CallReplyChannel reply_chan,
+      std::shared_ptr<detail::DirectReplier> direct_replier = {})
+      : connection_id(connection_id), id(id), reply_chan(reply_chan),
+        direct_replier(std::move(direct_replier)) {}
+
+  void reply(Result r) {
+    if (direct_replier)
+      direct_replier->reply(connection_id, id, r);
+    else
+      reply_chan.emplace(connection_id, id, std::move(r));
+  }
+
+  CallReplyChannel reply_chan;
+  std::shared_ptr<detail::DirectReplier> direct_replier;
+};
+
+struct Call : public HasMsgpackObject<Call>, public ReplyHandle {
+  static constexpr const char *name = "Call";
+
   explicit Call(uint16_t connection_id, uint16_t id,
-                msgpack::object_handle args,
-                Channel<std::tuple<uint16_t, uint16_t, Result>> reply_chan)
-      : HasMsgpackObject<Call>(std::move(args)), connection_id(connection_id),
-        id(id), reply_chan(reply_chan) {}
+                msgpack::object_handle args, CallReplyChannel reply_chan,
+                std::shared_ptr<detail::DirectReplier> direct_replier = {})
+      : HasMsgpackObject<Call>(std::move(args)),
+        ReplyHandle(connection_id, id, std::move(reply_chan),
+                    std::move(direct_replier)) {}
+};
 
-  void reply(Result r) { reply_chan.emplace(connection_id, id, std::move(r)); }
+/// an action call whose arguments are unpacked on first use, for
+/// action_register with a Channel<LazyCall>
+struct LazyCall : public ReplyHandle {
+  LazyValue args;
 
-  Channel<std::tuple<uint16_t, uint16_t, Result>> reply_chan;
+  explicit LazyCall(ReplyHandle handle, LazyValue args)
+      : ReplyHandle(std::move(handle)), args(std::move(args)) {}
 };
 
+/// an event with the time it was received, for event_listen with a
+/// Channel<TimestampedEvent>
+struct TimestampedEvent {
+  msgpack::object_handle value;
+  /// when the frame carrying this event was received by the kernel, if
+  /// SocketConfig::timestamping is enabled
+  std::optional<Timestamp> rx_time;
+};
+
+/// a known state value which is unpacked on first use, for state_observe
+/// with a Channel<LazyStateUpdate>
+struct LazyKnown {
+  LazyValue value;
+  Time t_since_change{0};
+  /// see Known::rx_time
+  std::optional<Timestamp> rx_time;
+};
+
+using LazyStateUpdate = std::variant<LazyKnown, Unknown>;
+
+/// options for event_listen and state_observe
+struct SubscribeOptions {
+  /// decode received values so that their strings, binaries and extensions
+  /// refer to the buffer the message was received in rather than being
+  /// copied; each value keeps its receive buffer alive, so values which are
+  /// held for a long time hold on to buffers from SocketConfig::receive_buffers
+  bool zero_copy = false;
+};
+
+/// events which arrived together, for event_listen with a batch channel
+using EventBatch = std::vector<msgpack::object_handle>;
+
+/// calls which arrived together, for action_register with a batch channel
+using CallBatch = std::vector<Call>;
+
 // make these printable
 
 template <typename Base>
@@ -0,0 +1,371 @@
+#pragma once
+#include "data.hpp"
+#include <cstring>
+#include <limits>
+#include <map>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace eshet {
+namespace detail {
+
+/// is T a struct using MSGPACK_DEFINE (or anything else with a msgpack_pack
+/// member template)?
+template <typename T, typename = void>
+struct has_msgpack_define : std::false_type {};
+
+template <typename T>
+struct has_msgpack_define<
+    T, std::void_t<decltype(std::declval<const T &>().msgpack_pack(
+           std::declval<msgpack::packer<msgpack::sbuffer> &>()))>>
+    : std::true_type {};
+
+/// reads msgpack-encoded values directly into C++ types, without building a
+/// msgpack::object tree first
+///
+/// Scalars, strings, binaries, vectors, maps, optionals, tuples, pairs and
+/// structs using MSGPACK_DEFINE are decoded directly; other types are
+/// unpacked into a msgpack::object and converted as usual. Malformed data
+/// throws ProtocolError, and values which don't match the type throw
+/// msgpack::type_error, as msgpack::object::convert does.
+class Decoder {
+public:
+  Decoder(const char *data, size_t size) : data(data), size(size) {}
+
+  template <typename T> void read(T &value) {
+    if constexpr (std::is_same<T, bool>::value)
+      value = read_bool();
+    else if constexpr (std::is_integral<T>::value)
+      value = read_integer<T>();
+    else if constexpr (std::is_floating_point<T>::value)
+      value = read_float<T>();
+    else if constexpr (has_msgpack_define<T>::value)
+      read_define(value);
+    else
+      read_object(value);
+  }
+
+  void read(std::string &value) {
+    size_t n = read_str_size();
+    const char *start = take(n);
+    value.assign(start, n);
+  }
+
+  template <typename T, typename A> void read(std::vector<T, A> &value) {
+    if constexpr (std::is_same<T, char>::value ||
+                  std::is_same<T, unsigned char>::value) {
+      size_t n = read_str_size();
+      const char *start = take(n);
+      value.assign(start, start + n);
+    } else {
+      size_t n = read_array_size();
+      value.resize(n);
+      for (T &item : value)
+        read(item);
+    }
+  }
+
+  template <typename K, typename V, typename C, typename A>
+  void read(std::map<K, V, C, A> &value) {
+    size_t n = read_map_size();
+    value.clear();
+    for (size_t i = 0; i < n; i++) {
+      K k;
+      V v;
+      read(k);
+      read(v);
+      value.emplace(std::move(k), std::move(v));
+    }
+  }
+
+  template <typename T> void read(std::optional<T> &value) {
+    if (peek() == 0xc0) {
+      pos++;
+      value.reset();
+    } else {
+      T v;
+      read(v);
+      value = std::move(v);
+    }
+  }
+
+  // as with msgpack's tuple conversion, elements missing from the end of the
+  // array are left alone, and extra elements are ignored
+  template <typename... Ts> void read(std::tuple<Ts...> &value) {
+    size_t n = read_array_size();
+    size_t i = 0;
+    std::apply(
+        [&](auto &...items) { ((i++ < n ? read(items) : void()), ...); },
+        value);
+    if (n > sizeof...(Ts))
+      skip(n - sizeof...(Ts));
+  }
+
+  template <typename A, typename B> void read(std::pair<A, B> &value) {
+    if (read_array_size() != 2)
+      throw msgpack::type_error();
+    read(value.first);
+    read(value.second);
+  }
+
+  /// skip n whole values
+  void skip(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      msgpack::null_visitor visitor;
+      try {
+        if (!msgpack::parse(data, size, pos, visitor))
+          throw ProtocolError();
+      } catch (msgpack::unpack_error &) {
+        throw ProtocolError();
+      }
+    }
+  }
+
+  void check_empty() {
+    if (pos != size)
+      throw ProtocolError();
+  }
+
+  size_t read_array_size() {
+    uint8_t b = read8();
+    if (b >= 0x90 && b <= 0x9f)
+      return b & 0x0f;
+    if (b == 0xdc)
+      return check_count(read_be<uint16_t>());
+    if (b == 0xdd)
+      return check_count(read_be<uint32_t>());
+    throw msgpack::type_error();
+  }
+
+  size_t read_map_size() {
+    uint8_t b = read8();
+    if (b >= 0x80 && b <= 0x8f)
+      return b & 0x0f;
+    if (b == 0xde)
+      return check_count(read_be<uint16_t>());
+    if (b == 0xdf)
+      return check_count(read_be<uint32_t>());
+    throw msgpack::type_error();
+  }
+
+private:
+  // thrown by DefineDecoder for structs it can't decode, like those using
+  // MSGPACK_DEFINE_MAP
+  struct UseObject {};
+
+  // passed to the msgpack_pack member generated by MSGPACK_DEFINE, which
+  // calls pack_array with the number of members, then pack with each member
+  // in turn; rather than packing them, this decodes each one from the input
+  //
+  // As with msgpack::type::define_array, members without a corresponding
+  // array element are left alone, and extra elements are ignored.
+  struct DefineDecoder {
+    Decoder &decoder;
+    size_t size = 0;
+    size_t index = 0;
+
+    DefineDecoder &pack_array(uint32_t) {
+      size = decoder.read_array_size();
+      return *this;
+    }
+
+    DefineDecoder &pack_map(uint32_t) { throw UseObject(); }
+
+    // msgpack_pack is const, but the object it was called on is not
+    template <typename T> DefineDecoder &pack(const T &member) {
+      if (index++ < size)
+        decoder.read(const_cast<T &>(member));
+      return *this;
+    }
+  };
+
+  template <typename T> void read_define(T &value) {
+    size_t start = pos;
+    try {
+      DefineDecoder define{*this};
+      value.msgpack_pack(define);
+      if (define.size > define.index)
+        skip(define.size - define.index);
+    } catch (UseObject &) {
+      pos = start;
+      read_object(value);
+    }
+  }
+
+  template <typename T> void read_object(T &value) {
+    msgpack::object_handle oh;
+    try {
+      oh = msgpack::unpack(data, size, pos);
+    } catch (msgpack::unpack_error &) {
+      throw ProtocolError();
+    }
+    oh.get().convert(value);
+  }
+
+  bool read_bool() {
+    uint8_t b = read8();
+    if (b == 0xc2)
+      return false;
+    if (b == 0xc3)
+      return true;
+    throw msgpack::type_error();
+  }
+
+  // an integer of any format; negative values are in i, others in u
+  struct Integer {
+    bool negative;
+    uint64_t u;
+    int64_t i;
+  };
+
+  static Integer signed_integer(int64_t i) {
+    if (i < 0)
+      return {true, 0, i};
+    return {false, (uint64_t)i, 0};
+  }
+
+  Integer read_integer_any() {
+    uint8_t b = read8();
+    if (b <= 0x7f)
+      return {false, b, 0};
+    if (b >= 0xe0)
+      return {true, 0, (int8_t)b};
+    switch (b) {
+    case 0xcc:
+      return {false, read_be<uint8_t>(), 0};
+    case 0xcd:
+      return {false, read_be<uint16_t>(), 0};
+    case 0xce:
+      return {false, read_be<uint32_t>(), 0};
+    case 0xcf:
+      return {false, read_be<uint64_t>(), 0};
+    case 0xd0:
+      return signed_integer((int8_t)read_be<uint8_t>());
+    case 0xd1:
+      return signed_integer((int16_t)read_be<uint16_t>());
+    case 0xd2:
+      return signed_integer((int32_t)read_be<uint32_t>());
+    case 0xd3:
+      return signed_integer((int64_t)read_be<uint64_t>());
+    default:
+      throw msgpack::type_error();
+    }
+  }
+
+  static bool is_integer(uint8_t b) {
+    return b <= 0x7f || b >= 0xe0 || (b >= 0xcc && b <= 0xcf) ||
+           (b >= 0xd0 && b <= 0xd3);
+  }
+
+  template <typename T> T read_integer() {
+    Integer v = read_integer_any();
+    if (v.negative) {
+      if (!std::is_signed<T>::value ||
+          v.i < (int64_t)std::numeric_limits<T>::min())
+        throw msgpack::type_error();
+      return (T)v.i;
+    } else {
+      if (v.u > (uint64_t)std::numeric_limits<T>::max())
+        throw msgpack::type_error();
+      return (T)v.u;
+    }
+  }
+
+  template <typename T> T read_float() {
+    uint8_t b = peek();
+    if (is_integer(b)) {
+      Integer v = read_integer_any();
+      return v.negative ? (T)v.i : (T)v.u;
+    }
+    pos++;
+    if (b == 0xca) {
+      uint32_t bits = read_be<uint32_t>();
+      float f;
+      memcpy(&f, &bits, sizeof(f));
+      return (T)f;
+    }
+    if (b == 0xcb) {
+      uint64_t bits = read_be<uint64_t>();
+      double d;
+      memcpy(&d, &bits, sizeof(d));
+      return (T)d;
+    }
+    throw msgpack::type_error();
+  }
+
+  // the size of a str or bin, which can both be read as strings
+  size_t read_str_size() {
+    uint8_t b = read8();
+    if (b >= 0xa0 && b <= 0xbf)
+      return b & 0x1f;
+    switch (b) {
+    case 0xd9:
+    case 0xc4:
+      return read_be<uint8_t>();
+    case 0xda:
+    case 0xc5:
+      return read_be<uint16_t>();
+    case 0xdb:
+    case 0xc6:
+      return read_be<uint32_t>();
+    default:
+      throw msgpack::type_error();
+    }
+  }
+
+  uint8_t peek() {
+    if (pos == size)
+      throw ProtocolError();
+    return (uint8_t)data[pos];
+  }
+
+  uint8_t read8() {
+    uint8_t b = peek();
+    pos++;
+    return b;
+  }
+
+  template <typename T> T read_be() {
+    const char *start = take(sizeof(T));
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++)
+      value = (T)((value << 8) | (uint8_t)start[i]);
+    return value;
+  }
+
+  // check a number of array or map elements read from the input before
+  // anything is allocated for them; each element is at least one byte
+  size_t check_count(size_t n) {
+    if (n > size - pos)
+      throw ProtocolError();
+    return n;
+  }
+
+  const char *take(size_t n) {
+    if (size - pos < n)
+      throw ProtocolError();
+    const char *start = data + pos;
+    pos += n;
+    return start;
+  }
+
+  const char *data;
+  size_t size;
+  size_t pos = 0;
+};
+
+/// decode the msgpack value in data directly into a T; see Decoder
+template <typename T> T decode_msgpack(const char *data, size_t size) {
+  T value;
+  Decoder decoder(data, size);
+  decoder.read(value);
+  decoder.check_empty();
+  return value;
+}
+
+} // namespace detail
+} // namespace eshet
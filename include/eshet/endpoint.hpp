@@ -0,0 +1,68 @@
+#pragma once
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace eshet {
+
+/// host names starting with this connect to a Unix socket at the path which
+/// follows, rather than over TCP; the port is ignored
+constexpr const char *unix_endpoint_prefix = "unix:";
+
+/// does host name a Unix socket (see unix_endpoint_prefix)?
+inline bool is_unix_endpoint(const std::string &host) {
+  return host.compare(0, strlen(unix_endpoint_prefix), unix_endpoint_prefix) ==
+         0;
+}
+
+/// the socket path in a Unix endpoint
+inline std::string unix_endpoint_path(const std::string &host) {
+  return host.substr(strlen(unix_endpoint_prefix));
+}
+
+/// host names starting with this connect to a server's shared memory socket
+/// (see ServerConfig::shm_path) at the path which follows, and exchange
+/// messages through shared memory rather than a socket; the port is ignored
+constexpr const char *shm_endpoint_prefix = "shm:";
+
+/// does host name a shared memory socket (see shm_endpoint_prefix)?
+inline bool is_shm_endpoint(const std::string &host) {
+  return host.compare(0, strlen(shm_endpoint_prefix), shm_endpoint_prefix) ==
+         0;
+}
+
+/// the socket path in a shared memory endpoint
+inline std::string shm_endpoint_path(const std::string &host) {
+  return host.substr(strlen(shm_endpoint_prefix));
+}
+
+namespace detail {
+
+/// connect to a Unix stream socket, returning the file descriptor; throws
+/// std::runtime_error on failure, like actorpp::connect
+inline int connect_unix(const std::string &path) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    throw std::runtime_error("unix socket path too long: " + path);
+  path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    throw std::runtime_error(std::string("socket failed: ") + strerror(errno));
+
+  if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    int err = errno;
+    ::close(fd);
+    throw std::runtime_error("connect to " + path + " failed: " +
+                             strerror(err));
+  }
+  return fd;
+}
+
+} // namespace detail
+} // namespace eshet
@@ -0,0 +1,38 @@
+#pragma once
+#include <cerrno>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+namespace eshet {
+namespace detail {
+
+/// owns a file descriptor
+class Fd {
+public:
+  Fd() {}
+  explicit Fd(int fd) : fd(fd) {}
+  Fd(Fd &&other) : fd(other.fd) { other.fd = -1; }
+  Fd &operator=(Fd &&other) {
+    std::swap(fd, other.fd);
+    return *this;
+  }
+  ~Fd() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  int get() const { return fd; }
+
+private:
+  int fd = -1;
+};
+
+inline int check_errno(int ret, const char *what) {
+  if (ret < 0)
+    throw std::system_error(errno, std::generic_category(), what);
+  return ret;
+}
+
+} // namespace detail
+} // namespace eshet
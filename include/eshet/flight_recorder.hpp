@@ -0,0 +1,180 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace eshet {
+
+struct FlightRecorderConfig {
+  /// number of frames to keep in each direction
+  size_t frames = 32;
+  /// frames longer than this are truncated
+  size_t max_frame_bytes = 256;
+  /// dump when the connection is lost, as well as on protocol errors
+  bool dump_on_disconnect = false;
+  /// file to append dumps to; if empty, dumps go to the error log
+  std::string dump_path;
+};
+
+enum class FrameDirection { In, Out };
+
+/// a frame recorded by FlightRecorder
+struct RecordedFrame {
+  FrameDirection direction;
+  std::chrono::system_clock::time_point time;
+  /// the size of the original frame, which may be more than data.size()
+  size_t size;
+  std::vector<uint8_t> data;
+};
+
+/// keeps the last few frames sent and received, so that there is some context
+/// when something goes wrong
+///
+/// Frames are recorded without the 3-byte header, so start with the message
+/// type. Recording a frame only copies it into preallocated storage. All
+/// methods are thread-safe.
+class FlightRecorder {
+public:
+  explicit FlightRecorder(FlightRecorderConfig config = {}) {
+    configure(std::move(config));
+  }
+
+  /// change the configuration; this discards all recorded frames
+  void configure(FlightRecorderConfig new_config) {
+    for (auto &ring : rings)
+      ring.resize(new_config.frames, new_config.max_frame_bytes);
+
+    std::lock_guard<std::mutex> guard(config_mut);
+    config_ = std::move(new_config);
+  }
+
+  FlightRecorderConfig config() const {
+    std::lock_guard<std::mutex> guard(config_mut);
+    return config_;
+  }
+
+  void record(FrameDirection direction, const uint8_t *data, size_t size) {
+    rings[(size_t)direction].record(data, size);
+  }
+
+  /// get the recorded frames in both directions, oldest first
+  std::vector<RecordedFrame> frames() const {
+    std::vector<RecordedFrame> result;
+    rings[0].read(FrameDirection::In, result);
+    rings[1].read(FrameDirection::Out, result);
+    std::stable_sort(result.begin(), result.end(),
+                     [](const RecordedFrame &a, const RecordedFrame &b) {
+                       return a.time < b.time;
+                     });
+    return result;
+  }
+
+  /// format the recorded frames as text, one per line
+  std::string dump() const {
+    std::vector<RecordedFrame> fs = frames();
+    std::string out = std::to_string(fs.size()) + " recorded frames:\n";
+
+    for (auto &frame : fs) {
+      out += format_time(frame.time);
+      out += frame.direction == FrameDirection::In ? " in  " : " out ";
+      out += std::to_string(frame.size) + " bytes:";
+
+      char hex[4];
+      for (uint8_t byte : frame.data) {
+        snprintf(hex, sizeof(hex), " %02x", byte);
+        out += hex;
+      }
+      if (frame.data.size() < frame.size)
+        out += " ...";
+      out += "\n";
+    }
+    return out;
+  }
+
+private:
+  class Ring {
+  public:
+    void resize(size_t frames, size_t max_frame_bytes) {
+      std::lock_guard<std::mutex> guard(mut);
+      max_bytes = max_frame_bytes;
+      slots.assign(frames, Slot{});
+      storage.assign(frames * max_frame_bytes, 0);
+      next = 0;
+      count = 0;
+    }
+
+    void record(const uint8_t *data, size_t size) {
+      auto now = std::chrono::system_clock::now();
+      std::lock_guard<std::mutex> guard(mut);
+      if (slots.empty())
+        return;
+
+      Slot &slot = slots[next];
+      slot.time = now;
+      slot.size = size;
+      std::memcpy(storage.data() + next * max_bytes, data,
+                  std::min(size, max_bytes));
+
+      next = (next + 1) % slots.size();
+      if (count < slots.size())
+        count++;
+    }
+
+    void read(FrameDirection direction,
+              std::vector<RecordedFrame> &out) const {
+      std::lock_guard<std::mutex> guard(mut);
+      // until the ring is full the oldest frame is at 0, then it's at next
+      size_t first = count < slots.size() ? 0 : next;
+      for (size_t i = 0; i < count; i++) {
+        size_t idx = (first + i) % slots.size();
+        const Slot &slot = slots[idx];
+        const uint8_t *data = storage.data() + idx * max_bytes;
+        out.push_back(RecordedFrame{
+            direction, slot.time, slot.size,
+            std::vector<uint8_t>(data, data + std::min(slot.size, max_bytes))});
+      }
+    }
+
+  private:
+    struct Slot {
+      std::chrono::system_clock::time_point time;
+      size_t size = 0;
+    };
+
+    mutable std::mutex mut;
+    std::vector<Slot> slots;
+    std::vector<uint8_t> storage;
+    size_t max_bytes = 0;
+    size_t next = 0;
+    size_t count = 0;
+  };
+
+  static std::string format_time(std::chrono::system_clock::time_point time) {
+    std::time_t t = std::chrono::system_clock::to_time_t(time);
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                  time.time_since_epoch())
+                  .count() %
+              1000000;
+
+    std::tm tm;
+    localtime_r(&t, &tm);
+    char buf[32];
+    size_t len = strftime(buf, sizeof(buf), "%H:%M:%S", &tm);
+    snprintf(buf + len, sizeof(buf) - len, ".%06lld", (long long)us);
+    return buf;
+  }
+
+  std::array<Ring, 2> rings;
+
+  mutable std::mutex config_mut;
+  FlightRecorderConfig config_;
+};
+
+} // namespace eshet
@@ -0,0 +1,155 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace eshet {
+
+/// log-linear bucketing of 64-bit values, as used in HDR histograms
+///
+/// Values below 2^sub_bucket_bits have their own buckets; above that, each
+/// power of two is split into 2^sub_bucket_bits linear buckets, giving a
+/// relative error of at most 2^-sub_bucket_bits.
+struct HistogramBuckets {
+  static constexpr unsigned sub_bucket_bits = 4;
+  static constexpr size_t sub_buckets = size_t(1) << sub_bucket_bits;
+  static constexpr size_t num_buckets = (65 - sub_bucket_bits) * sub_buckets;
+
+  static size_t index(uint64_t value) {
+    if (value < sub_buckets)
+      return (size_t)value;
+
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - sub_bucket_bits;
+    size_t sub = (size_t)(value >> shift) - sub_buckets;
+    return (shift + 1) * sub_buckets + sub;
+  }
+
+  static uint64_t lower_bound(size_t index) {
+    if (index < sub_buckets)
+      return index;
+
+    unsigned shift = (unsigned)(index / sub_buckets) - 1;
+    uint64_t sub = index % sub_buckets;
+    return (sub_buckets + sub) << shift;
+  }
+
+  static uint64_t upper_bound(size_t index) {
+    if (index < sub_buckets)
+      return index;
+
+    unsigned shift = (unsigned)(index / sub_buckets) - 1;
+    return lower_bound(index) + ((uint64_t(1) << shift) - 1);
+  }
+};
+
+/// a copy of the contents of a LatencyHistogram at one point in time
+struct HistogramSnapshot {
+  std::array<uint64_t, HistogramBuckets::num_buckets> counts{};
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+
+  double mean() const { return count ? (double)sum / count : 0.0; }
+
+  /// merge in the values from another snapshot
+  void add(const HistogramSnapshot &other) {
+    for (size_t i = 0; i < counts.size(); i++)
+      counts[i] += other.counts[i];
+    count += other.count;
+    sum += other.sum;
+    if (other.max > max)
+      max = other.max;
+  }
+
+  /// get the values recorded since an earlier snapshot of the same histogram;
+  /// if it has been reset in between, everything is included
+  ///
+  /// max is estimated from the highest non-empty bucket.
+  HistogramSnapshot since(const HistogramSnapshot &earlier) const {
+    if (earlier.count > count)
+      return *this;
+    for (size_t i = 0; i < counts.size(); i++)
+      if (earlier.counts[i] > counts[i])
+        return *this;
+
+    HistogramSnapshot s;
+    for (size_t i = 0; i < counts.size(); i++) {
+      s.counts[i] = counts[i] - earlier.counts[i];
+      if (s.counts[i]) {
+        uint64_t upper = HistogramBuckets::upper_bound(i);
+        s.max = upper < max ? upper : max;
+      }
+    }
+    s.count = count - earlier.count;
+    s.sum = sum - earlier.sum;
+    return s;
+  }
+
+  /// get an upper bound on the value at percentile p (0 to 100)
+  uint64_t percentile(double p) const {
+    if (count == 0)
+      return 0;
+
+    uint64_t target = (uint64_t)(p / 100.0 * count + 0.5);
+    if (target < 1)
+      target = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= target) {
+        uint64_t upper = HistogramBuckets::upper_bound(i);
+        return upper < max ? upper : max;
+      }
+    }
+    return max;
+  }
+};
+
+/// histogram of latencies (or other values) which can be recorded to and read
+/// from any thread without locking
+class LatencyHistogram {
+public:
+  void record(uint64_t value) {
+    counts[HistogramBuckets::index(value)].fetch_add(1,
+                                                     std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t old_max = max.load(std::memory_order_relaxed);
+    while (value > old_max &&
+           !max.compare_exchange_weak(old_max, value,
+                                      std::memory_order_relaxed))
+      ;
+  }
+
+  /// copy the current contents; concurrent recordings may be partially
+  /// included
+  HistogramSnapshot snapshot() const {
+    HistogramSnapshot s;
+    for (size_t i = 0; i < counts.size(); i++)
+      s.counts[i] = counts[i].load(std::memory_order_relaxed);
+    s.count = count.load(std::memory_order_relaxed);
+    s.sum = sum.load(std::memory_order_relaxed);
+    s.max = max.load(std::memory_order_relaxed);
+    return s;
+  }
+
+  void reset() {
+    for (auto &c : counts)
+      c.store(0, std::memory_order_relaxed);
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  std::array<std::atomic<uint64_t>, HistogramBuckets::num_buckets> counts{};
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> max{0};
+};
+
+} // namespace eshet
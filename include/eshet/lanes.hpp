@@ -0,0 +1,148 @@
+#pragma once
+#include "actorpp/actor.hpp"
+#include "trace.hpp"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+namespace eshet {
+using namespace actorpp;
+
+/// priority classes for outgoing messages, highest priority first
+enum class Lane {
+  /// connection management, e.g. test_disconnect
+  Control,
+  /// replies to action calls
+  Reply,
+  /// state changes, action calls, get, set and other registrations
+  State,
+  /// event registration and emits; these share a lane so that they stay in
+  /// order
+  Event,
+};
+constexpr size_t num_lanes = 4;
+
+/// counters for the messages passing through a lane; these can be read from
+/// any thread
+struct LaneStats {
+  std::atomic<uint64_t> pushed{0};
+  std::atomic<uint64_t> sent{0};
+  std::atomic<uint64_t> max_depth{0};
+
+  /// number of messages waiting to be sent
+  uint64_t depth() const { return pushed - sent; }
+};
+
+/// relative number of messages to send from each lane when all are busy,
+/// indexed by Lane
+using LaneWeights = std::array<unsigned, num_lanes>;
+constexpr LaneWeights default_lane_weights = {16, 8, 4, 1};
+
+namespace detail {
+
+/// a channel which counts the messages going through it in a LaneStats
+///
+/// There must only be one reader, which can use ready() to check for messages
+/// without blocking.
+///
+/// When tracing is enabled, the time each message spends in the channel is
+/// recorded as a span with the given name.
+template <typename T> class CountedChannel {
+public:
+  struct Queued {
+    T value;
+    uint64_t trace_start;
+  };
+
+  explicit CountedChannel(Actor &actor, const char *name = "queue")
+      : chan(actor), stats(std::make_shared<LaneStats>()), name(name) {}
+
+  void push(T value) {
+    uint64_t start = trace_start();
+    chan.push(Queued{std::move(value), start});
+    count_push(start);
+  }
+
+  template <typename... Args> void emplace(Args &&...args) {
+    push(T(std::forward<Args>(args)...));
+  }
+
+  T read() {
+    Queued queued = chan.read();
+    stats->sent++;
+    trace_end(queued.trace_start, name, "queue");
+    return std::move(queued.value);
+  }
+
+  bool ready() const { return stats->sent < stats->pushed; }
+
+  Channel<Queued> &channel() { return chan; }
+  const LaneStats &get_stats() const { return *stats; }
+  LaneStats &get_stats() { return *stats; }
+
+private:
+  void count_push(uint64_t start) {
+    uint64_t depth = ++stats->pushed - stats->sent;
+    uint64_t max_depth = stats->max_depth;
+    while (depth > max_depth &&
+           !stats->max_depth.compare_exchange_weak(max_depth, depth))
+      ;
+    trace_end(start, name, "enqueue", "depth", depth);
+  }
+
+  Channel<Queued> chan;
+  std::shared_ptr<LaneStats> stats;
+  const char *name;
+};
+
+/// throw std::invalid_argument if any weight is zero, as a lane with no
+/// allowance would never be drained
+inline void check_lane_weights(const LaneWeights &weights) {
+  for (unsigned weight : weights)
+    if (weight == 0)
+      throw std::invalid_argument("lane weights must be non-zero");
+}
+
+/// weighted round-robin between lanes; weights must be non-zero (see
+/// check_lane_weights)
+///
+/// Within a round, each lane may send up to its weight in messages, with
+/// higher-priority lanes going first. A new round starts once every lane with
+/// waiting messages has used up its allowance, so lower-priority lanes are
+/// never completely starved.
+class LaneScheduler {
+public:
+  explicit LaneScheduler(LaneWeights weights = default_lane_weights)
+      : weights(weights), credits(weights) {
+    check_lane_weights(weights);
+  }
+
+  void set_weights(LaneWeights new_weights) {
+    check_lane_weights(new_weights);
+    weights = new_weights;
+    credits = new_weights;
+  }
+
+  /// pick a lane to send from given which have messages waiting, or -1 if
+  /// none are ready
+  int pick(const std::array<bool, num_lanes> &ready) {
+    for (int round = 0; round < 2; round++) {
+      for (size_t i = 0; i < num_lanes; i++)
+        if (ready[i] && credits[i] > 0) {
+          credits[i]--;
+          return (int)i;
+        }
+      credits = weights;
+    }
+    return -1;
+  }
+
+private:
+  LaneWeights weights;
+  LaneWeights credits;
+};
+
+} // namespace detail
+} // namespace eshet
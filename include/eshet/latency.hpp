@@ -0,0 +1,94 @@
+#pragma once
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+namespace eshet {
+
+/// socket options and busy-polling to reduce round-trip latency, at the cost
+/// of CPU time; the default changes nothing
+///
+/// Options which don't apply to a connection's socket (TCP options on Unix
+/// sockets, and everything on shared memory connections) are ignored.
+struct LatencyProfile {
+  /// set TCP_NODELAY, so that small messages are not held back waiting for
+  /// an ACK
+  bool tcp_nodelay = false;
+  /// set TCP_QUICKACK, so that ACKs are not delayed; the kernel clears this
+  /// by itself, so it is set again after each read, which needs the spinning
+  /// receive thread (see recv_spin)
+  bool tcp_quickack = false;
+  /// SO_BUSY_POLL in microseconds: how long blocking reads busy-poll the
+  /// device queue for; values above net.core.busy_read need CAP_NET_ADMIN.
+  /// 0 leaves it unset
+  int busy_poll_us = 0;
+  /// SO_SNDBUF and SO_RCVBUF in bytes, or 0 for the kernel defaults
+  int send_buffer = 0;
+  int recv_buffer = 0;
+  /// after each read, keep reading the socket without blocking for this long
+  /// before sleeping, so that a reply arriving soon after a request is picked
+  /// up without a wakeup; costs up to one core per connection while busy
+  ///
+  /// Only used with SocketBackend::Threads.
+  std::chrono::microseconds recv_spin{0};
+  /// after handling each message or command, keep polling the client's
+  /// queues for this long before sleeping; costs up to one core per client
+  /// while busy
+  std::chrono::microseconds actor_spin{0};
+
+  /// everything enabled, with spins long enough to cover a loopback round
+  /// trip through a server
+  static LatencyProfile low_latency() {
+    LatencyProfile profile;
+    profile.tcp_nodelay = true;
+    profile.tcp_quickack = true;
+    profile.busy_poll_us = 50;
+    profile.recv_spin = std::chrono::microseconds(200);
+    profile.actor_spin = std::chrono::microseconds(200);
+    return profile;
+  }
+};
+
+namespace detail {
+
+/// hint to the CPU that this is a spin loop
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+/// apply the socket options in profile to sockfd, with the TCP options only
+/// if tcp is set; returns a message for each option which could not be set,
+/// as these are not fatal
+inline std::vector<std::string>
+apply_latency_profile(int sockfd, const LatencyProfile &profile, bool tcp) {
+  std::vector<std::string> errors;
+  auto set = [&](int level, int name, int value, const char *what) {
+    if (setsockopt(sockfd, level, name, &value, sizeof(value)) < 0)
+      errors.push_back(std::string("could not set ") + what + ": " +
+                       strerror(errno));
+  };
+
+  if (tcp && profile.tcp_nodelay)
+    set(IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  if (tcp && profile.tcp_quickack)
+    set(IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+  if (profile.busy_poll_us)
+    set(SOL_SOCKET, SO_BUSY_POLL, profile.busy_poll_us, "SO_BUSY_POLL");
+  if (profile.send_buffer)
+    set(SOL_SOCKET, SO_SNDBUF, profile.send_buffer, "SO_SNDBUF");
+  if (profile.recv_buffer)
+    set(SOL_SOCKET, SO_RCVBUF, profile.recv_buffer, "SO_RCVBUF");
+  return errors;
+}
+
+} // namespace detail
+} // namespace eshet
@@ -0,0 +1,61 @@
+#pragma once
+#include "buffer_pool.hpp"
+#include "msgpack.hpp"
+#include <optional>
+#include <string_view>
+
+namespace eshet {
+
+/// a received msgpack value which is only unpacked when it is first used
+///
+/// This holds the encoded value and the buffer it was received in. get(),
+/// as() and convert() unpack it on first use and cache the result, with
+/// strings, binaries and extensions referring to the buffer, so values which
+/// are never looked at cost only a check that they are well-formed. A
+/// LazyValue must not be used from more than one thread at once.
+class LazyValue {
+public:
+  LazyValue() {}
+
+  /// a value encoded in raw, which must point into buf
+  LazyValue(BufferRef buf, std::string_view raw)
+      : buf(std::move(buf)), raw(raw) {}
+
+  /// a value which has already been unpacked
+  explicit LazyValue(msgpack::object_handle value) : value(std::move(value)) {}
+
+  /// the unpacked value, which is valid as long as this LazyValue
+  const msgpack::object &get() const {
+    if (!value) {
+      bool referenced = false;
+      value = msgpack::unpack(
+          raw.data(), raw.size(), referenced,
+          [](msgpack::type::object_type, size_t, void *) { return true; });
+    }
+    return value->get();
+  }
+
+  const msgpack::object &operator*() const { return get(); }
+  const msgpack::object *operator->() const { return &get(); }
+
+  template <typename T> T as() const {
+    T v;
+    get().convert(v);
+    return v;
+  }
+
+  template <typename T> void convert(T &v) const { get().convert(v); }
+  template <typename... Ts> void convert(std::tuple<Ts &...> v) const {
+    get().convert(v);
+  }
+
+  /// has the value been unpacked yet?
+  bool unpacked() const { return value.has_value(); }
+
+private:
+  BufferRef buf;
+  std::string_view raw;
+  mutable std::optional<msgpack::object_handle> value;
+};
+
+} // namespace eshet
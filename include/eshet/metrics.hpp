@@ -0,0 +1,237 @@
+#pragma once
+#include "buffer_pool.hpp"
+#include "histogram.hpp"
+#include "lanes.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace eshet {
+
+/// types of commands sent to the server which get a reply
+enum class CommandType {
+  ActionCall,
+  ActionRegister,
+  StateRegister,
+  StateChanged,
+  StateObserve,
+  EventRegister,
+  EventEmit,
+  EventListen,
+  Get,
+  Set,
+  Ping,
+};
+constexpr size_t num_command_types = 11;
+
+inline const char *command_type_name(CommandType type) {
+  switch (type) {
+  case CommandType::ActionCall:
+    return "action_call";
+  case CommandType::ActionRegister:
+    return "action_register";
+  case CommandType::StateRegister:
+    return "state_register";
+  case CommandType::StateChanged:
+    return "state_changed";
+  case CommandType::StateObserve:
+    return "state_observe";
+  case CommandType::EventRegister:
+    return "event_register";
+  case CommandType::EventEmit:
+    return "event_emit";
+  case CommandType::EventListen:
+    return "event_listen";
+  case CommandType::Get:
+    return "get";
+  case CommandType::Set:
+    return "set";
+  case CommandType::Ping:
+    return "ping";
+  }
+  return "unknown";
+}
+
+/// configuration for publishing a client's own metrics as states; see
+/// ESHETClientActor::publish_metrics
+struct SelfMetricsConfig {
+  /// path under which states are registered, e.g. /meta/clients/my_service
+  std::string prefix;
+  /// how often to update the states
+  std::chrono::milliseconds interval{10000};
+};
+
+/// counts of values delivered to a subscriber (state observer, event listener
+/// or action)
+struct SubscriberStats {
+  std::atomic<uint64_t> delivered{0};
+};
+
+struct BufferPoolSnapshot {
+  uint64_t acquired = 0;
+  uint64_t in_use = 0;
+  uint64_t high_water = 0;
+  uint64_t overflows = 0;
+};
+
+struct LaneSnapshot {
+  uint64_t pushed = 0;
+  uint64_t sent = 0;
+  uint64_t depth = 0;
+  uint64_t max_depth = 0;
+};
+
+/// a copy of the contents of ClientMetrics at one point in time
+struct MetricsSnapshot {
+  /// time between sending a command and receiving the reply in nanoseconds,
+  /// indexed by CommandType
+  std::array<HistogramSnapshot, num_command_types> latency_ns;
+
+  /// see ClientMetrics::rx_delay_ns and ClientMetrics::tx_delay_ns
+  HistogramSnapshot rx_delay_ns;
+  HistogramSnapshot tx_delay_ns;
+
+  uint64_t bytes_in = 0;
+  uint64_t bytes_out = 0;
+  uint64_t frames_in = 0;
+  uint64_t frames_out = 0;
+
+  /// number of successful connections after the first
+  uint64_t reconnects = 0;
+  uint64_t connect_failures = 0;
+  /// total time spent re-registering after connecting
+  std::chrono::nanoseconds reregister_time{0};
+
+  /// number of commands waiting for replies
+  uint64_t in_flight = 0;
+
+  /// see ClientMetrics::receive_buffers
+  BufferPoolSnapshot receive_buffers;
+
+  /// outgoing queues, indexed by Lane
+  std::array<LaneSnapshot, num_lanes> lanes{};
+
+  /// values delivered to each subscriber, keyed by "state:", "event:" or
+  /// "action:" followed by the path
+  std::map<std::string, uint64_t> delivered;
+
+  const HistogramSnapshot &latency(CommandType type) const {
+    return latency_ns[(size_t)type];
+  }
+};
+
+/// client performance counters; these are updated by the client, and can be
+/// read from any thread
+class ClientMetrics {
+public:
+  void record_latency(CommandType type, std::chrono::nanoseconds latency) {
+    latency_ns[(size_t)type].record(latency.count());
+  }
+
+  std::atomic<uint64_t> bytes_in{0};
+  std::atomic<uint64_t> bytes_out{0};
+  std::atomic<uint64_t> frames_in{0};
+  std::atomic<uint64_t> frames_out{0};
+  std::atomic<uint64_t> reconnects{0};
+  std::atomic<uint64_t> connect_failures{0};
+  std::atomic<uint64_t> reregister_time_ns{0};
+  std::atomic<uint64_t> in_flight{0};
+
+  /// time from the kernel receiving each frame to the client handling it, in
+  /// nanoseconds; only recorded with SocketConfig::timestamping
+  LatencyHistogram rx_delay_ns;
+  /// time from writing each frame to the socket to its kernel transmit
+  /// timestamp, in nanoseconds; only recorded with SocketConfig::timestamping
+  /// over TCP
+  LatencyHistogram tx_delay_ns;
+
+  /// usage of the pool of receive buffers (see SocketConfig::receive_buffers)
+  std::shared_ptr<BufferPoolStats> receive_buffers =
+      std::make_shared<BufferPoolStats>();
+
+  /// get the stats for a subscriber; the result remains valid for the
+  /// lifetime of this object
+  SubscriberStats &subscriber(const std::string &key) {
+    std::lock_guard<std::mutex> guard(subscribers_mut);
+    return subscribers[key];
+  }
+
+  /// set the outgoing lanes to report in snapshots
+  void set_lanes(std::array<LaneStats *, num_lanes> new_lanes) {
+    lanes = new_lanes;
+  }
+
+  MetricsSnapshot snapshot() const {
+    MetricsSnapshot s;
+    for (size_t i = 0; i < num_command_types; i++)
+      s.latency_ns[i] = latency_ns[i].snapshot();
+    s.rx_delay_ns = rx_delay_ns.snapshot();
+    s.tx_delay_ns = tx_delay_ns.snapshot();
+
+    s.bytes_in = bytes_in;
+    s.bytes_out = bytes_out;
+    s.frames_in = frames_in;
+    s.frames_out = frames_out;
+    s.reconnects = reconnects;
+    s.connect_failures = connect_failures;
+    s.reregister_time = std::chrono::nanoseconds(reregister_time_ns);
+    s.in_flight = in_flight;
+    s.receive_buffers = {receive_buffers->acquired, receive_buffers->in_use,
+                         receive_buffers->high_water,
+                         receive_buffers->overflows};
+
+    for (size_t i = 0; i < num_lanes; i++) {
+      if (lanes[i]) {
+        uint64_t sent = lanes[i]->sent, pushed = lanes[i]->pushed;
+        s.lanes[i] = {pushed, sent, pushed > sent ? pushed - sent : 0,
+                      lanes[i]->max_depth};
+      }
+    }
+
+    std::lock_guard<std::mutex> guard(subscribers_mut);
+    for (auto &subscriber : subscribers)
+      s.delivered.emplace(subscriber.first, subscriber.second.delivered);
+
+    return s;
+  }
+
+  /// reset all counters and histograms except in_flight, queue depths and
+  /// receive buffers in use
+  void reset() {
+    for (auto &h : latency_ns)
+      h.reset();
+    rx_delay_ns.reset();
+    tx_delay_ns.reset();
+
+    bytes_in = 0;
+    bytes_out = 0;
+    frames_in = 0;
+    frames_out = 0;
+    reconnects = 0;
+    connect_failures = 0;
+    reregister_time_ns = 0;
+    receive_buffers->acquired = 0;
+    receive_buffers->overflows = 0;
+    receive_buffers->high_water = receive_buffers->in_use.load();
+
+    for (LaneStats *lane : lanes)
+      if (lane)
+        lane->max_depth = lane->depth();
+
+    std::lock_guard<std::mutex> guard(subscribers_mut);
+    for (auto &subscriber : subscribers)
+      subscriber.second.delivered = 0;
+  }
+
+private:
+  std::array<LatencyHistogram, num_command_types> latency_ns;
+  std::array<LaneStats *, num_lanes> lanes{};
+
+  mutable std::mutex subscribers_mut;
+  std::map<std::string, SubscriberStats> subscribers;
+};
+
+} // namespace eshet
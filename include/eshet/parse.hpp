@@ -1,5 +1,8 @@
 #pragma once
+#include "buffer_pool.hpp"
 #include "data.hpp"
+#include "trace.hpp"
+#include <string_view>
 
 namespace eshet {
 namespace detail {
@@ -32,7 +35,10 @@ public:
     return value;
   }
 
-  std::string read_string() {
+  std::string read_string() { return std::string(read_string_view()); }
+
+  /// read a string without copying it; the result points into the message
+  std::string_view read_string_view() {
     size_t end;
     for (end = pos; end < size; end++)
       if (data[end] == 0)
@@ -41,7 +47,7 @@ public:
     if (end == size)
       throw ProtocolError();
 
-    std::string value{(const char *)data + pos, (const char *)data + end};
+    std::string_view value{(const char *)data + pos, end - pos};
     pos = end + 1;
 
     return value;
@@ -56,12 +62,62 @@ public:
     return value;
   }
 
+  /// like read_msgpack, but strings, binaries and extensions in the result
+  /// refer to the message rather than being copied; buf must contain the
+  /// message, and is kept alive by the result
+  msgpack::object_handle read_msgpack_ref(const BufferRef &buf) {
+    if (size - pos < 1)
+      throw ProtocolError();
+    bool referenced = false;
+    msgpack::object_handle value = msgpack::unpack(
+        (char *)data + pos, size - pos, referenced, reference_all);
+    pos = size;
+    if (referenced)
+      value.zone()->push_finalizer(std::make_unique<BufferRef>(buf));
+    return value;
+  }
+
+  /// get the rest of the message, without checking it
+  std::string_view read_rest() {
+    if (size - pos < 1)
+      throw ProtocolError();
+    std::string_view rest((const char *)data + pos, size - pos);
+    pos = size;
+    return rest;
+  }
+
+  /// check that the rest of the message is exactly one msgpack object, and
+  /// return its encoding without unpacking it
+  std::string_view read_msgpack_raw() {
+    if (size - pos < 1)
+      throw ProtocolError();
+
+    const char *start = (const char *)data + pos;
+    size_t off = 0;
+    msgpack::null_visitor visitor;
+    try {
+      if (!msgpack::parse(start, size - pos, off, visitor))
+        throw ProtocolError();
+    } catch (msgpack::unpack_error &) {
+      throw ProtocolError();
+    }
+    if (off != size - pos)
+      throw ProtocolError();
+
+    pos = size;
+    return std::string_view(start, off);
+  }
+
   void check_empty() {
     if (pos != size)
       throw ProtocolError();
   }
 
 private:
+  static bool reference_all(msgpack::type::object_type, size_t, void *) {
+    return true;
+  }
+
   const uint8_t *data;
   size_t size;
   size_t pos = 0;
@@ -73,6 +129,7 @@ struct SendBuf {
   explicit SendBuf(size_t size) : sbuf(size) {}
 
   void start_msg(uint8_t type) {
+    trace_start_ns = trace_start();
     sbuf.clear();
     uint8_t header[] = {0x47, 0, 0, type};
     sbuf.write((char *)header, sizeof(header));
@@ -85,10 +142,20 @@ struct SendBuf {
     sbuf.write((char *)data, sizeof(data));
   }
 
-  void write_string(const std::string &s) {
-    sbuf.write(s.c_str(), s.size() + 1);
+  void write32(uint32_t value) {
+    uint8_t data[] = {(uint8_t)(value >> 24), (uint8_t)(value >> 16),
+                      (uint8_t)(value >> 8), (uint8_t)(value & 0xff)};
+    sbuf.write((char *)data, sizeof(data));
+  }
+
+  void write_string(std::string_view s) {
+    sbuf.write(s.data(), s.size());
+    write8(0);
   }
 
+  /// write bytes which are already encoded, e.g. from read_msgpack_raw
+  void write_raw(std::string_view s) { sbuf.write(s.data(), s.size()); }
+
   template <typename T> void write_msgpack(const T &value) {
     msgpack::pack(sbuf, value);
   }
@@ -98,6 +165,8 @@ struct SendBuf {
     uint8_t size_fmt[] = {(uint8_t)(size >> 8), (uint8_t)(size & 0xff)};
     sbuf.data()[1] = size_fmt[0];
     sbuf.data()[2] = size_fmt[1];
+    trace_end(trace_start_ns, "encode", "encode", "type",
+              (uint8_t)sbuf.data()[3]);
   }
 
   // methods for writing common eshet command formats
@@ -190,6 +259,16 @@ struct SendBuf {
     write_path_pack(0x31, id, path, value);
   }
 
+  /// emit an event whose value is already encoded
+  void write_event_emit(uint16_t id, const std::string &path,
+                        std::string_view encoded) {
+    start_msg(0x31);
+    write16(id);
+    write_string(path);
+    write_raw(encoded);
+    write_size();
+  }
+
   void write_event_listen(uint16_t id, const std::string &path) {
     write_path(0x32, id, path);
   }
@@ -210,6 +289,9 @@ struct SendBuf {
   }
 
   msgpack::sbuffer sbuf;
+
+private:
+  uint64_t trace_start_ns = 0;
 };
 
 } // namespace detail
@@ -0,0 +1,43 @@
+#pragma once
+
+/// USDT (user-level statically defined tracing) probes, for use with
+/// bpftrace, perf or systemtap; see tools/bpftrace for examples
+///
+/// These are only compiled in if ESHET_USDT is defined (see the ESHET_USDT
+/// cmake option), which requires sys/sdt.h (systemtap-sdt-dev or similar).
+/// When disabled, the arguments are not evaluated. When enabled, each probe is
+/// a single nop until a tracer attaches to it.
+///
+/// Probes, all in the eshet provider:
+///
+/// - send(type, id, size): a message is being sent; id is -1 for messages
+///   which don't have one
+/// - message(type, size): a message has been received
+/// - deliver(type, path): an action call, event or state change for path has
+///   been received
+/// - reply(id): a reply to the command with the given id has been received
+/// - connect_start(): connecting to the server
+/// - connect_done(connection_id): connected and re-registered
+/// - disconnected(connection_id): an established connection was lost or
+///   closed
+/// - unpack(length, buffered): a frame of length bytes was extracted, with
+///   buffered bytes in the buffer before extraction
+///
+/// In clients these fire on the client's own thread, so tid can be used to
+/// tell clients in the same process apart.
+
+#ifdef ESHET_USDT
+#include <sys/sdt.h>
+
+#define ESHET_PROBE0(name) DTRACE_PROBE(eshet, name)
+#define ESHET_PROBE1(name, a) DTRACE_PROBE1(eshet, name, a)
+#define ESHET_PROBE2(name, a, b) DTRACE_PROBE2(eshet, name, a, b)
+#define ESHET_PROBE3(name, a, b, c) DTRACE_PROBE3(eshet, name, a, b, c)
+#else
+#define ESHET_PROBE0(name)                                                     \
+  do {                                                                         \
+  } while (0)
+#define ESHET_PROBE1(name, a) ESHET_PROBE0(name)
+#define ESHET_PROBE2(name, a, b) ESHET_PROBE0(name)
+#define ESHET_PROBE3(name, a, b, c) ESHET_PROBE0(name)
+#endif
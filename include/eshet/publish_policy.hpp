@@ -0,0 +1,72 @@
+#pragma once
+#include "data.hpp"
+#include <chrono>
+#include <cmath>
+#include <optional>
+#include <stdexcept>
+
+namespace eshet {
+
+/// controls which calls to state_changed on a registered state actually result
+/// in a message being sent to the server
+///
+/// The default policy publishes every change.
+struct PublishPolicy {
+  /// don't publish values which are equal to the last published value
+  bool dedupe = false;
+
+  /// don't publish numeric values which differ from the last published value
+  /// by less than this
+  std::optional<double> deadband;
+
+  /// publish at most once in this interval; changes inside the interval are
+  /// coalesced, and the latest value is published at the end of it
+  std::chrono::milliseconds min_interval{0};
+
+  /// set min_interval to publish at most rate times per second; throws
+  /// std::invalid_argument unless rate is positive
+  PublishPolicy &max_rate(double rate) {
+    // also rejects NaN, and rates so low that the interval doesn't fit
+    if (!(rate > 0) || !(1000 / rate < 1e18))
+      throw std::invalid_argument("max_rate must be positive");
+    min_interval = std::chrono::milliseconds((long long)std::ceil(1000 / rate));
+    return *this;
+  }
+};
+
+namespace detail {
+
+/// get the value of numeric msgpack objects
+inline std::optional<double> msgpack_number(const msgpack::object &o) {
+  switch (o.type) {
+  case msgpack::type::POSITIVE_INTEGER:
+    return (double)o.via.u64;
+  case msgpack::type::NEGATIVE_INTEGER:
+    return (double)o.via.i64;
+  case msgpack::type::FLOAT32:
+  case msgpack::type::FLOAT64:
+    return o.via.f64;
+  default:
+    return std::nullopt;
+  }
+}
+
+/// should next be published, given that last was the last value published?
+inline bool should_publish(const PublishPolicy &policy, const StateUpdate &last,
+                           const StateUpdate &next) {
+  if (policy.deadband && std::holds_alternative<Known>(last) &&
+      std::holds_alternative<Known>(next)) {
+    auto last_num = msgpack_number(std::get<Known>(last).value.get());
+    auto next_num = msgpack_number(std::get<Known>(next).value.get());
+    if (last_num && next_num)
+      return std::abs(*next_num - *last_num) >= *policy.deadband;
+  }
+
+  if (policy.dedupe)
+    return last != next;
+
+  return true;
+}
+
+} // namespace detail
+} // namespace eshet
@@ -0,0 +1,118 @@
+#pragma once
+#include "actorpp/actor.hpp"
+#include "actorpp/net.hpp"
+#include "eshet/buffer_pool.hpp"
+#include "eshet/fd.hpp"
+#include "eshet/latency.hpp"
+#include "eshet/timestamps.hpp"
+#include <atomic>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+namespace eshet {
+namespace detail {
+
+/// the equivalent of actorpp::RecvThread, which reads into buffers from pool
+/// and pushes them to on_message
+///
+/// For LatencyProfile, after each read this keeps reading without blocking
+/// for up to spin before sleeping in poll (with no spin, it goes straight
+/// back to poll), and re-arms TCP_QUICKACK after each read if quickack is
+/// set. If timestamps is set, reads go through it to collect receive
+/// timestamps, and transmit timestamps are read from the error queue.
+class SocketRecvThread : public actorpp::Actor {
+  using clock = std::chrono::steady_clock;
+
+public:
+  SocketRecvThread(int sockfd, std::shared_ptr<BufferPool> pool,
+                   std::chrono::nanoseconds spin, bool quickack,
+                   std::shared_ptr<SocketTimestamps> timestamps,
+                   actorpp::Channel<BufferRef> on_message,
+                   actorpp::Channel<actorpp::CloseReason> on_close)
+      : sockfd(sockfd), pool(std::move(pool)), spin(spin), quickack(quickack),
+        timestamps(std::move(timestamps)), on_message(std::move(on_message)),
+        on_close(std::move(on_close)),
+        exit_fd(check_errno(eventfd(0, EFD_CLOEXEC), "eventfd")) {}
+
+  void run() {
+    BufferRef buf;
+    clock::time_point spin_until = clock::now() + spin;
+    bool try_read = true;
+
+    while (!should_exit.load(std::memory_order_relaxed)) {
+      if (try_read) {
+        if (!buf)
+          buf = pool->acquire();
+        size_t size = buf.capacity();
+        ssize_t n = timestamps ? timestamps->recv(sockfd, buf.data(), size)
+                               : recv(sockfd, buf.data(), size, MSG_DONTWAIT);
+        if (n > 0) {
+          // before pushing, so that the client sees the transmit timestamps
+          // of requests before their replies
+          if (timestamps)
+            timestamps->read_tx(sockfd);
+          buf.resize(n);
+          on_message.push(std::move(buf));
+          if (quickack) {
+            int one = 1;
+            setsockopt(sockfd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+          }
+          spin_until = clock::now() + spin;
+          // without spinning, another read would normally just fail with
+          // EAGAIN, so wait in poll straight away
+          try_read = spin.count() > 0;
+          continue;
+        }
+        if (n == 0) {
+          on_close.push(actorpp::CloseReason::Closed);
+          return;
+        }
+        if (errno == EINTR)
+          continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          break;
+
+        if (clock::now() < spin_until) {
+          cpu_relax();
+          continue;
+        }
+      }
+
+      try_read = true;
+      pollfd fds[2] = {{sockfd, POLLIN, 0}, {exit_fd.get(), POLLIN, 0}};
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      if (fds[1].revents)
+        return;
+      if ((fds[0].revents & POLLERR) && timestamps)
+        timestamps->read_tx(sockfd);
+      spin_until = clock::now() + spin;
+    }
+    if (!should_exit)
+      on_close.push(actorpp::CloseReason::Error);
+  }
+
+  void exit() {
+    should_exit = true;
+    uint64_t one = 1;
+    if (write(exit_fd.get(), &one, sizeof(one)) < 0)
+      return;
+  }
+
+private:
+  int sockfd;
+  std::shared_ptr<BufferPool> pool;
+  std::chrono::nanoseconds spin;
+  bool quickack;
+  std::shared_ptr<SocketTimestamps> timestamps;
+  actorpp::Channel<BufferRef> on_message;
+  actorpp::Channel<actorpp::CloseReason> on_close;
+  Fd exit_fd;
+  std::atomic<bool> should_exit{false};
+};
+
+} // namespace detail
+} // namespace eshet
@@ -0,0 +1,485 @@
+#pragma once
+#include "eshet/parse.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace eshet {
+namespace detail {
+
+/// add value to v if it's not already there, returning true if it was added
+template <typename T> bool add_unique(std::vector<T> &v, T value) {
+  if (std::find(v.begin(), v.end(), value) != v.end())
+    return false;
+  v.push_back(value);
+  return true;
+}
+
+/// remove value from v without preserving the order
+template <typename T> void remove_unordered(std::vector<T> &v, T value) {
+  auto it = std::find(v.begin(), v.end(), value);
+  if (it != v.end()) {
+    *it = v.back();
+    v.pop_back();
+  }
+}
+
+} // namespace detail
+
+namespace server {
+
+/// identifies a connection to a Broker; ids are never reused
+using ConnId = uint64_t;
+
+/// where a Broker sends frames
+class BrokerOutput {
+public:
+  /// send a complete frame, including the header, to a connection; frames for
+  /// connections which have gone should be ignored
+  virtual void send(ConnId conn, const uint8_t *data, size_t size) = 0;
+
+  virtual ~BrokerOutput() {}
+};
+
+/// receives messages from connections, e.g. from an EventLoop
+class MessageHandler {
+public:
+  virtual void connected(ConnId conn) = 0;
+
+  /// handle a message (without the frame header) from conn; throws
+  /// ProtocolError if the message is invalid, in which case the connection
+  /// should be closed
+  virtual void handle(ConnId conn, const uint8_t *msg, size_t size) = 0;
+
+  virtual void disconnected(ConnId conn) = 0;
+
+  /// how long conn may be idle before it is closed, or 0 for the default
+  virtual std::chrono::seconds timeout(ConnId conn) const = 0;
+
+  /// called about once a second
+  virtual void tick() {}
+
+  virtual ~MessageHandler() {}
+};
+
+/// the protocol state of an ESHET server, independent of the transport
+///
+/// This handles messages (without the frame header) from each connection, and
+/// sends the resulting frames to a BrokerOutput. Message bodies are checked to
+/// be valid msgpack, but are forwarded without being decoded.
+///
+/// Paths are kept in a hash table, where each entry holds the owners and
+/// subscribers of that path, so the cost of a message depends only on the
+/// number of connections it is sent to. Each connection keeps pointers to the
+/// entries it uses, so disconnecting doesn't scan the table. Entries are kept
+/// once created.
+///
+/// The supported commands are hello, ping, action register/call, state
+/// register/changed/observe, event register/emit/listen, and get. When a path
+/// is registered again, the latest connection becomes the owner; this means
+/// that a reconnecting client doesn't have to wait for its old connection to
+/// time out. set always returns an error, as there is no way for a client to
+/// register a property.
+///
+/// This is not thread-safe.
+class Broker : public MessageHandler {
+public:
+  explicit Broker(BrokerOutput &output) : output(output), send_buf(256) {}
+
+  Broker(const Broker &) = delete;
+  Broker &operator=(const Broker &) = delete;
+
+  void connected(ConnId conn) override { sessions[conn]; }
+
+  void handle(ConnId conn, const uint8_t *msg, size_t size) override {
+    auto session_it = sessions.find(conn);
+    if (session_it == sessions.end())
+      throw ProtocolError();
+    Session &session = session_it->second;
+
+    detail::Parser p(msg, size);
+    uint8_t type = p.read8();
+    if (!session.hello) {
+      handle_hello(conn, session, type, p);
+      return;
+    }
+
+    switch (type) {
+    case 0x05:
+    case 0x06: {
+      // {reply, Id, Msg} or {error, Id, Msg} from an action owner
+      uint16_t id = p.read16();
+      std::string_view value = p.read_msgpack_raw();
+
+      auto call_it = session.calls.find(id);
+      if (call_it == session.calls.end())
+        break; // the caller has gone
+      PendingCall call = call_it->second;
+      session.calls.erase(call_it);
+
+      send_buf.start_msg(type);
+      send_buf.write16(call.caller_id);
+      send_buf.write_raw(value);
+      send_buf.write_size();
+      send(call.caller);
+    } break;
+    case 0x09: {
+      // {ping, Id}
+      uint16_t id = p.read16();
+      p.check_empty();
+      reply_ok(conn, id);
+    } break;
+    case 0x10: {
+      // {action_register, Id, Path}
+      uint16_t id = p.read16();
+      PathEntry &entry = get_entry(p.read_string_view());
+      p.check_empty();
+      entry.action_owner = conn;
+      detail::add_unique(session.owned, &entry);
+      reply_ok(conn, id);
+    } break;
+    case 0x11: {
+      // {action_call, Id, Path, Msg}
+      uint16_t id = p.read16();
+      std::string_view path = p.read_string_view();
+      std::string_view args = p.read_msgpack_raw();
+
+      PathEntry *entry = find_entry(path);
+      if (!entry || !entry->action_owner) {
+        reply_error(conn, id, "no_action");
+        break;
+      }
+
+      // every id is in use if the owner isn't replying
+      Session &owner = sessions.at(entry->action_owner);
+      if (owner.calls.size() > UINT16_MAX) {
+        reply_error(conn, id, "busy");
+        break;
+      }
+      uint16_t call_id = owner.next_call_id++;
+      while (owner.calls.count(call_id))
+        call_id = owner.next_call_id++;
+      owner.calls[call_id] = PendingCall{conn, id};
+
+      send_buf.start_msg(0x11);
+      send_buf.write16(call_id);
+      send_buf.write_string(path);
+      send_buf.write_raw(args);
+      send_buf.write_size();
+      send(entry->action_owner);
+    } break;
+    case 0x23: {
+      // {get, Id, Path}
+      uint16_t id = p.read16();
+      PathEntry *entry = find_entry(p.read_string_view());
+      p.check_empty();
+
+      if (!entry || !entry->state_owner)
+        reply_error(conn, id, "no_state");
+      else if (!entry->known)
+        reply_error(conn, id, "unknown");
+      else {
+        send_buf.start_msg(0x05);
+        send_buf.write16(id);
+        send_buf.write_raw(entry->value);
+        send_buf.write_size();
+        send(conn);
+      }
+    } break;
+    case 0x24: {
+      // {set, Id, Path, Msg}
+      uint16_t id = p.read16();
+      p.read_string_view();
+      p.read_msgpack_raw();
+      reply_error(conn, id, "no_prop");
+    } break;
+    case 0x30: {
+      // {event_register, Id, Path}
+      uint16_t id = p.read16();
+      PathEntry &entry = get_entry(p.read_string_view());
+      p.check_empty();
+      entry.event_owner = conn;
+      detail::add_unique(session.owned, &entry);
+      reply_ok(conn, id);
+    } break;
+    case 0x31: {
+      // {event_emit, Id, Path, Msg}
+      uint16_t id = p.read16();
+      std::string_view path = p.read_string_view();
+      std::string_view value = p.read_msgpack_raw();
+
+      PathEntry *entry = find_entry(path);
+      if (entry && !entry->listeners.empty()) {
+        send_buf.start_msg(0x33);
+        send_buf.write_string(path);
+        send_buf.write_raw(value);
+        send_buf.write_size();
+        send_all(entry->listeners);
+      }
+      reply_ok(conn, id);
+    } break;
+    case 0x32: {
+      // {event_listen, Id, Path}
+      uint16_t id = p.read16();
+      PathEntry &entry = get_entry(p.read_string_view());
+      p.check_empty();
+      if (detail::add_unique(session.listening, &entry))
+        entry.listeners.push_back(conn);
+      reply_ok(conn, id);
+    } break;
+    case 0x40: {
+      // {state_register, Id, Path}
+      uint16_t id = p.read16();
+      PathEntry &entry = get_entry(p.read_string_view());
+      p.check_empty();
+      entry.state_owner = conn;
+      detail::add_unique(session.owned, &entry);
+      reply_ok(conn, id);
+    } break;
+    case 0x41:
+    case 0x42: {
+      // {state_changed, Id, Path, Msg} or {state_unknown, Id, Path}
+      uint16_t id = p.read16();
+      std::string_view path = p.read_string_view();
+      std::string_view value;
+      if (type == 0x41) {
+        value = p.read_msgpack_raw();
+        // must fit in an observe reply, which has 7 bytes of other fields
+        if (value.size() > 0xffff - 7)
+          throw ProtocolError();
+      } else
+        p.check_empty();
+
+      PathEntry *entry = find_entry(path);
+      if (!entry || entry->state_owner != conn) {
+        reply_error(conn, id, "not_owner");
+        break;
+      }
+
+      if (type == 0x41)
+        set_known(*entry, value);
+      else
+        set_unknown(*entry);
+      reply_ok(conn, id);
+    } break;
+    case 0x46: {
+      // {state_observe, Id, Path}
+      uint16_t id = p.read16();
+      PathEntry &entry = get_entry(p.read_string_view());
+      p.check_empty();
+      if (detail::add_unique(session.observing, &entry))
+        entry.observers.push_back(conn);
+
+      using namespace std::chrono;
+      auto since_change =
+          duration_cast<milliseconds>(steady_clock::now() - entry.changed);
+      uint32_t t =
+          (uint32_t)std::min<int64_t>(since_change.count(), UINT32_MAX);
+
+      send_buf.start_msg(entry.known ? 0x0a : 0x0b);
+      send_buf.write16(id);
+      send_buf.write32(t);
+      if (entry.known)
+        send_buf.write_raw(entry.value);
+      send_buf.write_size();
+      send(conn);
+    } break;
+    default:
+      throw ProtocolError();
+    }
+  }
+
+  /// clean up after a connection has closed: its paths are unregistered,
+  /// states it owned become unknown, and calls waiting for it get an error
+  void disconnected(ConnId conn) override {
+    auto session_it = sessions.find(conn);
+    if (session_it == sessions.end())
+      return;
+    Session session = std::move(session_it->second);
+    sessions.erase(session_it);
+
+    for (PathEntry *entry : session.observing)
+      detail::remove_unordered(entry->observers, conn);
+    for (PathEntry *entry : session.listening)
+      detail::remove_unordered(entry->listeners, conn);
+
+    for (PathEntry *entry : session.owned) {
+      if (entry->action_owner == conn)
+        entry->action_owner = 0;
+      if (entry->event_owner == conn)
+        entry->event_owner = 0;
+      if (entry->state_owner == conn) {
+        entry->state_owner = 0;
+        if (entry->known)
+          set_unknown(*entry);
+      }
+    }
+
+    for (auto &call : session.calls)
+      reply_error(call.second.caller, call.second.caller_id, "disconnected");
+  }
+
+  /// the timeout requested by a connection in its hello, or 0 if it hasn't
+  /// said hello yet
+  std::chrono::seconds timeout(ConnId conn) const override {
+    auto it = sessions.find(conn);
+    return it == sessions.end() ? std::chrono::seconds(0) : it->second.timeout;
+  }
+
+  size_t connections() const { return sessions.size(); }
+  size_t paths() const { return entries.size(); }
+
+private:
+  struct PathEntry {
+    /// connections which registered this path, or 0
+    ConnId action_owner = 0;
+    ConnId state_owner = 0;
+    ConnId event_owner = 0;
+
+    bool known = false;
+    /// msgpack-encoded state value if known
+    std::string value;
+    std::chrono::steady_clock::time_point changed =
+        std::chrono::steady_clock::now();
+
+    std::vector<ConnId> observers;
+    std::vector<ConnId> listeners;
+
+    /// the key of this entry, set when it's created
+    const std::string *path = nullptr;
+  };
+
+  struct PendingCall {
+    ConnId caller;
+    uint16_t caller_id;
+  };
+
+  struct Session {
+    bool hello = false;
+    std::chrono::seconds timeout{0};
+
+    std::vector<PathEntry *> owned;
+    std::vector<PathEntry *> observing;
+    std::vector<PathEntry *> listening;
+
+    /// calls to actions owned by this connection, by the id sent to it
+    std::unordered_map<uint16_t, PendingCall> calls;
+    uint16_t next_call_id = 0;
+  };
+
+  void handle_hello(ConnId conn, Session &session, uint8_t type,
+                    detail::Parser &p) {
+    if (type != 0x01 && type != 0x02)
+      throw ProtocolError();
+
+    // {hello, ProtocolVersion, Timeout} or {hello_id, ProtocolVersion,
+    // Timeout, ClientID}
+    uint8_t version = p.read8();
+    if (version != 1)
+      throw ProtocolError();
+    session.timeout = std::chrono::seconds(p.read16());
+
+    if (type == 0x02) {
+      p.read_msgpack_raw();
+      send_buf.start_msg(0x03);
+    } else {
+      p.check_empty();
+      // the connection id is unique, so is used as the client id, encoded
+      // as a msgpack uint64
+      send_buf.start_msg(0x04);
+      send_buf.write8(0xcf);
+      send_buf.write32((uint32_t)(conn >> 32));
+      send_buf.write32((uint32_t)conn);
+    }
+    send_buf.write_size();
+    send(conn);
+
+    session.hello = true;
+  }
+
+  void set_known(PathEntry &entry, std::string_view value) {
+    entry.known = true;
+    entry.value.assign(value);
+    entry.changed = std::chrono::steady_clock::now();
+
+    if (entry.observers.empty())
+      return;
+    send_buf.start_msg(0x44);
+    send_buf.write_string(*entry.path);
+    send_buf.write_raw(value);
+    send_buf.write_size();
+    send_all(entry.observers);
+  }
+
+  void set_unknown(PathEntry &entry) {
+    entry.known = false;
+    entry.value.clear();
+    entry.changed = std::chrono::steady_clock::now();
+
+    if (entry.observers.empty())
+      return;
+    send_buf.start_msg(0x45);
+    send_buf.write_string(*entry.path);
+    send_buf.write_size();
+    send_all(entry.observers);
+  }
+
+  void reply_ok(ConnId conn, uint16_t id) {
+    send_buf.start_msg(0x05);
+    send_buf.write16(id);
+    send_buf.write8(0xc0); // nil
+    send_buf.write_size();
+    send(conn);
+  }
+
+  void reply_error(ConnId conn, uint16_t id, const char *error) {
+    send_buf.start_msg(0x06);
+    send_buf.write16(id);
+    send_buf.write_msgpack(error);
+    send_buf.write_size();
+    send(conn);
+  }
+
+  void send(ConnId conn) {
+    output.send(conn, (const uint8_t *)send_buf.sbuf.data(),
+                send_buf.sbuf.size());
+  }
+
+  void send_all(const std::vector<ConnId> &conns) {
+    for (ConnId conn : conns)
+      send(conn);
+  }
+
+  /// get the entry for a path, creating it if necessary
+  PathEntry &get_entry(std::string_view path) {
+    key.assign(path);
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+      it = entries.emplace(key, PathEntry{}).first;
+      it->second.path = &it->first;
+    }
+    return it->second;
+  }
+
+  PathEntry *find_entry(std::string_view path) {
+    key.assign(path);
+    auto it = entries.find(key);
+    return it == entries.end() ? nullptr : &it->second;
+  }
+
+  BrokerOutput &output;
+  detail::SendBuf send_buf;
+
+  std::unordered_map<std::string, PathEntry> entries;
+  std::unordered_map<ConnId, Session> sessions;
+
+  /// reused for lookups, so that finding an entry doesn't allocate
+  std::string key;
+};
+
+} // namespace server
+} // namespace eshet
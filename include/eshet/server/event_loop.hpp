@@ -0,0 +1,582 @@
+#pragma once
+#include "eshet/fd.hpp"
+#include "eshet/server/broker.hpp"
+#include "eshet/shm.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace eshet {
+namespace server {
+
+struct ServerConfig {
+  /// IPv4 address to listen on
+  std::string bind_address = "0.0.0.0";
+  /// TCP port to listen on; 0 picks a free port, which can be found with
+  /// port(), and -1 disables TCP
+  int port = 11236;
+  /// if not empty, also listen on a Unix socket at this path; any existing
+  /// file at the path is replaced
+  std::string unix_path;
+  /// if not empty, also accept shared memory connections (see
+  /// detail::ShmConnection) through a Unix socket at this path; any existing
+  /// file at the path is replaced
+  std::string shm_path;
+  /// the size of each ring of a shared memory connection
+  size_t shm_ring_size = 1 << 20;
+  /// close connections with more than this many bytes waiting to be sent
+  size_t max_output_buffer = 16 << 20;
+  /// close connections which have not said hello after this long
+  std::chrono::seconds hello_timeout{30};
+};
+
+/// a single-threaded epoll loop, which reads frames from connections and
+/// passes them to a MessageHandler, and sends frames to them as a
+/// BrokerOutput
+///
+/// Received data is framed in place from a shared read buffer, so idle
+/// connections only hold what they have buffered. Frames sent during one
+/// iteration of the loop are collected per connection and written together
+/// at the end of it, with EPOLLOUT used only while a connection's socket
+/// buffer is full. Connections are closed if the handler throws
+/// ProtocolError, if they stop reading, or if they don't send anything
+/// within their timeout.
+///
+/// Shared memory connections are handled in the same way, except that frames
+/// are read in place from, and written to, the connection's rings, and its
+/// doorbell is watched rather than its socket buffers.
+class EventLoop : public BrokerOutput {
+public:
+  /// start listening; this throws std::system_error if the sockets can't be
+  /// set up
+  EventLoop(MessageHandler &handler, ServerConfig config)
+      : handler(handler), config(std::move(config)), read_buf(65536) {
+    using detail::check_errno;
+    epoll_fd = detail::Fd(check_errno(epoll_create1(EPOLL_CLOEXEC), "epoll"));
+    wake_fd = detail::Fd(
+        check_errno(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), "eventfd"));
+    watch(wake_fd.get(), EPOLL_CTL_ADD, EPOLLIN, wake_key);
+
+    if (this->config.port >= 0)
+      listen_tcp();
+    if (!this->config.unix_path.empty())
+      listen_unix(this->config.unix_path, Listener::Unix);
+    if (!this->config.shm_path.empty())
+      listen_unix(this->config.shm_path, Listener::Shm);
+  }
+
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+
+  ~EventLoop() {
+    if (!config.unix_path.empty())
+      unlink(config.unix_path.c_str());
+    if (!config.shm_path.empty())
+      unlink(config.shm_path.c_str());
+  }
+
+  /// the TCP port being listened on, or -1
+  int port() const { return port_; }
+
+  /// run the loop until stop() is called
+  void run() {
+    using namespace std::chrono;
+    std::vector<epoll_event> events(256);
+    steady_clock::time_point last_sweep = steady_clock::now();
+
+    // send anything queued before the loop started
+    finish_batch();
+
+    while (true) {
+      int n =
+          epoll_wait(epoll_fd.get(), events.data(), (int)events.size(), 1000);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        throw std::system_error(errno, std::generic_category(), "epoll_wait");
+      }
+      now = steady_clock::now();
+
+      bool stopping = false;
+      for (int i = 0; i < n; i++) {
+        uint64_t key = events[i].data.u64;
+        if (key == wake_key) {
+          uint64_t count;
+          if (read(wake_fd.get(), &count, sizeof(count)) > 0)
+            stopping = true;
+        } else if (key & shm_bell_bit)
+          handle_bell(key & ~shm_bell_bit);
+        else if (Listener *listener = find_listener(key))
+          accept_all(*listener);
+        else
+          handle_event(key, events[i].events);
+      }
+
+      if (now - last_sweep >= seconds(1)) {
+        sweep();
+        handler.tick();
+        last_sweep = now;
+      }
+      finish_batch();
+
+      if (stopping)
+        return;
+    }
+  }
+
+  /// make run() return; this can be called from any thread, or from a signal
+  /// handler
+  void stop() {
+    uint64_t one = 1;
+    if (write(wake_fd.get(), &one, sizeof(one)) < 0)
+      return;
+  }
+
+  /// add a connection which was made elsewhere, e.g. an outgoing connection,
+  /// taking ownership of fd; unlike for accepted connections, the handler's
+  /// connected() is not called
+  ///
+  /// If connecting is set, fd is a non-blocking socket whose connect() is in
+  /// progress. Frames sent to it are held until the connect finishes, and if
+  /// it fails or times out, the connection is closed as usual.
+  ConnId add_connection(int fd, bool connecting = false) {
+    return add_connection(detail::Fd(fd), {}, connecting);
+  }
+
+  /// close a connection at the end of this iteration of the loop; the
+  /// handler's disconnected() will be called
+  void close(ConnId id) {
+    auto it = conns.find(id);
+    if (it != conns.end())
+      close_later(it->second);
+  }
+
+  void send(ConnId id, const uint8_t *data, size_t size) override {
+    auto it = conns.find(id);
+    if (it == conns.end() || it->second.closing)
+      return;
+    Connection &conn = it->second;
+
+    conn.out.insert(conn.out.end(), data, data + size);
+    if (conn.out.size() - conn.out_pos > config.max_output_buffer) {
+      close_later(conn);
+      return;
+    }
+    mark_dirty(conn);
+  }
+
+  /// the number of open connections; only call this from the thread running
+  /// the loop, or while it's stopped
+  size_t connections() const { return conns.size(); }
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct Listener {
+    enum Kind { Tcp, Unix, Shm };
+    detail::Fd fd;
+    uint64_t key;
+    Kind kind;
+  };
+
+  struct Connection {
+    detail::Fd fd;
+    ConnId id;
+    /// the start of a frame which hasn't been completely received
+    std::vector<uint8_t> in;
+    /// data to send, starting at out_pos
+    std::vector<uint8_t> out;
+    size_t out_pos = 0;
+    /// in the dirty list
+    bool dirty = false;
+    /// in the to_close list
+    bool closing = false;
+    /// EPOLLOUT is enabled
+    bool want_write = false;
+    /// waiting for an outgoing connect() to finish; only EPOLLOUT is enabled
+    bool connecting = false;
+    clock::time_point last_rx;
+    /// for shared memory connections, the rings which carry frames in place of
+    /// fd, which is only watched for closing
+    std::unique_ptr<detail::ShmConnection> shm;
+  };
+
+  // epoll key for wake_fd; listeners and connections take keys from next_id
+  static constexpr uint64_t wake_key = 0;
+  // set in the epoll key of a shared memory connection's doorbell, along with
+  // its ConnId
+  static constexpr uint64_t shm_bell_bit = 1ull << 63;
+
+  void watch(int fd, int op, uint32_t events, uint64_t key) {
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.u64 = key;
+    detail::check_errno(epoll_ctl(epoll_fd.get(), op, fd, &ev), "epoll_ctl");
+  }
+
+  void listen_tcp() {
+    using detail::check_errno;
+    detail::Fd fd(check_errno(
+        socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+        "socket"));
+    int one = 1;
+    setsockopt(fd.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.bind_address.c_str(), &addr.sin_addr) != 1)
+      throw std::system_error(EINVAL, std::generic_category(),
+                              "bad bind address");
+    check_errno(bind(fd.get(), (sockaddr *)&addr, sizeof(addr)), "bind");
+    check_errno(listen(fd.get(), SOMAXCONN), "listen");
+
+    socklen_t len = sizeof(addr);
+    check_errno(getsockname(fd.get(), (sockaddr *)&addr, &len),
+                "getsockname");
+    port_ = ntohs(addr.sin_port);
+
+    add_listener(std::move(fd), Listener::Tcp);
+  }
+
+  void listen_unix(const std::string &path, Listener::Kind kind) {
+    using detail::check_errno;
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+      throw std::system_error(ENAMETOOLONG, std::generic_category(),
+                              "unix socket path");
+    path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+    detail::Fd fd(check_errno(
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+        "socket"));
+    unlink(path.c_str());
+    check_errno(bind(fd.get(), (sockaddr *)&addr, sizeof(addr)), "bind");
+    check_errno(listen(fd.get(), SOMAXCONN), "listen");
+
+    add_listener(std::move(fd), kind);
+  }
+
+  void add_listener(detail::Fd fd, Listener::Kind kind) {
+    uint64_t key = next_id++;
+    watch(fd.get(), EPOLL_CTL_ADD, EPOLLIN, key);
+    listeners.push_back(Listener{std::move(fd), key, kind});
+  }
+
+  ConnId add_connection(detail::Fd fd,
+                        std::unique_ptr<detail::ShmConnection> shm,
+                        bool connecting = false) {
+    ConnId id = next_id++;
+    watch(fd.get(), EPOLL_CTL_ADD, connecting ? EPOLLOUT : EPOLLIN, id);
+    if (shm)
+      watch(shm->data_bell(), EPOLL_CTL_ADD, EPOLLIN, id | shm_bell_bit);
+
+    Connection &conn = conns[id];
+    conn.fd = std::move(fd);
+    conn.id = id;
+    conn.last_rx = clock::now();
+    conn.shm = std::move(shm);
+    conn.connecting = connecting;
+    return id;
+  }
+
+  Listener *find_listener(uint64_t key) {
+    for (auto &listener : listeners)
+      if (listener.key == key)
+        return &listener;
+    return nullptr;
+  }
+
+  void accept_all(Listener &listener) {
+    while (true) {
+      int fd = accept4(listener.fd.get(), nullptr, nullptr,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        return;
+      }
+
+      if (listener.kind == Listener::Tcp) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      }
+
+      detail::Fd owned_fd(fd);
+      ConnId id;
+      try {
+        std::unique_ptr<detail::ShmConnection> shm;
+        if (listener.kind == Listener::Shm) {
+          shm = detail::ShmConnection::create(config.shm_ring_size);
+          shm->send_to(fd);
+        }
+        id = add_connection(std::move(owned_fd), std::move(shm));
+      } catch (std::system_error &) {
+        continue;
+      }
+      handler.connected(id);
+    }
+  }
+
+  void handle_event(ConnId id, uint32_t events) {
+    auto it = conns.find(id);
+    if (it == conns.end() || it->second.closing)
+      return;
+    Connection &conn = it->second;
+
+    if (conn.connecting) {
+      finish_connect(conn);
+      return;
+    }
+    if (events & EPOLLOUT)
+      mark_dirty(conn);
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      read_from(conn);
+  }
+
+  /// an outgoing connection became writable or failed; check which, and start
+  /// reading from it and sending what was held
+  void finish_connect(Connection &conn) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(conn.fd.get(), SOL_SOCKET, SO_ERROR, &error, &len) < 0 ||
+        error) {
+      close_later(conn);
+      return;
+    }
+
+    conn.connecting = false;
+    watch(conn.fd.get(), EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT, conn.id);
+    conn.want_write = true;
+    mark_dirty(conn);
+  }
+
+  void read_from(Connection &conn) {
+    ssize_t n = recv(conn.fd.get(), read_buf.data(), read_buf.size(), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return;
+    // shared memory clients only close their socket
+    if (n <= 0 || conn.shm) {
+      close_later(conn);
+      return;
+    }
+    conn.last_rx = now;
+
+    try {
+      if (conn.in.empty()) {
+        size_t used = handle_frames(conn, read_buf.data(), n);
+        conn.in.assign(read_buf.data() + used, read_buf.data() + n);
+      } else {
+        conn.in.insert(conn.in.end(), read_buf.data(), read_buf.data() + n);
+        size_t used = handle_frames(conn, conn.in.data(), conn.in.size());
+        conn.in.erase(conn.in.begin(), conn.in.begin() + used);
+      }
+    } catch (ProtocolError &) {
+      close_later(conn);
+    }
+  }
+
+  /// handle frames from a shared memory connection's ring, and retry writing
+  /// to it, after its doorbell was rung
+  void handle_bell(ConnId id) {
+    auto it = conns.find(id);
+    if (it == conns.end() || it->second.closing)
+      return;
+    Connection &conn = it->second;
+    detail::ShmConnection &shm = *conn.shm;
+    detail::ShmConnection::clear_bell(shm.data_bell());
+
+    if (conn.out_pos < conn.out.size())
+      mark_dirty(conn);
+
+    try {
+      // frames are handled in place, and only released once handled; a
+      // partial frame is left in the ring until the rest is written
+      while (!conn.closing) {
+        auto [data, size] = shm.readable();
+        size_t used = handle_frames(conn, data, size);
+        if (used) {
+          shm.consume(used);
+          conn.last_rx = now;
+        } else if (shm.prepare_read_wait())
+          break;
+      }
+    } catch (ProtocolError &) {
+      close_later(conn);
+    }
+  }
+
+  /// handle the complete frames at the start of data, returning the number of
+  /// bytes used
+  size_t handle_frames(Connection &conn, const uint8_t *data, size_t size) {
+    size_t pos = 0;
+    while (size - pos >= 3 && !conn.closing) {
+      if (data[pos] != 0x47)
+        throw ProtocolError();
+      size_t length = ((size_t)data[pos + 1] << 8) | data[pos + 2];
+      if (size - pos - 3 < length)
+        break;
+
+      handler.handle(conn.id, data + pos + 3, length);
+      pos += 3 + length;
+    }
+    return pos;
+  }
+
+  void mark_dirty(Connection &conn) {
+    if (!conn.dirty) {
+      conn.dirty = true;
+      dirty.push_back(conn.id);
+    }
+  }
+
+  void close_later(Connection &conn) {
+    if (!conn.closing) {
+      conn.closing = true;
+      to_close.push_back(conn.id);
+    }
+  }
+
+  void flush(Connection &conn) {
+    if (conn.shm)
+      write_shm(conn);
+    else
+      write_socket(conn);
+    if (conn.closing)
+      return;
+
+    bool blocked = conn.out_pos < conn.out.size();
+    if (!blocked) {
+      conn.out.clear();
+      conn.out_pos = 0;
+      // don't keep a large buffer around after a burst
+      if (conn.out.capacity() > read_buf.size())
+        conn.out.shrink_to_fit();
+    } else if (conn.out_pos > conn.out.size() / 2) {
+      conn.out.erase(conn.out.begin(), conn.out.begin() + conn.out_pos);
+      conn.out_pos = 0;
+    }
+
+    // shared memory connections are woken by their doorbell instead
+    if (!conn.shm && blocked != conn.want_write) {
+      watch(conn.fd.get(), EPOLL_CTL_MOD,
+            blocked ? EPOLLIN | EPOLLOUT : EPOLLIN, conn.id);
+      conn.want_write = blocked;
+    }
+  }
+
+  void write_socket(Connection &conn) {
+    while (conn.out_pos < conn.out.size()) {
+      ssize_t n = ::send(conn.fd.get(), conn.out.data() + conn.out_pos,
+                         conn.out.size() - conn.out_pos, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        close_later(conn);
+        return;
+      }
+      conn.out_pos += n;
+    }
+  }
+
+  void write_shm(Connection &conn) {
+    try {
+      while (conn.out_pos < conn.out.size()) {
+        size_t n = conn.shm->write_some(conn.out.data() + conn.out_pos,
+                                        conn.out.size() - conn.out_pos);
+        conn.out_pos += n;
+        if (!n && conn.shm->prepare_write_wait())
+          break;
+      }
+    } catch (ProtocolError &) {
+      close_later(conn);
+    }
+  }
+
+  /// close connections and write output from this iteration; closing a
+  /// connection can produce output for others, and writing can fail and
+  /// close a connection, so repeat until there is nothing left to do
+  void finish_batch() {
+    while (!to_close.empty() || !dirty.empty()) {
+      std::swap(to_close, batch);
+      for (ConnId id : batch) {
+        auto it = conns.find(id);
+        if (it == conns.end())
+          continue;
+        epoll_ctl(epoll_fd.get(), EPOLL_CTL_DEL, it->second.fd.get(), nullptr);
+        // the client has the doorbell open too, so closing it here would not
+        // remove it from the epoll set
+        if (it->second.shm)
+          epoll_ctl(epoll_fd.get(), EPOLL_CTL_DEL, it->second.shm->data_bell(),
+                    nullptr);
+        conns.erase(it);
+        handler.disconnected(id);
+      }
+      batch.clear();
+
+      std::swap(dirty, batch);
+      for (ConnId id : batch) {
+        auto it = conns.find(id);
+        if (it == conns.end())
+          continue;
+        it->second.dirty = false;
+        // output to a connection which is still connecting is flushed once
+        // it has connected
+        if (!it->second.closing && !it->second.connecting)
+          flush(it->second);
+      }
+      batch.clear();
+    }
+  }
+
+  /// close connections which have timed out
+  void sweep() {
+    for (auto &item : conns) {
+      Connection &conn = item.second;
+      std::chrono::seconds timeout = handler.timeout(conn.id);
+      if (!timeout.count())
+        timeout = config.hello_timeout;
+      if (now - conn.last_rx > timeout)
+        close_later(conn);
+    }
+  }
+
+  MessageHandler &handler;
+  ServerConfig config;
+
+  detail::Fd epoll_fd;
+  detail::Fd wake_fd;
+  std::vector<Listener> listeners;
+  int port_ = -1;
+
+  std::unordered_map<ConnId, Connection> conns;
+  ConnId next_id = wake_key + 1;
+
+  std::vector<uint8_t> read_buf;
+  std::vector<ConnId> dirty;
+  std::vector<ConnId> to_close;
+  /// swapped with dirty or to_close while processing them
+  std::vector<ConnId> batch;
+
+  /// the time at the start of this iteration
+  clock::time_point now = clock::now();
+};
+
+} // namespace server
+} // namespace eshet
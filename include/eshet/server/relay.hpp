@@ -0,0 +1,745 @@
+#pragma once
+#include "eshet/server/event_loop.hpp"
+#include <atomic>
+#include <memory>
+#include <netdb.h>
+
+namespace eshet {
+namespace server {
+
+struct RelayConfig {
+  RelayConfig() {
+    listen.port = -1;
+    listen.unix_path = "/tmp/eshet_relay.sock";
+  }
+
+  /// where to listen for local clients; by default this is only a Unix
+  /// socket
+  ServerConfig listen;
+
+  std::string upstream_host = "localhost";
+  int upstream_port = 11236;
+  /// timeout to send to the server; pings are sent at a third of this
+  std::chrono::seconds upstream_timeout{30};
+  /// how long to wait between attempts to connect to the server
+  std::chrono::seconds reconnect_delay{1};
+};
+
+/// counts of the work done by a Relay; these can be read from any thread
+struct RelayCounters {
+  /// observes and listens which were sent to the server
+  std::atomic<uint64_t> observes_forwarded{0};
+  std::atomic<uint64_t> listens_forwarded{0};
+  /// observes and listens which were answered from the relay's own
+  /// subscription
+  std::atomic<uint64_t> observes_shared{0};
+  std::atomic<uint64_t> listens_shared{0};
+  std::atomic<uint64_t> upstream_connects{0};
+};
+
+/// shares one connection to an ESHET server between many local clients
+///
+/// Local clients connect to an EventLoop, and most of their commands are
+/// forwarded to the server with their ids rewritten, so that ids from
+/// different clients can't collide; replies are routed back by the rewritten
+/// id. Hello and ping are answered locally.
+///
+/// Each path is only observed or listened to once on the server; the first
+/// observe or listen for a path is forwarded, and later ones are answered from
+/// the relay's copy of the state, with updates and events fanned out to all
+/// local subscribers. Calls to actions registered by local clients are routed
+/// to the client which registered them, and when a client disconnects, any
+/// states it owned are made unknown.
+///
+/// The server's address is resolved once, when the relay is made, and the
+/// connection to it is made without blocking the loop, with upstream_timeout
+/// as the connect timeout; if there are several addresses, each failure moves
+/// on to the next. While it's not connected, local clients are disconnected,
+/// so that they register and subscribe again when it comes back.
+class Relay : private MessageHandler {
+public:
+  /// resolve the server's address and start listening; this throws
+  /// std::system_error if the address can't be resolved or the sockets can't
+  /// be set up
+  explicit Relay(RelayConfig config = {})
+      : config(config), send_buf(256),
+        upstream_addrs(resolve(config.upstream_host, config.upstream_port)),
+        upstream_addr(upstream_addrs.get()), loop(*this, config.listen) {}
+
+  /// the TCP port being listened on, or -1
+  int port() const { return loop.port(); }
+
+  /// connect to the server and run the loop until stop() is called
+  void run() {
+    connect_upstream();
+    loop.run();
+  }
+
+  /// make run() return; this can be called from any thread, or from a signal
+  /// handler
+  void stop() { loop.stop(); }
+
+  const RelayCounters &counters() const { return counters_; }
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  /// the state of a subscription to the server
+  enum class Status { None, Pending, Done };
+
+  /// a local request waiting for the server's reply
+  struct Waiter {
+    ConnId conn;
+    uint16_t id;
+  };
+
+  struct PathEntry {
+    Status observe = Status::None;
+    bool known = false;
+    std::string value;
+    clock::time_point changed;
+    std::vector<ConnId> observers;
+    std::vector<Waiter> observe_waiters;
+
+    Status listen = Status::None;
+    std::vector<ConnId> listeners;
+    std::vector<Waiter> listen_waiters;
+
+    /// local connections which registered this path, or 0
+    ConnId action_owner = 0;
+    ConnId state_owner = 0;
+
+    /// the key of this entry, set when it's created
+    const std::string *path = nullptr;
+  };
+
+  enum class RequestType {
+    /// a local request; the reply goes back to waiter
+    Forward,
+    /// our observe or listen for entry, which has local waiters
+    Observe,
+    Listen,
+    /// our own request, whose reply is ignored
+    Internal,
+  };
+
+  /// a request sent to the server, by the id it was sent with
+  struct Request {
+    RequestType type;
+    Waiter waiter;
+    PathEntry *entry;
+  };
+
+  struct Session {
+    bool hello = false;
+    std::chrono::seconds timeout{0};
+
+    std::vector<PathEntry *> owned;
+    std::vector<PathEntry *> observing;
+    std::vector<PathEntry *> listening;
+  };
+
+  // MessageHandler
+
+  void connected(ConnId conn) override { sessions[conn]; }
+
+  void handle(ConnId conn, const uint8_t *msg, size_t size) override {
+    if (conn == upstream)
+      handle_upstream(msg, size);
+    else
+      handle_local(conn, msg, size);
+  }
+
+  void disconnected(ConnId conn) override {
+    if (conn == upstream) {
+      upstream_lost();
+      return;
+    }
+
+    auto session_it = sessions.find(conn);
+    if (session_it == sessions.end())
+      return;
+    Session session = std::move(session_it->second);
+    sessions.erase(session_it);
+
+    for (PathEntry *entry : session.observing)
+      detail::remove_unordered(entry->observers, conn);
+    for (PathEntry *entry : session.listening)
+      detail::remove_unordered(entry->listeners, conn);
+
+    for (PathEntry *entry : session.owned) {
+      if (entry->action_owner == conn)
+        entry->action_owner = 0;
+      if (entry->state_owner == conn) {
+        entry->state_owner = 0;
+        // if every request id is in use the server keeps the old value; this
+        // can't throw, as it's not handling a message from conn
+        if (upstream_ready && have_request_id()) {
+          send_buf.start_msg(0x42);
+          send_buf.write16(add_request({RequestType::Internal, {}, nullptr}));
+          send_buf.write_string(*entry->path);
+          send_buf.write_size();
+          send(upstream);
+        }
+      }
+    }
+
+    for (auto it = calls.begin(); it != calls.end();) {
+      if (it->second == conn) {
+        reply_error(upstream, it->first, "disconnected");
+        it = calls.erase(it);
+      } else
+        ++it;
+    }
+  }
+
+  std::chrono::seconds timeout(ConnId conn) const override {
+    if (conn == upstream)
+      return config.upstream_timeout;
+    auto it = sessions.find(conn);
+    return it == sessions.end() ? std::chrono::seconds(0) : it->second.timeout;
+  }
+
+  void tick() override {
+    clock::time_point now = clock::now();
+    if (!upstream) {
+      if (now >= next_connect)
+        connect_upstream();
+    } else if (upstream_ready && have_request_id() &&
+               now - last_ping >= config.upstream_timeout / 3) {
+      send_buf.start_msg(0x09);
+      send_buf.write16(add_request({RequestType::Internal, {}, nullptr}));
+      send_buf.write_size();
+      send(upstream);
+      last_ping = now;
+    }
+  }
+
+  // messages from local clients
+
+  void handle_local(ConnId conn, const uint8_t *msg, size_t size) {
+    auto session_it = sessions.find(conn);
+    if (session_it == sessions.end() || !upstream_ready)
+      throw ProtocolError();
+    Session &session = session_it->second;
+
+    detail::Parser p(msg, size);
+    uint8_t type = p.read8();
+    if (!session.hello) {
+      handle_hello(conn, session, type, p);
+      return;
+    }
+
+    switch (type) {
+    case 0x05:
+    case 0x06: {
+      // {reply, Id, Msg} or {error, Id, Msg} to a call from the server
+      uint16_t id = p.read16();
+      p.read_msgpack_raw();
+
+      auto call_it = calls.find(id);
+      if (call_it == calls.end() || call_it->second != conn)
+        break;
+      calls.erase(call_it);
+      send_message(upstream, msg, size);
+    } break;
+    case 0x09: {
+      // {ping, Id}
+      uint16_t id = p.read16();
+      p.check_empty();
+      reply_ok(conn, id);
+    } break;
+    case 0x10:
+    case 0x30:
+    case 0x40: {
+      // {action_register/event_register/state_register, Id, Path}
+      uint16_t id = p.read16();
+      PathEntry &entry = get_entry(p.read_string_view());
+      p.check_empty();
+
+      if (!forward(conn, id, msg, size))
+        break;
+      if (type == 0x10)
+        entry.action_owner = conn;
+      else if (type == 0x40)
+        entry.state_owner = conn;
+      detail::add_unique(session.owned, &entry);
+    } break;
+    case 0x11:
+    case 0x24:
+    case 0x31: {
+      // {action_call/set/event_emit, Id, Path, Msg}
+      uint16_t id = p.read16();
+      p.read_string_view();
+      p.read_msgpack_raw();
+      forward(conn, id, msg, size);
+    } break;
+    case 0x23: {
+      // {get, Id, Path}
+      uint16_t id = p.read16();
+      p.read_string_view();
+      p.check_empty();
+      forward(conn, id, msg, size);
+    } break;
+    case 0x41:
+    case 0x42: {
+      // {state_changed, Id, Path, Msg} or {state_unknown, Id, Path}
+      uint16_t id = p.read16();
+      PathEntry *entry = find_entry(p.read_string_view());
+      if (type == 0x41)
+        p.read_msgpack_raw();
+      else
+        p.check_empty();
+
+      // all local states are owned by the relay on the server, so check the
+      // owner here
+      if (!entry || entry->state_owner != conn)
+        reply_error(conn, id, "not_owner");
+      else
+        forward(conn, id, msg, size);
+    } break;
+    case 0x46: {
+      // {state_observe, Id, Path}
+      uint16_t id = p.read16();
+      PathEntry &entry = get_entry(p.read_string_view());
+      p.check_empty();
+      if (entry.observe == Status::None && !have_request_id()) {
+        reply_error(conn, id, "busy");
+        break;
+      }
+      if (detail::add_unique(session.observing, &entry))
+        entry.observers.push_back(conn);
+
+      if (entry.observe == Status::Done) {
+        counters_.observes_shared++;
+        reply_state(conn, id, entry);
+      } else {
+        if (entry.observe == Status::Pending)
+          counters_.observes_shared++;
+        else {
+          counters_.observes_forwarded++;
+          subscribe(0x46, RequestType::Observe, entry);
+          entry.observe = Status::Pending;
+        }
+        entry.observe_waiters.push_back({conn, id});
+      }
+    } break;
+    case 0x32: {
+      // {event_listen, Id, Path}
+      uint16_t id = p.read16();
+      PathEntry &entry = get_entry(p.read_string_view());
+      p.check_empty();
+      if (entry.listen == Status::None && !have_request_id()) {
+        reply_error(conn, id, "busy");
+        break;
+      }
+      if (detail::add_unique(session.listening, &entry))
+        entry.listeners.push_back(conn);
+
+      if (entry.listen == Status::Done) {
+        counters_.listens_shared++;
+        reply_ok(conn, id);
+      } else {
+        if (entry.listen == Status::Pending)
+          counters_.listens_shared++;
+        else {
+          counters_.listens_forwarded++;
+          subscribe(0x32, RequestType::Listen, entry);
+          entry.listen = Status::Pending;
+        }
+        entry.listen_waiters.push_back({conn, id});
+      }
+    } break;
+    default:
+      throw ProtocolError();
+    }
+  }
+
+  void handle_hello(ConnId conn, Session &session, uint8_t type,
+                    detail::Parser &p) {
+    if (type != 0x01 && type != 0x02)
+      throw ProtocolError();
+
+    // {hello, ProtocolVersion, Timeout} or {hello_id, ProtocolVersion,
+    // Timeout, ClientID}
+    uint8_t version = p.read8();
+    if (version != 1)
+      throw ProtocolError();
+    session.timeout = std::chrono::seconds(p.read16());
+
+    if (type == 0x02) {
+      p.read_msgpack_raw();
+      send_buf.start_msg(0x03);
+    } else {
+      p.check_empty();
+      // as in Broker, the connection id is used as the client id
+      send_buf.start_msg(0x04);
+      send_buf.write8(0xcf);
+      send_buf.write32((uint32_t)(conn >> 32));
+      send_buf.write32((uint32_t)conn);
+    }
+    send_buf.write_size();
+    send(conn);
+
+    session.hello = true;
+  }
+
+  // messages from the server
+
+  void handle_upstream(const uint8_t *msg, size_t size) {
+    detail::Parser p(msg, size);
+    uint8_t type = p.read8();
+    if (!upstream_ready) {
+      // {hello} or {hello_id, ClientID}
+      if (type == 0x04)
+        p.read_msgpack_raw();
+      else if (type != 0x03)
+        throw ProtocolError();
+      p.check_empty();
+
+      upstream_ready = true;
+      last_ping = clock::now();
+      counters_.upstream_connects++;
+      return;
+    }
+
+    switch (type) {
+    case 0x05:
+    case 0x06: {
+      // {reply, Id, Msg} or {error, Id, Msg}
+      uint16_t id = p.read16();
+      std::string_view value = p.read_msgpack_raw();
+      auto it = requests.find(id);
+      if (it == requests.end())
+        break;
+      Request request = it->second;
+      requests.erase(it);
+
+      switch (request.type) {
+      case RequestType::Forward:
+        send_buf.start_msg(type);
+        send_buf.write16(request.waiter.id);
+        send_buf.write_raw(value);
+        send_buf.write_size();
+        send(request.waiter.conn);
+        break;
+      case RequestType::Observe:
+      case RequestType::Listen: {
+        bool observe = request.type == RequestType::Observe;
+        PathEntry &entry = *request.entry;
+        // observes normally get a state reply, so this is an error
+        bool ok = type == 0x05 && !observe;
+        (observe ? entry.observe : entry.listen) =
+            ok ? Status::Done : Status::None;
+
+        auto &waiters = observe ? entry.observe_waiters : entry.listen_waiters;
+        for (Waiter &waiter : waiters) {
+          send_buf.start_msg(type);
+          send_buf.write16(waiter.id);
+          send_buf.write_raw(value);
+          send_buf.write_size();
+          send(waiter.conn);
+        }
+        waiters.clear();
+      } break;
+      case RequestType::Internal:
+        break;
+      }
+    } break;
+    case 0x07:
+    case 0x08:
+    case 0x0a:
+    case 0x0b: {
+      // {reply_state, Id, [T], [Msg]}
+      uint16_t id = p.read16();
+      uint32_t t = type >= 0x0a ? p.read32() : 0;
+      std::string_view value;
+      bool known = type == 0x07 || type == 0x0a;
+      if (known)
+        value = p.read_msgpack_raw();
+      else
+        p.check_empty();
+
+      auto it = requests.find(id);
+      if (it == requests.end() || it->second.type != RequestType::Observe)
+        break;
+      PathEntry &entry = *it->second.entry;
+      requests.erase(it);
+
+      entry.observe = Status::Done;
+      entry.known = known;
+      entry.value.assign(value);
+      entry.changed = clock::now() - std::chrono::milliseconds(t);
+      for (Waiter &waiter : entry.observe_waiters)
+        reply_state(waiter.conn, waiter.id, entry);
+      entry.observe_waiters.clear();
+    } break;
+    case 0x11: {
+      // {action_call, Id, Path, Msg}
+      uint16_t id = p.read16();
+      PathEntry *entry = find_entry(p.read_string_view());
+      p.read_msgpack_raw();
+
+      if (!entry || !entry->action_owner) {
+        reply_error(upstream, id, "disconnected");
+        break;
+      }
+      // ids are chosen by the server, so are already unique
+      calls[id] = entry->action_owner;
+      send_message(entry->action_owner, msg, size);
+    } break;
+    case 0x33: {
+      // {event_notify, Path, Msg}
+      PathEntry *entry = find_entry(p.read_string_view());
+      p.read_msgpack_raw();
+      if (entry && !entry->listeners.empty()) {
+        copy_message(msg, size);
+        send_all(entry->listeners);
+      }
+    } break;
+    case 0x44:
+    case 0x45: {
+      // {state_changed, Path, Msg} or {state_unknown, Path}
+      PathEntry *entry = find_entry(p.read_string_view());
+      std::string_view value;
+      if (type == 0x44)
+        value = p.read_msgpack_raw();
+      else
+        p.check_empty();
+      if (!entry)
+        break;
+
+      entry->known = type == 0x44;
+      entry->value.assign(value);
+      entry->changed = clock::now();
+      if (!entry->observers.empty()) {
+        copy_message(msg, size);
+        send_all(entry->observers);
+      }
+    } break;
+    default:
+      throw ProtocolError();
+    }
+  }
+
+  // the server connection
+
+  void connect_upstream() {
+    const addrinfo *addr = upstream_addr;
+    int fd = socket(addr->ai_family,
+                    addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    addr->ai_protocol);
+    if (fd >= 0 && ::connect(fd, addr->ai_addr, addr->ai_addrlen) < 0 &&
+        errno != EINPROGRESS) {
+      ::close(fd);
+      fd = -1;
+    }
+    if (fd < 0) {
+      next_address();
+      next_connect = clock::now() + config.reconnect_delay;
+      return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    upstream = loop.add_connection(fd, true);
+
+    // held by the loop until the connection is made
+    send_buf.start_msg(0x01);
+    send_buf.write8(1);
+    send_buf.write16((uint16_t)config.upstream_timeout.count());
+    send_buf.write_size();
+    send(upstream);
+  }
+
+  /// try the next of the server's addresses on the next connect
+  void next_address() {
+    upstream_addr =
+        upstream_addr->ai_next ? upstream_addr->ai_next : upstream_addrs.get();
+  }
+
+  using AddrInfo = std::unique_ptr<addrinfo, decltype(&freeaddrinfo)>;
+
+  /// look up the addresses of a TCP server; this blocks, so is only done when
+  /// the relay is made
+  static AddrInfo resolve(const std::string &host, int port) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addrs;
+    int err = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints,
+                          &addrs);
+    if (err != 0)
+      throw std::system_error(EINVAL, std::generic_category(),
+                              "can't resolve " + host + ": " +
+                                  gai_strerror(err));
+    return AddrInfo(addrs, &freeaddrinfo);
+  }
+
+  /// forget everything learned from the server, and disconnect all local
+  /// clients
+  void upstream_lost() {
+    // the connect failed or timed out
+    if (!upstream_ready)
+      next_address();
+    upstream = 0;
+    upstream_ready = false;
+    next_connect = clock::now() + config.reconnect_delay;
+
+    requests.clear();
+    calls.clear();
+    for (auto &item : entries) {
+      PathEntry &entry = item.second;
+      entry.observe = Status::None;
+      entry.known = false;
+      entry.value.clear();
+      entry.observe_waiters.clear();
+      entry.listen = Status::None;
+      entry.listen_waiters.clear();
+    }
+
+    for (auto &session : sessions)
+      loop.close(session.first);
+  }
+
+  /// send a local request to the server, with a new id; if every id is in
+  /// use, reply with a busy error instead and return false
+  bool forward(ConnId conn, uint16_t id, const uint8_t *msg, size_t size) {
+    if (!have_request_id()) {
+      reply_error(conn, id, "busy");
+      return false;
+    }
+    send_buf.start_msg(msg[0]);
+    send_buf.write16(add_request({RequestType::Forward, {conn, id}, nullptr}));
+    send_buf.write_raw({(const char *)msg + 3, size - 3});
+    send_buf.write_size();
+    send(upstream);
+    return true;
+  }
+
+  /// send an observe or listen for entry to the server; the caller must check
+  /// have_request_id first
+  void subscribe(uint8_t type, RequestType request_type, PathEntry &entry) {
+    send_buf.start_msg(type);
+    send_buf.write16(add_request({request_type, {}, &entry}));
+    send_buf.write_string(*entry.path);
+    send_buf.write_size();
+    send(upstream);
+  }
+
+  /// is there a free id for add_request?
+  bool have_request_id() const { return requests.size() <= UINT16_MAX; }
+
+  /// store a request, returning the id to send it with; throws ProtocolError
+  /// if every id is in use, so callers must check have_request_id first
+  uint16_t add_request(Request request) {
+    if (!have_request_id())
+      throw ProtocolError();
+    uint16_t id = next_request_id++;
+    while (requests.count(id))
+      id = next_request_id++;
+    requests.emplace(id, request);
+    return id;
+  }
+
+  void reply_state(ConnId conn, uint16_t id, const PathEntry &entry) {
+    using namespace std::chrono;
+    auto since_change =
+        duration_cast<milliseconds>(clock::now() - entry.changed);
+    uint32_t t =
+        (uint32_t)std::min<int64_t>(since_change.count(), UINT32_MAX);
+
+    send_buf.start_msg(entry.known ? 0x0a : 0x0b);
+    send_buf.write16(id);
+    send_buf.write32(t);
+    if (entry.known)
+      send_buf.write_raw(entry.value);
+    send_buf.write_size();
+    send(conn);
+  }
+
+  void reply_ok(ConnId conn, uint16_t id) {
+    send_buf.start_msg(0x05);
+    send_buf.write16(id);
+    send_buf.write8(0xc0); // nil
+    send_buf.write_size();
+    send(conn);
+  }
+
+  void reply_error(ConnId conn, uint16_t id, const char *error) {
+    send_buf.start_msg(0x06);
+    send_buf.write16(id);
+    send_buf.write_msgpack(error);
+    send_buf.write_size();
+    send(conn);
+  }
+
+  /// put a received message into send_buf
+  void copy_message(const uint8_t *msg, size_t size) {
+    send_buf.start_msg(msg[0]);
+    send_buf.write_raw({(const char *)msg + 1, size - 1});
+    send_buf.write_size();
+  }
+
+  void send_message(ConnId conn, const uint8_t *msg, size_t size) {
+    copy_message(msg, size);
+    send(conn);
+  }
+
+  void send(ConnId conn) {
+    loop.send(conn, (const uint8_t *)send_buf.sbuf.data(),
+              send_buf.sbuf.size());
+  }
+
+  void send_all(const std::vector<ConnId> &conns) {
+    for (ConnId conn : conns)
+      send(conn);
+  }
+
+  /// get the entry for a path, creating it if necessary
+  PathEntry &get_entry(std::string_view path) {
+    key.assign(path);
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+      it = entries.emplace(key, PathEntry{}).first;
+      it->second.path = &it->first;
+    }
+    return it->second;
+  }
+
+  PathEntry *find_entry(std::string_view path) {
+    key.assign(path);
+    auto it = entries.find(key);
+    return it == entries.end() ? nullptr : &it->second;
+  }
+
+  RelayConfig config;
+  RelayCounters counters_;
+  detail::SendBuf send_buf;
+
+  std::unordered_map<std::string, PathEntry> entries;
+  std::unordered_map<ConnId, Session> sessions;
+
+  /// the server's addresses, and the one to connect to next
+  AddrInfo upstream_addrs;
+  const addrinfo *upstream_addr;
+  /// the connection to the server, or 0
+  ConnId upstream = 0;
+  /// the server has replied to our hello
+  bool upstream_ready = false;
+  clock::time_point next_connect;
+  clock::time_point last_ping;
+
+  std::unordered_map<uint16_t, Request> requests;
+  uint16_t next_request_id = 0;
+  /// calls from the server to local actions, by the id the server sent, with
+  /// the connection handling each
+  std::unordered_map<uint16_t, ConnId> calls;
+
+  /// reused for lookups, so that finding an entry doesn't allocate
+  std::string key;
+
+  EventLoop loop;
+};
+
+} // namespace server
+} // namespace eshet
@@ -0,0 +1,42 @@
+#pragma once
+#include "eshet/server/broker.hpp"
+#include "eshet/server/event_loop.hpp"
+
+namespace eshet {
+namespace server {
+
+/// an ESHET server, running a Broker on an EventLoop
+class Server : private BrokerOutput {
+public:
+  /// start listening; this throws std::system_error if the sockets can't be
+  /// set up
+  explicit Server(ServerConfig config = {})
+      : broker_(*this), loop(broker_, std::move(config)) {}
+
+  /// the TCP port being listened on, or -1
+  int port() const { return loop.port(); }
+
+  /// run the loop until stop() is called
+  void run() { loop.run(); }
+
+  /// make run() return; this can be called from any thread, or from a signal
+  /// handler
+  void stop() { loop.stop(); }
+
+  /// the number of open connections; only call this from the thread running
+  /// the loop, or while it's stopped
+  size_t connections() const { return loop.connections(); }
+
+  const Broker &broker() const { return broker_; }
+
+private:
+  void send(ConnId conn, const uint8_t *data, size_t size) override {
+    loop.send(conn, data, size);
+  }
+
+  Broker broker_;
+  EventLoop loop;
+};
+
+} // namespace server
+} // namespace eshet
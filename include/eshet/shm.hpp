@@ -0,0 +1,412 @@
+#pragma once
+#include "eshet/fd.hpp"
+#include "eshet/parse.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <utility>
+
+namespace eshet {
+namespace detail {
+
+/// the control block at the start of each ring
+///
+/// head and tail count bytes read and written since the ring was created, and
+/// are on separate cache lines so that the two sides don't contend.
+struct ShmRingHeader {
+  alignas(64) std::atomic<uint64_t> head{0};
+  alignas(64) std::atomic<uint64_t> tail{0};
+  /// set by the consumer before it sleeps, and cleared by the producer when it
+  /// rings the consumer's doorbell; consumers start off asleep
+  alignas(64) std::atomic<uint32_t> reader_waiting{1};
+  /// set by the producer before it sleeps because the ring is full, and
+  /// cleared by the consumer when it rings the producer's doorbell
+  alignas(64) std::atomic<uint32_t> writer_waiting{0};
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+                  std::atomic<uint32_t>::is_always_lock_free,
+              "shared memory rings need address-free atomics");
+
+/// a single-producer single-consumer byte ring in shared memory
+///
+/// The data area is mapped twice, back to back, so that the readable and
+/// writable parts are always contiguous, and frames can be read in place
+/// without handling wrap-around.
+///
+/// Doorbells are not rung here: after write() the producer should call
+/// take_reader_waiting() and ring the consumer if it returns true, and the
+/// same for consume() and take_writer_waiting(). Before sleeping, each side
+/// calls its prepare_*_wait(), which only returns true if nothing happened
+/// since it last looked, so that wake-ups are not lost.
+///
+/// The peer shares the header, so head and tail are checked before use, and
+/// ProtocolError is thrown if they are inconsistent.
+class ShmRing {
+public:
+  /// map the ring at offset in memfd, which has a header_size (a multiple of
+  /// the page size) control block followed by capacity bytes of data
+  ShmRing(int memfd, size_t offset, size_t header_size, size_t capacity)
+      : header_size(header_size), capacity_(capacity) {
+    void *reserved = mmap(nullptr, map_size(), PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED)
+      check_errno(-1, "mmap");
+    base = (uint8_t *)reserved;
+
+    void *first = mmap(base, header_size + capacity, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_FIXED, memfd, offset);
+    void *second = first == MAP_FAILED
+                       ? MAP_FAILED
+                       : mmap(base + header_size + capacity, capacity,
+                              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                              memfd, offset + header_size);
+    if (second == MAP_FAILED) {
+      int err = errno;
+      munmap(base, map_size());
+      throw std::system_error(err, std::generic_category(), "mmap");
+    }
+
+    header = (ShmRingHeader *)base;
+    data = base + header_size;
+  }
+
+  ShmRing(const ShmRing &) = delete;
+  ShmRing &operator=(const ShmRing &) = delete;
+
+  ~ShmRing() { munmap(base, map_size()); }
+
+  /// initialise the control block of a newly created ring
+  void init() { new (header) ShmRingHeader(); }
+
+  size_t capacity() const { return capacity_; }
+
+  // producer side
+
+  /// copy as much of data into the ring as will fit, returning the number of
+  /// bytes written
+  size_t write(const uint8_t *src, size_t size) {
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    size_t used = checked_used(header->head.load(std::memory_order_acquire),
+                               tail);
+    size_t n = std::min(size, capacity_ - used);
+    if (!n)
+      return 0;
+
+    memcpy(data + (tail & (capacity_ - 1)), src, n);
+    header->tail.store(tail + n, std::memory_order_seq_cst);
+    return n;
+  }
+
+  /// should the consumer be woken after a write?
+  bool take_reader_waiting() {
+    return header->reader_waiting.load(std::memory_order_seq_cst) &&
+           header->reader_waiting.exchange(0, std::memory_order_seq_cst);
+  }
+
+  /// call before sleeping because the ring is full; returns false if space
+  /// was made in the meantime
+  bool prepare_write_wait() {
+    header->writer_waiting.store(1, std::memory_order_seq_cst);
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    if (checked_used(header->head.load(std::memory_order_seq_cst), tail) <
+        capacity_) {
+      header->writer_waiting.store(0, std::memory_order_relaxed);
+      return false;
+    }
+    return true;
+  }
+
+  // consumer side
+
+  /// the data which can be read, which stays valid until consume()
+  std::pair<const uint8_t *, size_t> readable() {
+    uint64_t head = header->head.load(std::memory_order_relaxed);
+    seen_tail = header->tail.load(std::memory_order_acquire);
+    size_t used = checked_used(head, seen_tail);
+    return {data + (head & (capacity_ - 1)), used};
+  }
+
+  /// release size bytes from the start of readable()
+  void consume(size_t size) {
+    uint64_t head = header->head.load(std::memory_order_relaxed);
+    header->head.store(head + size, std::memory_order_seq_cst);
+  }
+
+  /// should the producer be woken after consume()?
+  bool take_writer_waiting() {
+    return header->writer_waiting.load(std::memory_order_seq_cst) &&
+           header->writer_waiting.exchange(0, std::memory_order_seq_cst);
+  }
+
+  /// call before sleeping; returns false if data was written since the last
+  /// call to readable()
+  bool prepare_read_wait() {
+    header->reader_waiting.store(1, std::memory_order_seq_cst);
+    if (header->tail.load(std::memory_order_seq_cst) != seen_tail) {
+      header->reader_waiting.store(0, std::memory_order_relaxed);
+      return false;
+    }
+    return true;
+  }
+
+private:
+  size_t map_size() const { return header_size + 2 * capacity_; }
+
+  size_t checked_used(uint64_t head, uint64_t tail) const {
+    if (tail - head > capacity_)
+      throw ProtocolError();
+    return tail - head;
+  }
+
+  size_t header_size;
+  size_t capacity_;
+  uint8_t *base;
+  ShmRingHeader *header;
+  uint8_t *data;
+  /// the tail seen by the last readable() on the consumer side
+  uint64_t seen_tail = 0;
+};
+
+/// the two rings and doorbells of a shared memory connection
+///
+/// The server creates a memfd holding a ring for each direction and three
+/// eventfd doorbells: one which the client rings for the server, and one
+/// each for the client's receive thread and its writer. These are passed to
+/// the client over a Unix socket, which then carries nothing else, but is
+/// kept open so that either side can see the other go away.
+///
+/// Frames are written to the rings in the same format as on a socket, so
+/// Unpacker and the server's framing work unchanged. A doorbell is only rung
+/// when the other side is waiting, so a busy connection makes no system calls.
+class ShmConnection {
+public:
+  /// create the shared memory and doorbells for a new connection, on the
+  /// server side; capacity is rounded up to a power of two multiple of the
+  /// page size which can hold the largest frame
+  static std::unique_ptr<ShmConnection> create(size_t capacity) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t header_size = std::max(page, sizeof(ShmRingHeader));
+    size_t rounded = page;
+    while (rounded < std::max(capacity, max_frame_size))
+      rounded *= 2;
+
+    Fd memfd(check_errno(memfd_create("eshet", MFD_CLOEXEC), "memfd_create"));
+    check_errno(ftruncate(memfd.get(), 2 * (header_size + rounded)),
+                "ftruncate");
+
+    std::unique_ptr<ShmConnection> conn(new ShmConnection(
+        std::move(memfd), make_bell(), make_bell(), make_bell(), header_size,
+        rounded, true));
+    conn->in.init();
+    conn->out.init();
+    return conn;
+  }
+
+  /// send the shared memory and doorbells to the client
+  void send_to(int sock) const {
+    Handshake handshake = {handshake_magic, (uint32_t)header_size,
+                           out.capacity()};
+    int fds[4] = {memfd.get(), server_bell.get(), client_data_bell.get(),
+                  client_space_bell.get()};
+
+    iovec iov = {&handshake, sizeof(handshake)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (check_errno(sendmsg(sock, &msg, MSG_NOSIGNAL), "sendmsg") !=
+        sizeof(handshake))
+      throw std::system_error(EIO, std::generic_category(), "sendmsg");
+  }
+
+  /// receive the shared memory and doorbells from the server, on the client
+  /// side; this throws std::runtime_error if sock doesn't send them
+  static std::unique_ptr<ShmConnection> receive(int sock) {
+    Handshake handshake;
+    iovec iov = {&handshake, sizeof(handshake)};
+    alignas(cmsghdr) char control[CMSG_SPACE(4 * sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    // the server sends this immediately, so don't wait long for something
+    // which isn't coming
+    timeval tv = {5, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ssize_t n = check_errno(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC), "recvmsg");
+
+    // take ownership of any fds first, so that they are closed on error
+    Fd fds[4];
+    size_t n_fds = 0;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t i = 0; i < count; i++) {
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        Fd owned(fd);
+        if (n_fds < 4)
+          fds[n_fds++] = std::move(owned);
+      }
+    }
+
+    if (n != sizeof(handshake) || handshake.magic != handshake_magic ||
+        n_fds != 4 || (msg.msg_flags & MSG_CTRUNC))
+      throw std::runtime_error("bad shared memory handshake");
+
+    size_t capacity = handshake.capacity;
+    size_t header_size = handshake.header_size;
+    struct stat st;
+    check_errno(fstat(fds[0].get(), &st), "fstat");
+    if (capacity == 0 || (capacity & (capacity - 1)) ||
+        header_size < sizeof(ShmRingHeader) ||
+        (size_t)st.st_size < 2 * (header_size + capacity))
+      throw std::runtime_error("bad shared memory handshake");
+
+    return std::unique_ptr<ShmConnection>(new ShmConnection(
+        std::move(fds[0]), std::move(fds[1]), std::move(fds[2]),
+        std::move(fds[3]), header_size, capacity, false));
+  }
+
+  ShmConnection(const ShmConnection &) = delete;
+  ShmConnection &operator=(const ShmConnection &) = delete;
+
+  /// write as much of data as will fit, waking the peer if it's waiting;
+  /// returns the number of bytes written
+  size_t write_some(const uint8_t *data, size_t size) {
+    size_t n = out.write(data, size);
+    if (n && out.take_reader_waiting())
+      ring(server_side ? client_data_bell : server_bell);
+    return n;
+  }
+
+  /// see ShmRing::prepare_write_wait
+  bool prepare_write_wait() { return out.prepare_write_wait(); }
+
+  /// write all of data, blocking while the ring is full; returns false if
+  /// sock is closed or the ring is corrupt
+  bool write_all(const uint8_t *data, size_t size, int sock) {
+    try {
+      while (size) {
+        size_t n = write_some(data, size);
+        data += n;
+        size -= n;
+        if (size && out.prepare_write_wait() && !wait(space_bell(), sock))
+          return false;
+      }
+    } catch (ProtocolError &) {
+      return false;
+    }
+    return true;
+  }
+
+  /// see ShmRing::readable
+  std::pair<const uint8_t *, size_t> readable() { return in.readable(); }
+
+  /// release data from readable(), waking the peer if it's waiting for space
+  void consume(size_t size) {
+    in.consume(size);
+    if (in.take_writer_waiting())
+      ring(server_side ? client_space_bell : server_bell);
+  }
+
+  /// see ShmRing::prepare_read_wait
+  bool prepare_read_wait() { return in.prepare_read_wait(); }
+
+  /// the doorbell which is rung when there is data to read; on the server
+  /// this is also rung when space is made for writing
+  int data_bell() const {
+    return server_side ? server_bell.get() : client_data_bell.get();
+  }
+
+  /// the doorbell which is rung when space is made for writing
+  int space_bell() const {
+    return server_side ? server_bell.get() : client_space_bell.get();
+  }
+
+  /// reset a doorbell after it has been rung
+  static void clear_bell(int bell) {
+    uint64_t count;
+    if (read(bell, &count, sizeof(count)) < 0)
+      return;
+  }
+
+  /// wait until bell is rung (and clear it), returning false if sock is
+  /// closed first
+  static bool wait(int bell, int sock) {
+    pollfd fds[2] = {{bell, POLLIN, 0}, {sock, POLLIN, 0}};
+    while (poll(fds, 2, -1) < 0)
+      if (errno != EINTR)
+        return false;
+    if (fds[1].revents)
+      return false;
+    clear_bell(bell);
+    return true;
+  }
+
+private:
+  struct Handshake {
+    uint32_t magic;
+    uint32_t header_size;
+    uint64_t capacity;
+  };
+  static constexpr uint32_t handshake_magic = 0x45534d31; // "ESM1"
+  static constexpr size_t max_frame_size = 3 + 0xffff;
+
+  ShmConnection(Fd memfd, Fd server_bell, Fd client_data_bell,
+                Fd client_space_bell, size_t header_size, size_t capacity,
+                bool server_side)
+      : memfd(std::move(memfd)), server_bell(std::move(server_bell)),
+        client_data_bell(std::move(client_data_bell)),
+        client_space_bell(std::move(client_space_bell)),
+        header_size(header_size), server_side(server_side),
+        // the client to server ring comes first
+        in(this->memfd.get(), server_side ? 0 : header_size + capacity,
+           header_size, capacity),
+        out(this->memfd.get(), server_side ? header_size + capacity : 0,
+            header_size, capacity) {}
+
+  static Fd make_bell() {
+    return Fd(check_errno(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), "eventfd"));
+  }
+
+  static void ring(const Fd &bell) {
+    uint64_t one = 1;
+    if (write(bell.get(), &one, sizeof(one)) < 0)
+      return;
+  }
+
+  Fd memfd;
+  Fd server_bell;
+  Fd client_data_bell;
+  Fd client_space_bell;
+  size_t header_size;
+  bool server_side;
+  ShmRing in;
+  ShmRing out;
+};
+
+} // namespace detail
+} // namespace eshet
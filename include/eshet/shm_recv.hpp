@@ -0,0 +1,77 @@
+#pragma once
+#include "actorpp/actor.hpp"
+#include "actorpp/net.hpp"
+#include "eshet/buffer_pool.hpp"
+#include "eshet/shm.hpp"
+#include <memory>
+
+namespace eshet {
+namespace detail {
+
+/// the equivalent of actorpp::RecvThread for a shared memory connection:
+/// copies data from the server's ring into buffers from pool and pushes them
+/// to on_message, and pushes to on_close when the connection's socket is
+/// closed
+class ShmRecvThread : public actorpp::Actor {
+public:
+  ShmRecvThread(std::shared_ptr<ShmConnection> shm, int sockfd,
+                std::shared_ptr<BufferPool> pool,
+                actorpp::Channel<BufferRef> on_message,
+                actorpp::Channel<actorpp::CloseReason> on_close)
+      : shm(std::move(shm)), sockfd(sockfd), pool(std::move(pool)),
+        on_message(std::move(on_message)),
+        on_close(std::move(on_close)),
+        exit_fd(check_errno(eventfd(0, EFD_CLOEXEC), "eventfd")) {}
+
+  void run() {
+    try {
+      while (true) {
+        auto [data, size] = shm->readable();
+        if (size) {
+          BufferRef buf = pool->acquire();
+          size = std::min(size, buf.capacity());
+          memcpy(buf.data(), data, size);
+          buf.resize(size);
+          on_message.push(std::move(buf));
+          shm->consume(size);
+          continue;
+        }
+        if (!shm->prepare_read_wait())
+          continue;
+
+        pollfd fds[3] = {{shm->data_bell(), POLLIN, 0},
+                         {sockfd, POLLIN, 0},
+                         {exit_fd.get(), POLLIN, 0}};
+        if (poll(fds, 3, -1) < 0) {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+        if (fds[2].revents)
+          return;
+        if (fds[1].revents)
+          break;
+        ShmConnection::clear_bell(shm->data_bell());
+      }
+    } catch (ProtocolError &) {
+    }
+    on_close.push(actorpp::CloseReason::Error);
+  }
+
+  void exit() {
+    uint64_t one = 1;
+    if (write(exit_fd.get(), &one, sizeof(one)) < 0)
+      return;
+  }
+
+private:
+  std::shared_ptr<ShmConnection> shm;
+  int sockfd;
+  std::shared_ptr<BufferPool> pool;
+  actorpp::Channel<BufferRef> on_message;
+  actorpp::Channel<actorpp::CloseReason> on_close;
+  Fd exit_fd;
+};
+
+} // namespace detail
+} // namespace eshet
@@ -0,0 +1,131 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace eshet {
+
+/// fixed-size work-stealing thread pool
+///
+/// Each worker has its own queue; tasks submitted from a worker go onto that
+/// worker's queue, and other tasks are distributed round-robin. Idle workers
+/// steal from the front of other workers' queues.
+///
+/// On destruction, all submitted tasks are ran before the workers exit.
+class ThreadPool {
+public:
+  using Task = std::function<void()>;
+
+  explicit ThreadPool(size_t n_threads = std::thread::hardware_concurrency()) {
+    if (n_threads == 0)
+      n_threads = 1;
+
+    for (size_t i = 0; i < n_threads; i++)
+      workers.emplace_back(std::make_unique<Worker>());
+    for (size_t i = 0; i < n_threads; i++)
+      threads.emplace_back([this, i]() { worker_loop(i); });
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> guard(sleep_mut);
+      stopping = true;
+    }
+    sleep_cv.notify_all();
+
+    for (auto &thread : threads)
+      thread.join();
+  }
+
+  void submit(Task task) {
+    size_t idx;
+    if (current().first == this)
+      idx = current().second;
+    else
+      idx = next_worker++ % workers.size();
+
+    // count the task before it's visible so that queued never underflows
+    {
+      std::lock_guard<std::mutex> guard(sleep_mut);
+      queued++;
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(workers[idx]->mut);
+      workers[idx]->tasks.push_back(std::move(task));
+    }
+    sleep_cv.notify_one();
+  }
+
+  size_t size() const { return workers.size(); }
+
+private:
+  struct Worker {
+    std::mutex mut;
+    std::deque<Task> tasks;
+  };
+
+  // the pool and worker index of the current thread, if it is a worker
+  static std::pair<ThreadPool *, size_t> &current() {
+    static thread_local std::pair<ThreadPool *, size_t> current{nullptr, 0};
+    return current;
+  }
+
+  void worker_loop(size_t idx) {
+    current() = {this, idx};
+
+    while (true) {
+      Task task;
+      if (take(idx, task)) {
+        task();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(sleep_mut);
+      sleep_cv.wait(lock, [&]() { return queued > 0 || stopping; });
+      if (queued == 0 && stopping)
+        return;
+    }
+  }
+
+  // take a task from the back of our queue, or steal from the front of
+  // another
+  bool take(size_t idx, Task &task) {
+    for (size_t i = 0; i < workers.size(); i++) {
+      Worker &worker = *workers[(idx + i) % workers.size()];
+      std::lock_guard<std::mutex> guard(worker.mut);
+      if (worker.tasks.empty())
+        continue;
+
+      if (i == 0) {
+        task = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+      } else {
+        task = std::move(worker.tasks.front());
+        worker.tasks.pop_front();
+      }
+      queued--;
+      return true;
+    }
+    return false;
+  }
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::atomic<size_t> next_worker{0};
+
+  std::mutex sleep_mut;
+  std::condition_variable sleep_cv;
+  std::atomic<size_t> queued{0};
+  bool stopping = false;
+};
+
+} // namespace eshet
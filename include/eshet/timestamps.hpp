@@ -0,0 +1,161 @@
+#pragma once
+#include "data.hpp"
+#include "fd.hpp"
+#include "metrics.hpp"
+#include <cstring>
+#include <deque>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace eshet {
+namespace detail {
+
+/// kernel software timestamps for the socket of one connection (see
+/// SocketConfig::timestamping)
+///
+/// The receive thread reads with recv, which queues the receive timestamp of
+/// each chunk of data; the client takes them with pop_rx in the same order as
+/// it takes the chunks. The writer calls sent after each write, and the
+/// receive thread calls read_tx to match transmit timestamps from the socket's
+/// error queue to those writes, recording the difference in
+/// ClientMetrics::tx_delay_ns.
+class SocketTimestamps {
+public:
+  /// enable timestamps on sockfd, with transmit timestamps if tx is set
+  /// (which needs TCP); throws std::system_error if they are not supported
+  SocketTimestamps(int sockfd, bool tx, std::shared_ptr<ClientMetrics> metrics)
+      : tx(tx), metrics(std::move(metrics)) {
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (tx)
+      flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+               SOF_TIMESTAMPING_OPT_TSONLY;
+    check_errno(setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                           sizeof(flags)),
+                "setsockopt(SO_TIMESTAMPING)");
+  }
+
+  /// like recv with MSG_DONTWAIT, queueing the receive timestamp (if there is
+  /// one) when data is read
+  ssize_t recv(int sockfd, uint8_t *data, size_t size) {
+    iovec iov = {data, size};
+    alignas(cmsghdr) char control[256];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+    if (n > 0) {
+      std::lock_guard<std::mutex> guard(mut);
+      rx_times.push_back(find_timestamp(msg));
+    }
+    return n;
+  }
+
+  /// get the receive timestamp of the oldest chunk of data not yet taken
+  std::optional<Timestamp> pop_rx() {
+    std::lock_guard<std::mutex> guard(mut);
+    if (rx_times.empty())
+      return {};
+    std::optional<Timestamp> t = rx_times.front();
+    rx_times.pop_front();
+    return t;
+  }
+
+  /// the current time, to pass to sent
+  static Timestamp now() {
+    return std::chrono::time_point_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now());
+  }
+
+  /// record that size bytes were written to the socket by a write which
+  /// started at start
+  void sent(size_t size, Timestamp start) {
+    if (!tx)
+      return;
+    // with SOF_TIMESTAMPING_OPT_ID, TCP timestamps are keyed by the offset of
+    // the last byte of each write
+    bytes_sent += size;
+    std::lock_guard<std::mutex> guard(mut);
+    if (pending_tx.size() >= max_pending_tx)
+      pending_tx.pop_front();
+    pending_tx.push_back({bytes_sent - 1, start});
+  }
+
+  /// read all transmit timestamps from the socket's error queue
+  void read_tx(int sockfd) {
+    while (tx) {
+      alignas(cmsghdr) char control[256];
+      msghdr msg = {};
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        return;
+
+      std::optional<Timestamp> t = find_timestamp(msg);
+      for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (!((c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) ||
+              (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR)))
+          continue;
+        sock_extended_err err;
+        memcpy(&err, CMSG_DATA(c), sizeof(err));
+        if (t && err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+          match_tx(err.ee_data, *t);
+      }
+    }
+  }
+
+private:
+  struct PendingTx {
+    uint32_t key;
+    Timestamp sent;
+  };
+
+  static std::optional<Timestamp> find_timestamp(msghdr &msg) {
+    for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPING)
+        continue;
+      scm_timestamping ts;
+      memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+      // software timestamps are in the first slot
+      return Timestamp(std::chrono::seconds(ts.ts[0].tv_sec) +
+                       std::chrono::nanoseconds(ts.ts[0].tv_nsec));
+    }
+    return {};
+  }
+
+  // record the delay for the write with this key, dropping any earlier ones
+  // whose timestamps were not reported (for example because TCP coalesced
+  // them into the same packet)
+  void match_tx(uint32_t key, Timestamp t) {
+    std::lock_guard<std::mutex> guard(mut);
+    while (!pending_tx.empty() && (int32_t)(pending_tx.front().key - key) < 0)
+      pending_tx.pop_front();
+    if (pending_tx.empty() || pending_tx.front().key != key)
+      return;
+
+    auto delay = t - pending_tx.front().sent;
+    metrics->tx_delay_ns.record(delay.count() > 0 ? delay.count() : 0);
+    pending_tx.pop_front();
+  }
+
+  // limit on writes waiting for a timestamp, in case some are never reported
+  static constexpr size_t max_pending_tx = 4096;
+
+  bool tx;
+  std::shared_ptr<ClientMetrics> metrics;
+  // only used by the writer, with its lock held
+  uint32_t bytes_sent = 0;
+
+  std::mutex mut;
+  std::deque<std::optional<Timestamp>> rx_times;
+  std::deque<PendingTx> pending_tx;
+};
+
+} // namespace detail
+} // namespace eshet
@@ -0,0 +1,285 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace eshet {
+
+/// a span recorded by TraceSink
+struct TraceEvent {
+  const char *name;
+  const char *cat;
+  /// name of arg, or nullptr if there is no argument
+  const char *arg_name;
+  uint64_t arg;
+  /// steady_clock time in nanoseconds
+  uint64_t start_ns;
+  uint64_t dur_ns;
+  uint32_t tid;
+};
+
+/// process-wide in-memory trace of client activity, which can be written in
+/// Chrome trace format (viewable in chrome://tracing or ui.perfetto.dev)
+///
+/// Tracing is off by default; while off, each trace point costs one relaxed
+/// atomic load. Events are recorded into a fixed-size lock-free ring, so only
+/// the most recent events are kept.
+///
+/// The recorded spans, by category, are:
+///
+/// - enqueue: a command or reply was pushed onto a lane (named by lane) on the
+///   calling thread
+/// - queue: the time from enqueue until the client thread picked it up
+/// - encode: a message was encoded into a send buffer
+/// - write: a message was written to the socket
+/// - dispatch: a received message was parsed and handled; replies are named
+///   "reply parse", and everything else "dispatch"
+/// - result: a reply was pushed to the result channel
+class TraceSink {
+public:
+  static TraceSink &global() {
+    static TraceSink sink;
+    return sink;
+  }
+
+  /// start recording; the ring is allocated with room for capacity events
+  /// (rounded up to a power of two) the first time this is called
+  void start(size_t capacity = 1 << 16) {
+    std::lock_guard<std::mutex> guard(mut);
+    if (!ring) {
+      size_t size = 1;
+      while (size < capacity)
+        size *= 2;
+      ring_storage = std::make_unique<Slot[]>(size);
+      ring_mask = size - 1;
+      ring = ring_storage.get();
+    }
+    enabled_flag.store(true, std::memory_order_release);
+  }
+
+  void stop() { enabled_flag.store(false, std::memory_order_release); }
+
+  bool enabled() const {
+    return enabled_flag.load(std::memory_order_relaxed);
+  }
+
+  /// discard all recorded events
+  void clear() {
+    std::lock_guard<std::mutex> guard(mut);
+    cleared = head.load(std::memory_order_acquire);
+  }
+
+  /// name the current thread in the output
+  void set_thread_name(std::string name) {
+    std::lock_guard<std::mutex> guard(mut);
+    thread_names[thread_id()] = std::move(name);
+  }
+
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  void record(const char *name, const char *cat, uint64_t start_ns,
+              uint64_t end_ns, const char *arg_name = nullptr,
+              uint64_t arg = 0) {
+    if (!enabled_flag.load(std::memory_order_acquire))
+      return;
+    Slot *slots = ring;
+
+    // seqlock: the sequence is odd while the slot is being written, and
+    // 2(n+1) once event n is complete
+    uint64_t n = head.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = slots[n & ring_mask];
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.cat.store(cat, std::memory_order_relaxed);
+    slot.arg_name.store(arg_name, std::memory_order_relaxed);
+    slot.arg.store(arg, std::memory_order_relaxed);
+    slot.start_ns.store(start_ns, std::memory_order_relaxed);
+    slot.dur_ns.store(end_ns > start_ns ? end_ns - start_ns : 0,
+                      std::memory_order_relaxed);
+    slot.tid.store(thread_id(), std::memory_order_relaxed);
+
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+  }
+
+  /// get the events currently in the ring, oldest first; events being written
+  /// concurrently are skipped
+  std::vector<TraceEvent> events() const {
+    std::vector<TraceEvent> result;
+    std::lock_guard<std::mutex> guard(mut);
+    if (!ring)
+      return result;
+
+    uint64_t end = head.load(std::memory_order_acquire);
+    uint64_t start = end > ring_mask + 1 ? end - (ring_mask + 1) : 0;
+    if (start < cleared)
+      start = cleared;
+
+    for (uint64_t n = start; n < end; n++) {
+      const Slot &slot = ring[n & ring_mask];
+      uint64_t seq = slot.seq.load(std::memory_order_acquire);
+      if (seq != 2 * n + 2)
+        continue;
+
+      TraceEvent event;
+      event.name = slot.name.load(std::memory_order_relaxed);
+      event.cat = slot.cat.load(std::memory_order_relaxed);
+      event.arg_name = slot.arg_name.load(std::memory_order_relaxed);
+      event.arg = slot.arg.load(std::memory_order_relaxed);
+      event.start_ns = slot.start_ns.load(std::memory_order_relaxed);
+      event.dur_ns = slot.dur_ns.load(std::memory_order_relaxed);
+      event.tid = slot.tid.load(std::memory_order_relaxed);
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) != seq)
+        continue;
+      result.push_back(event);
+    }
+    return result;
+  }
+
+  /// write the recorded events as Chrome trace JSON
+  void write_chrome_json(std::ostream &out) const {
+    std::vector<TraceEvent> evs = events();
+    uint64_t base = evs.empty() ? 0 : evs.front().start_ns;
+    for (auto &event : evs)
+      if (event.start_ns < base)
+        base = event.start_ns;
+
+    int pid = (int)getpid();
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    auto sep = [&]() {
+      if (!first)
+        out << ",\n";
+      first = false;
+    };
+
+    for (auto &event : evs) {
+      sep();
+      out << "{\"name\":\"" << event.name << "\",\"cat\":\"" << event.cat
+          << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << event.tid
+          << ",\"ts\":" << format_us(event.start_ns - base)
+          << ",\"dur\":" << format_us(event.dur_ns);
+      if (event.arg_name)
+        out << ",\"args\":{\"" << event.arg_name << "\":" << event.arg << "}";
+      out << "}";
+    }
+
+    std::map<uint32_t, std::string> names;
+    {
+      std::lock_guard<std::mutex> guard(mut);
+      names = thread_names;
+    }
+    for (auto &name : names) {
+      sep();
+      out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+          << ",\"tid\":" << name.first << ",\"args\":{\"name\":\""
+          << escape(name.second) << "\"}}";
+    }
+
+    out << "]}\n";
+  }
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<const char *> name{nullptr};
+    std::atomic<const char *> cat{nullptr};
+    std::atomic<const char *> arg_name{nullptr};
+    std::atomic<uint64_t> arg{0};
+    std::atomic<uint64_t> start_ns{0};
+    std::atomic<uint64_t> dur_ns{0};
+    std::atomic<uint32_t> tid{0};
+  };
+
+  // small sequential ids, which are easier to read than OS thread ids
+  static uint32_t thread_id() {
+    static std::atomic<uint32_t> next_id{1};
+    static thread_local uint32_t id = next_id++;
+    return id;
+  }
+
+  static std::string format_us(uint64_t ns) {
+    std::string s = std::to_string(ns / 1000) + ".";
+    std::string frac = std::to_string(ns % 1000);
+    return s + std::string(3 - frac.size(), '0') + frac;
+  }
+
+  static std::string escape(const std::string &s) {
+    std::string out;
+    for (char c : s) {
+      if (c == '"' || c == '\\')
+        out += '\\';
+      if ((unsigned char)c >= 0x20)
+        out += c;
+    }
+    return out;
+  }
+
+  std::atomic<bool> enabled_flag{false};
+  std::atomic<uint64_t> head{0};
+
+  // ring is set once in start() before tracing is first enabled, and is never
+  // reallocated, so that record() doesn't need to lock
+  Slot *ring = nullptr;
+  std::unique_ptr<Slot[]> ring_storage;
+  uint64_t ring_mask = 0;
+  uint64_t cleared = 0;
+
+  mutable std::mutex mut;
+  std::map<uint32_t, std::string> thread_names;
+};
+
+namespace detail {
+
+/// the current time if tracing is enabled, otherwise 0
+inline uint64_t trace_start() {
+  return TraceSink::global().enabled() ? TraceSink::now() : 0;
+}
+
+/// record a span from start (from trace_start) until now
+inline void trace_end(uint64_t start, const char *name, const char *cat,
+                      const char *arg_name = nullptr, uint64_t arg = 0) {
+  if (start)
+    TraceSink::global().record(name, cat, start, TraceSink::now(), arg_name,
+                               arg);
+}
+
+/// record a span for the lifetime of this object
+class TraceSpan {
+public:
+  TraceSpan(const char *name, const char *cat, const char *arg_name = nullptr,
+            uint64_t arg = 0)
+      : name(name), cat(cat), arg_name(arg_name), arg(arg),
+        start(trace_start()) {}
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+  ~TraceSpan() { trace_end(start, name, cat, arg_name, arg); }
+
+  void set_name(const char *new_name) { name = new_name; }
+
+private:
+  const char *name;
+  const char *cat;
+  const char *arg_name;
+  uint64_t arg;
+  uint64_t start;
+};
+
+} // namespace detail
+} // namespace eshet
@@ -0,0 +1,158 @@
+#pragma once
+#include "data.hpp"
+#include "decode.hpp"
+#include <stdexcept>
+#include <string_view>
+
+namespace eshet {
+
+namespace detail {
+/// 64-bit FNV-1a hash, which can be computed at compile time
+constexpr uint64_t fnv1a(std::string_view s) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (char c : s) {
+    hash ^= (uint8_t)c;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+} // namespace detail
+
+/// an ESHET path, which is checked and hashed at compile time when it is a
+/// constant
+///
+/// A path must start with '/', and must not end with '/' or contain empty
+/// components; for constant paths this is a compile error, otherwise it
+/// throws std::invalid_argument.
+///
+/// The path is not copied, so this can only be constructed from a character
+/// array (normally a string literal) rather than a pointer, which would make
+/// it easy to keep a pointer into a temporary std::string.
+class PathName {
+public:
+  template <size_t N>
+  constexpr PathName(const char (&name)[N])
+      : path(check(name)), path_hash(detail::fnv1a(path)) {}
+
+  constexpr std::string_view str() const { return path; }
+  constexpr uint64_t hash() const { return path_hash; }
+
+  constexpr bool operator==(const PathName &other) const {
+    return path_hash == other.path_hash && path == other.path;
+  }
+  constexpr bool operator!=(const PathName &other) const {
+    return !(*this == other);
+  }
+
+private:
+  static constexpr std::string_view check(std::string_view path) {
+    if (path.size() < 2 || path[0] != '/' || path[path.size() - 1] == '/')
+      throw std::invalid_argument("invalid ESHET path");
+    for (size_t i = 1; i < path.size(); i++)
+      if (path[i] == '/' && path[i - 1] == '/')
+        throw std::invalid_argument("invalid ESHET path");
+    return path;
+  }
+
+  std::string_view path;
+  uint64_t path_hash;
+};
+
+/// a handle for an event whose values are of type T, for use with the
+/// ESHETClient methods which take one:
+///
+///     constexpr TypedEvent<Pose> pose_event{"/robot/pose"};
+///     client.event_emit(pose_event, pose, result_chan);
+///
+/// Values are packed directly from T when emitted, and decoded directly into
+/// T when received (see detail::Decoder).
+template <typename T> class TypedEvent {
+public:
+  using value_type = T;
+
+  constexpr explicit TypedEvent(PathName path) : path_name(path) {}
+
+  constexpr const PathName &path() const { return path_name; }
+
+private:
+  PathName path_name;
+};
+
+/// a handle for a state whose values are of type T; like TypedEvent, but
+/// observers receive a std::optional<T>, which is empty while the state is
+/// unknown
+template <typename T> class TypedState {
+public:
+  using value_type = T;
+
+  constexpr explicit TypedState(PathName path) : path_name(path) {}
+
+  constexpr const PathName &path() const { return path_name; }
+
+private:
+  PathName path_name;
+};
+
+namespace detail {
+
+/// where values for a TypedEvent or TypedState are sent, which knows their
+/// type; called from the client thread, which catches and logs
+/// msgpack::type_error for values which don't match
+struct TypedSink {
+  explicit TypedSink(std::string_view path) : path(path) {}
+  virtual ~TypedSink() {}
+  /// deliver an encoded value
+  virtual void deliver(const char *data, size_t size) = 0;
+  /// deliver a value which has already been unpacked
+  virtual void deliver(const msgpack::object &value) = 0;
+  /// the state is unknown
+  virtual void unknown() {}
+
+  std::string path;
+};
+
+template <typename T> struct TypedEventSink : public TypedSink {
+  TypedEventSink(std::string_view path, Channel<T> chan)
+      : TypedSink(path), chan(std::move(chan)) {}
+
+  void deliver(const char *data, size_t size) override {
+    chan.push(decode_msgpack<T>(data, size));
+  }
+  void deliver(const msgpack::object &value) override {
+    chan.push(value.as<T>());
+  }
+
+  Channel<T> chan;
+};
+
+template <typename T> struct TypedStateSink : public TypedSink {
+  TypedStateSink(std::string_view path, Channel<std::optional<T>> chan)
+      : TypedSink(path), chan(std::move(chan)) {}
+
+  void deliver(const char *data, size_t size) override {
+    chan.push(decode_msgpack<T>(data, size));
+  }
+  void deliver(const msgpack::object &value) override {
+    chan.push(value.as<T>());
+  }
+  void unknown() override { chan.push(std::nullopt); }
+
+  Channel<std::optional<T>> chan;
+};
+
+/// a stream for msgpack::pack which writes to a string, so that small values
+/// don't need an allocation
+struct StringWriter {
+  std::string data;
+  void write(const char *buf, size_t len) { data.append(buf, len); }
+};
+
+/// pack value into a string
+template <typename T> std::string encode_msgpack(const T &value) {
+  StringWriter writer;
+  msgpack::pack(writer, value);
+  return std::move(writer.data);
+}
+
+} // namespace detail
+} // namespace eshet
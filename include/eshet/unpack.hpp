@@ -1,44 +1,127 @@
 #pragma once
+#include "buffer_pool.hpp"
 #include "parse.hpp"
+#include "probes.hpp"
 #include <optional>
 #include <vector>
 
 namespace eshet {
 namespace detail {
 
+/// a complete message from the Unpacker, without its header, which refers to
+/// the buffer it was received in
+struct Frame {
+  BufferRef buf;
+  const uint8_t *ptr = nullptr;
+  size_t len = 0;
+
+  const uint8_t *data() const { return ptr; }
+  size_t size() const { return len; }
+  const uint8_t &operator[](size_t i) const { return ptr[i]; }
+  const uint8_t *begin() const { return ptr; }
+  const uint8_t *end() const { return ptr + len; }
+};
+
 // accept a stream of data in arbitrary chunks, and produce complete messages
+//
+// Messages which are within one chunk refer to it rather than being copied;
+// those which span chunks are copied into a buffer from pool (or an unpooled
+// buffer if there is no pool).
 class Unpacker {
-  std::vector<uint8_t> buffer;
-
 public:
-  void push(std::vector<uint8_t> buf) {
-    for (uint8_t chr : buf)
-      buffer.push_back(chr);
+  explicit Unpacker(std::shared_ptr<BufferPool> pool = {})
+      : pool(std::move(pool)) {}
+
+  /// add a chunk of data; all messages from the previous chunk must have been
+  /// read
+  void push(BufferRef chunk) {
+    current = std::move(chunk);
+    pos = 0;
+  }
+
+  void push(const std::vector<uint8_t> &data) {
+    push(BufferRef::copy_of(data.data(), data.size()));
+  }
+
+  std::optional<Frame> read() {
+    while (true) {
+      size_t avail = current.size() - pos;
+
+      // the common case: a whole message in the current chunk
+      if (header_size == 0 && avail >= 3) {
+        const uint8_t *start = current.data() + pos;
+        uint16_t length = parse_header(start);
+        if (avail >= 3 + (size_t)length) {
+          ESHET_PROBE2(unpack, length, avail);
+          pos += 3 + length;
+          return Frame{current, start + 3, length};
+        }
+      }
+
+      if (avail == 0) {
+        // let the buffer be reused once the messages in it are gone
+        current = BufferRef();
+        pos = 0;
+        return std::nullopt;
+      }
+
+      // otherwise, copy the start of a message which continues in the next
+      // chunk, or the end of one which started in a previous chunk
+      if (header_size < 3) {
+        size_t n = std::min(3 - header_size, avail);
+        memcpy(header + header_size, current.data() + pos, n);
+        header_size += n;
+        pos += n;
+        if (header_size < 3)
+          continue;
+
+        uint16_t length = parse_header(header);
+        partial = pool ? pool->acquire(length) : BufferRef::allocate(length);
+      }
+
+      size_t length = parse_header(header);
+      size_t n = std::min(length - partial.size(), current.size() - pos);
+      memcpy(partial.data() + partial.size(), current.data() + pos, n);
+      partial.resize(partial.size() + n);
+      pos += n;
+      if (partial.size() == length) {
+        ESHET_PROBE2(unpack, length, length);
+        header_size = 0;
+        const uint8_t *start = partial.data();
+        return Frame{std::move(partial), start, length};
+      }
+    }
   }
 
-  std::optional<std::vector<uint8_t>> read() {
-    if (buffer.size() < 3)
-      return std::nullopt;
+  /// drop any partial message, for a new connection
+  void clear() {
+    current = BufferRef();
+    pos = 0;
+    header_size = 0;
+    partial = BufferRef();
+  }
 
-    Parser p(buffer.data(), 3);
+private:
+  static uint16_t parse_header(const uint8_t *data) {
+    Parser p(data, 3);
     uint8_t magic = p.read8();
     uint16_t length = p.read16();
     p.check_empty();
 
     if (magic != 0x47)
       throw ProtocolError();
+    return length;
+  }
 
-    if (length > (buffer.size() - 3))
-      return std::nullopt;
-
-    std::vector<uint8_t> message(buffer.data() + 3, buffer.data() + 3 + length);
+  std::shared_ptr<BufferPool> pool;
 
-    for (size_t i = length + 3; i < buffer.size(); i++)
-      buffer[i - (length + 3)] = buffer[i];
-    buffer.resize(buffer.size() - (length + 3));
+  BufferRef current;
+  size_t pos = 0;
 
-    return message;
-  }
+  // header and body of a message spanning chunks
+  uint8_t header[3];
+  size_t header_size = 0;
+  BufferRef partial;
 };
 
 } // namespace detail
@@ -0,0 +1,659 @@
+#pragma once
+#include "actorpp/actor.hpp"
+#include "actorpp/net.hpp"
+#include "eshet/buffer_pool.hpp"
+#include "eshet/fd.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// io_uring is used through raw system calls, so only the kernel headers are
+// needed; multishot recv is the newest feature used
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define ESHET_HAVE_URING
+#endif
+#endif
+
+namespace eshet {
+namespace detail {
+
+#ifdef ESHET_HAVE_URING
+
+/// a minimal io_uring, used through raw system calls
+///
+/// Only one thread may use an instance.
+class Uring {
+public:
+  /// throws std::system_error if io_uring is not available
+  explicit Uring(unsigned entries) {
+    io_uring_params params = {};
+    fd = Fd(check_errno(syscall(__NR_io_uring_setup, entries, &params),
+                        "io_uring_setup"));
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP))
+      throw std::system_error(ENOSYS, std::generic_category(), "io_uring");
+
+    ring_size = std::max(params.sq_off.array + params.sq_entries *
+                                                   sizeof(unsigned),
+                         params.cq_off.cqes +
+                             params.cq_entries * sizeof(io_uring_cqe));
+    ring = map(ring_size, IORING_OFF_SQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    try {
+      sqes = (io_uring_sqe *)map(sqes_size, IORING_OFF_SQES);
+    } catch (...) {
+      munmap(ring, ring_size);
+      throw;
+    }
+
+    sq_head = (unsigned *)(ring + params.sq_off.head);
+    sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    cq_head = (unsigned *)(ring + params.cq_off.head);
+    cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    unsigned *array = (unsigned *)(ring + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; i++)
+      array[i] = i;
+    local_tail = *sq_tail;
+  }
+
+  Uring(const Uring &) = delete;
+  Uring &operator=(const Uring &) = delete;
+
+  ~Uring() {
+    munmap(sqes, sqes_size);
+    munmap(ring, ring_size);
+  }
+
+  /// get a zeroed submission queue entry, submitting queued entries if the
+  /// queue is full
+  io_uring_sqe &get_sqe() {
+    while (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >=
+           sq_entries)
+      enter(0);
+    io_uring_sqe &sqe = sqes[local_tail++ & sq_mask];
+    memset(&sqe, 0, sizeof(sqe));
+    return sqe;
+  }
+
+  /// submit queued entries, and wait for at least wait_nr completions
+  void enter(unsigned wait_nr) {
+    __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit =
+        local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (syscall(__NR_io_uring_enter, fd.get(), to_submit, wait_nr,
+                wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) < 0 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      throw std::system_error(errno, std::generic_category(),
+                              "io_uring_enter");
+  }
+
+  /// call f with each available completion, returning the number handled
+  template <typename F> unsigned for_each_cqe(F f) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (unsigned i = head; i != tail; i++)
+      f(cqes[i & cq_mask]);
+    __atomic_store_n(cq_head, tail, __ATOMIC_RELEASE);
+    return tail - head;
+  }
+
+  void register_buf_ring(io_uring_buf *br, unsigned entries,
+                         uint16_t bgid) {
+    io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    check_errno(syscall(__NR_io_uring_register, fd.get(),
+                        IORING_REGISTER_PBUF_RING, &reg, 1),
+                "io_uring_register");
+  }
+
+private:
+  uint8_t *map(size_t size, off_t offset) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd.get(), offset);
+    if (p == MAP_FAILED)
+      check_errno(-1, "mmap");
+    return (uint8_t *)p;
+  }
+
+  Fd fd;
+  uint8_t *ring;
+  size_t ring_size;
+  io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned *sq_head, *sq_tail;
+  unsigned sq_mask, sq_entries;
+  /// the tail including entries not yet published to the kernel
+  unsigned local_tail;
+  unsigned *cq_head, *cq_tail;
+  unsigned cq_mask;
+  io_uring_cqe *cqes;
+};
+
+/// a thread which services the sockets of any number of clients with one
+/// io_uring, in place of a RecvThread per connection and blocking sends
+///
+/// Each connection has a multishot recv outstanding, which receives into
+/// buffers from a shared provided buffer ring, so receiving needs no system
+/// calls beyond the one io_uring_enter per loop which also submits sends and
+/// waits for completions.
+///
+/// Sends from any thread are appended to a per-connection queue, and the
+/// reactor is woken (with an eventfd write, only if it isn't already awake).
+/// Everything queued for a connection is sent with one send, and the next
+/// only starts when that completes, so a burst of frames from many
+/// connections costs a handful of system calls.
+///
+/// Send errors are reported like receive errors, by pushing to on_close. If
+/// more than max_pending_bytes are waiting to be sent on a connection (because
+/// the server has stopped reading), it is closed in the same way, rather than
+/// buffering without limit.
+class UringReactor {
+public:
+  using MessageChannel = actorpp::Channel<BufferRef>;
+  using CloseChannel = actorpp::Channel<actorpp::CloseReason>;
+
+  static constexpr size_t max_pending_bytes = 16 << 20;
+
+  /// the reactor shared by all clients in this process, started on first
+  /// use; returns null if io_uring can't be used, in which case clients fall
+  /// back to threads
+  static std::shared_ptr<UringReactor> get() {
+    static std::mutex mut;
+    static std::weak_ptr<UringReactor> instance;
+    static bool unsupported = false;
+
+    std::lock_guard<std::mutex> guard(mut);
+    if (unsupported)
+      return nullptr;
+    if (std::shared_ptr<UringReactor> reactor = instance.lock())
+      return reactor;
+    try {
+      std::shared_ptr<UringReactor> reactor(new UringReactor());
+      instance = reactor;
+      return reactor;
+    } catch (std::system_error &) {
+      unsupported = true;
+      return nullptr;
+    }
+  }
+
+  UringReactor(const UringReactor &) = delete;
+  UringReactor &operator=(const UringReactor &) = delete;
+
+  ~UringReactor() {
+    {
+      std::lock_guard<std::mutex> guard(mut);
+      stopping = true;
+    }
+    wake();
+    thread.join();
+    munmap(buffers, buffer_count * buffer_size);
+    munmap(buf_ring, buf_ring_size());
+  }
+
+  /// start receiving from fd into buffers from pool, returning an id for
+  /// send() and remove()
+  uint64_t add(int fd, std::shared_ptr<BufferPool> pool,
+               MessageChannel on_message, CloseChannel on_close) {
+    uint64_t id;
+    {
+      std::lock_guard<std::mutex> guard(mut);
+      id = next_id++;
+      adding.push_back(std::make_unique<Conn>(id, fd, std::move(pool),
+                                              std::move(on_message),
+                                              std::move(on_close)));
+    }
+    wake();
+    return id;
+  }
+
+  /// queue data to be sent on a connection
+  void send(uint64_t id, const char *data, size_t size) {
+    {
+      std::lock_guard<std::mutex> guard(mut);
+      // past the limit the connection will be closed when the reactor sees
+      // this, so there's no point in keeping more
+      std::vector<uint8_t> &queue = queued[id];
+      if (queue.size() <= max_pending_bytes)
+        queue.insert(queue.end(), data, data + size);
+    }
+    wake();
+  }
+
+  /// stop using a connection, waiting until the kernel has finished with it
+  /// so that it can be closed; nothing more is pushed to its channels
+  void remove(uint64_t id) {
+    std::promise<void> removed;
+    std::future<void> future = removed.get_future();
+    {
+      std::lock_guard<std::mutex> guard(mut);
+      removing.emplace_back(id, &removed);
+    }
+    wake();
+    future.wait();
+  }
+
+private:
+  struct Conn {
+    Conn(uint64_t id, int fd, std::shared_ptr<BufferPool> pool,
+         MessageChannel on_message, CloseChannel on_close)
+        : id(id), fd(fd), pool(std::move(pool)),
+          on_message(std::move(on_message)), on_close(std::move(on_close)) {}
+
+    uint64_t id;
+    int fd;
+    std::shared_ptr<BufferPool> pool;
+    MessageChannel on_message;
+    CloseChannel on_close;
+    /// the multishot recv is outstanding
+    bool recv_armed = false;
+    /// the recv stopped because there were no buffers, and should be re-armed
+    bool recv_starved = false;
+    /// on_close has been pushed (or it's being removed), so nothing more
+    /// should be pushed or sent
+    bool closed = false;
+    /// data being sent, starting at sent
+    std::vector<uint8_t> sending;
+    size_t sent = 0;
+    bool send_armed = false;
+    /// data to send when the current send completes
+    std::vector<uint8_t> pending;
+    /// set when remove() is waiting for outstanding operations to finish
+    std::promise<void> *removed = nullptr;
+  };
+
+  // operation types, in the low bits of user_data, above the connection id
+  enum Op : uint64_t { Recv, Send, Wake, Cancel };
+  static constexpr int op_bits = 2;
+
+  static constexpr uint16_t buffer_group = 0;
+  static constexpr unsigned buffer_count = 128;
+  static constexpr size_t buffer_size = 16384;
+
+  UringReactor()
+      : uring(256), wake_fd(check_errno(eventfd(0, EFD_CLOEXEC), "eventfd")) {
+    void *br = mmap(nullptr, buf_ring_size(), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED)
+      check_errno(-1, "mmap");
+    buf_ring = (io_uring_buf *)br;
+    void *bufs = mmap(nullptr, buffer_count * buffer_size,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                      0);
+    if (bufs == MAP_FAILED) {
+      munmap(buf_ring, buf_ring_size());
+      check_errno(-1, "mmap");
+    }
+    buffers = (uint8_t *)bufs;
+
+    try {
+      uring.register_buf_ring(buf_ring, buffer_count, buffer_group);
+      for (unsigned i = 0; i < buffer_count; i++)
+        provide_buffer(i);
+      self_test();
+    } catch (...) {
+      munmap(buffers, buffer_count * buffer_size);
+      munmap(buf_ring, buf_ring_size());
+      throw;
+    }
+
+    arm_wake();
+    thread = std::thread([this]() { run(); });
+  }
+
+  static size_t buf_ring_size() {
+    return buffer_count * sizeof(io_uring_buf);
+  }
+
+  /// check that multishot recv works on a socket pair, as older kernels
+  /// only reject it when it's used
+  void self_test() {
+    int fds[2];
+    check_errno(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds),
+                "socketpair");
+    Fd a(fds[0]), b(fds[1]);
+
+    prep_recv(a.get(), 0);
+    uring.enter(0);
+    check_errno((int)::send(b.get(), "x", 1, MSG_NOSIGNAL), "send");
+
+    int result = -EINVAL;
+    bool more = false;
+    while (uring.for_each_cqe([&](const io_uring_cqe &cqe) {
+             result = cqe.res;
+             more = cqe.flags & IORING_CQE_F_MORE;
+             if (cqe.flags & IORING_CQE_F_BUFFER)
+               provide_buffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+           }) == 0)
+      uring.enter(1);
+    if (result != 1 || !more)
+      throw std::system_error(result < 0 ? -result : ENOSYS,
+                              std::generic_category(), "multishot recv");
+
+    // closing b ends the recv
+    b = Fd();
+    while (more) {
+      uring.enter(1);
+      uring.for_each_cqe([&](const io_uring_cqe &cqe) {
+        more = cqe.flags & IORING_CQE_F_MORE;
+        if (cqe.flags & IORING_CQE_F_BUFFER)
+          provide_buffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      });
+    }
+  }
+
+  void wake() {
+    if (!wake_pending.exchange(true)) {
+      uint64_t one = 1;
+      if (write(wake_fd.get(), &one, sizeof(one)) < 0)
+        return;
+    }
+  }
+
+  void provide_buffer(unsigned bid) {
+    io_uring_buf &buf = buf_ring[buf_tail & (buffer_count - 1)];
+    buf.addr = (uint64_t)(buffers + bid * buffer_size);
+    buf.len = buffer_size;
+    buf.bid = bid;
+    buf_tail++;
+    __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+  }
+
+  static uint64_t user_data(uint64_t id, Op op) {
+    return (id << op_bits) | op;
+  }
+
+  void prep_recv(int fd, uint64_t id) {
+    io_uring_sqe &sqe = uring.get_sqe();
+    sqe.opcode = IORING_OP_RECV;
+    sqe.fd = fd;
+    sqe.ioprio = IORING_RECV_MULTISHOT;
+    sqe.flags = IOSQE_BUFFER_SELECT;
+    sqe.buf_group = buffer_group;
+    sqe.user_data = user_data(id, Recv);
+  }
+
+  void arm_wake() {
+    io_uring_sqe &sqe = uring.get_sqe();
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = wake_fd.get();
+    sqe.addr = (uint64_t)&wake_value;
+    sqe.len = sizeof(wake_value);
+    sqe.user_data = user_data(0, Wake);
+  }
+
+  void arm_recv(Conn &conn) {
+    prep_recv(conn.fd, conn.id);
+    conn.recv_armed = true;
+    conn.recv_starved = false;
+  }
+
+  void arm_send(Conn &conn) {
+    io_uring_sqe &sqe = uring.get_sqe();
+    sqe.opcode = IORING_OP_SEND;
+    sqe.fd = conn.fd;
+    sqe.addr = (uint64_t)(conn.sending.data() + conn.sent);
+    sqe.len = conn.sending.size() - conn.sent;
+    sqe.msg_flags = MSG_NOSIGNAL;
+    sqe.user_data = user_data(conn.id, Send);
+    conn.send_armed = true;
+  }
+
+  /// start sending anything pending, if no send is outstanding
+  void start_send(Conn &conn) {
+    if (conn.send_armed || conn.pending.empty())
+      return;
+    std::swap(conn.sending, conn.pending);
+    conn.pending.clear();
+    conn.sent = 0;
+    arm_send(conn);
+  }
+
+  void cancel(uint64_t target) {
+    io_uring_sqe &sqe = uring.get_sqe();
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.addr = target;
+    sqe.user_data = user_data(0, Cancel);
+  }
+
+  void close_conn(Conn &conn) {
+    if (!conn.closed) {
+      conn.closed = true;
+      conn.on_close.push(actorpp::CloseReason::Error);
+    }
+    // nothing more will be sent; sending may still be in use by the kernel
+    conn.pending = std::vector<uint8_t>();
+  }
+
+  /// take commands from other threads
+  bool take_commands() {
+    std::vector<std::unique_ptr<Conn>> new_conns;
+    std::unordered_map<uint64_t, std::vector<uint8_t>> new_data;
+    std::vector<std::pair<uint64_t, std::promise<void> *>> new_removals;
+    bool stop;
+    {
+      wake_pending = false;
+      std::lock_guard<std::mutex> guard(mut);
+      std::swap(new_conns, adding);
+      std::swap(new_data, queued);
+      std::swap(new_removals, removing);
+      stop = stopping;
+    }
+
+    for (auto &conn : new_conns) {
+      arm_recv(*conn);
+      conns[conn->id] = std::move(conn);
+    }
+
+    for (auto &item : new_data) {
+      auto it = conns.find(item.first);
+      if (it == conns.end() || it->second->closed)
+        continue;
+      Conn &conn = *it->second;
+      if (conn.pending.empty())
+        std::swap(conn.pending, item.second);
+      else
+        conn.pending.insert(conn.pending.end(), item.second.begin(),
+                            item.second.end());
+      if (conn.pending.size() > max_pending_bytes)
+        close_conn(conn);
+      else
+        start_send(conn);
+    }
+
+    for (auto &removal : new_removals) {
+      auto it = conns.find(removal.first);
+      if (it == conns.end()) {
+        removal.second->set_value();
+        continue;
+      }
+      Conn &conn = *it->second;
+      conn.closed = true;
+      conn.removed = removal.second;
+      if (conn.recv_armed)
+        cancel(user_data(conn.id, Recv));
+      if (conn.send_armed)
+        cancel(user_data(conn.id, Send));
+      finish_removal(it);
+    }
+
+    return stop;
+  }
+
+  /// erase a connection being removed once nothing is outstanding
+  void finish_removal(
+      std::unordered_map<uint64_t, std::unique_ptr<Conn>>::iterator it) {
+    Conn &conn = *it->second;
+    if (conn.removed && !conn.recv_armed && !conn.send_armed) {
+      std::promise<void> *removed = conn.removed;
+      conns.erase(it);
+      removed->set_value();
+    }
+  }
+
+  // copy received data out of the provided buffer, so that it can be reused
+  void push_data(Conn &conn, const uint8_t *data, size_t size) {
+    while (size) {
+      BufferRef buf = conn.pool->acquire();
+      size_t n = std::min(size, buf.capacity());
+      memcpy(buf.data(), data, n);
+      buf.resize(n);
+      conn.on_message.push(std::move(buf));
+      data += n;
+      size -= n;
+    }
+  }
+
+  void handle_cqe(const io_uring_cqe &cqe) {
+    Op op = (Op)(cqe.user_data & ((1 << op_bits) - 1));
+    uint64_t id = cqe.user_data >> op_bits;
+
+    if (op == Wake) {
+      arm_wake();
+      return;
+    }
+    if (op == Cancel)
+      return;
+
+    auto it = conns.find(id);
+    if (op == Recv) {
+      if (cqe.flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe.res > 0 && it != conns.end() && !it->second->closed)
+          push_data(*it->second, buffers + bid * buffer_size, cqe.res);
+        provide_buffer(bid);
+      }
+      if (it == conns.end() || (cqe.flags & IORING_CQE_F_MORE))
+        return;
+
+      Conn &conn = *it->second;
+      conn.recv_armed = false;
+      if (cqe.res == -ENOBUFS || cqe.res > 0)
+        conn.recv_starved = true;
+      else
+        close_conn(conn);
+    } else { // Send
+      if (it == conns.end())
+        return;
+      Conn &conn = *it->second;
+      conn.send_armed = false;
+      if (cqe.res < 0)
+        close_conn(conn);
+      else if (!conn.closed) {
+        conn.sent += cqe.res;
+        if (conn.sent < conn.sending.size())
+          arm_send(conn);
+        else
+          start_send(conn);
+      }
+    }
+    finish_removal(it);
+  }
+
+  void run() {
+    while (true) {
+      bool stop = take_commands();
+      if (stop && conns.empty())
+        return;
+
+      uring.enter(1);
+      uring.for_each_cqe([&](const io_uring_cqe &cqe) { handle_cqe(cqe); });
+
+      // buffers have been returned, so starved receives can continue
+      for (auto &item : conns)
+        if (item.second->recv_starved && !item.second->closed)
+          arm_recv(*item.second);
+    }
+  }
+
+  Uring uring;
+  Fd wake_fd;
+  uint64_t wake_value;
+  std::atomic<bool> wake_pending{false};
+
+  /// the provided buffer ring; this is used as an array rather than through
+  /// io_uring_buf_ring, whose flexible array member is misplaced in C++, and
+  /// the tail overlays the resv field of the first entry
+  io_uring_buf *buf_ring;
+  uint8_t *buffers;
+  uint16_t buf_tail = 0;
+
+  std::thread thread;
+
+  // owned by the reactor thread
+  std::unordered_map<uint64_t, std::unique_ptr<Conn>> conns;
+
+  // commands from other threads
+  std::mutex mut;
+  uint64_t next_id = 1;
+  std::vector<std::unique_ptr<Conn>> adding;
+  std::unordered_map<uint64_t, std::vector<uint8_t>> queued;
+  std::vector<std::pair<uint64_t, std::promise<void> *>> removing;
+  bool stopping = false;
+};
+
+#else
+
+class UringReactor {
+public:
+  using MessageChannel = actorpp::Channel<BufferRef>;
+  using CloseChannel = actorpp::Channel<actorpp::CloseReason>;
+
+  static std::shared_ptr<UringReactor> get() { return nullptr; }
+  uint64_t add(int, std::shared_ptr<BufferPool>, MessageChannel,
+              CloseChannel) {
+    return 0;
+  }
+  void send(uint64_t, const char *, size_t) {}
+  void remove(uint64_t) {}
+};
+
+#endif
+
+/// a connection serviced by the UringReactor, for as long as this exists
+class UringConnection {
+public:
+  UringConnection(std::shared_ptr<UringReactor> reactor, int fd,
+                  std::shared_ptr<BufferPool> pool,
+                  UringReactor::MessageChannel on_message,
+                  UringReactor::CloseChannel on_close)
+      : reactor(std::move(reactor)),
+        id(this->reactor->add(fd, std::move(pool), std::move(on_message),
+                              std::move(on_close))) {}
+
+  UringConnection(const UringConnection &) = delete;
+  UringConnection &operator=(const UringConnection &) = delete;
+
+  ~UringConnection() { reactor->remove(id); }
+
+  /// queue data to be sent; errors are reported through on_close
+  void send(const char *data, size_t size) { reactor->send(id, data, size); }
+
+private:
+  std::shared_ptr<UringReactor> reactor;
+  uint64_t id;
+};
+
+} // namespace detail
+} // namespace eshet
@@ -0,0 +1,139 @@
+#pragma once
+#include "data.hpp"
+#include "flight_recorder.hpp"
+#include "metrics.hpp"
+#include "parse.hpp"
+#include "shm.hpp"
+#include "timestamps.hpp"
+#include "uring.hpp"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sys/socket.h>
+
+namespace eshet {
+namespace detail {
+
+/// serialises writes to the socket (or shared memory rings) of the current
+/// connection, so that threads other than the client actor can send messages
+class SocketWriter : public DirectReplier {
+public:
+  SocketWriter(std::shared_ptr<ClientMetrics> metrics,
+               std::shared_ptr<FlightRecorder> recorder)
+      : metrics(std::move(metrics)), recorder(std::move(recorder)) {}
+
+  /// start using a new connection; if new_shm or new_uring are set, messages
+  /// are written to them rather than directly to the socket, and if
+  /// new_timestamps is set, writes to the socket are recorded in it
+  void connect(int new_sockfd, uint16_t new_connection_id,
+               std::shared_ptr<ShmConnection> new_shm = {},
+               std::shared_ptr<UringConnection> new_uring = {},
+               std::shared_ptr<SocketTimestamps> new_timestamps = {}) {
+    std::lock_guard<std::mutex> guard(mut);
+    sockfd = new_sockfd;
+    connection_id = new_connection_id;
+    shm = std::move(new_shm);
+    uring = std::move(new_uring);
+    timestamps = std::move(new_timestamps);
+  }
+
+  /// stop using the current connection; this must be called before the socket
+  /// is closed
+  void disconnect() {
+    std::lock_guard<std::mutex> guard(mut);
+    sockfd = -1;
+    shm.reset();
+    uring.reset();
+    timestamps.reset();
+  }
+
+  /// send a message on the current connection, throwing Disconnected on error
+  /// (or, with io_uring, reporting it through the receive side)
+  void send(const char *data, size_t size) {
+    TraceSpan span("write", "write", "size", size);
+    std::lock_guard<std::mutex> guard(mut);
+    record(data, size);
+    if (!write(data, size))
+      throw Disconnected{};
+    count_sent(size);
+  }
+
+  /// encode and send a reply from the calling thread; replies to calls from
+  /// previous connections are dropped
+  void reply(uint16_t call_connection_id, uint16_t id,
+             const Result &result) override {
+    static thread_local SendBuf buf(128);
+    buf.write_reply(id, result);
+
+    TraceSpan span("write", "write", "size", buf.sbuf.size());
+    std::lock_guard<std::mutex> guard(mut);
+    if (sockfd == -1 || call_connection_id != connection_id)
+      return;
+    record(buf.sbuf.data(), buf.sbuf.size());
+
+    // we can't throw into the client thread, so shut down the socket and let
+    // the receive thread notice instead
+    if (!write(buf.sbuf.data(), buf.sbuf.size()))
+      shutdown(sockfd, SHUT_RDWR);
+    else
+      count_sent(buf.sbuf.size());
+  }
+
+  /// when a message was last sent successfully by any thread, so that the
+  /// client doesn't send pings while direct replies are keeping the
+  /// connection busy
+  std::chrono::steady_clock::time_point last_sent() const {
+    return std::chrono::steady_clock::time_point(
+        std::chrono::steady_clock::duration(
+            last_sent_ticks.load(std::memory_order_relaxed)));
+  }
+
+private:
+  // write to the current connection, returning false on error; called with
+  // mut held
+  bool write(const char *data, size_t size) {
+    if (shm)
+      return shm->write_all((const uint8_t *)data, size, sockfd);
+    if (uring) {
+      uring->send(data, size);
+      return true;
+    }
+    if (!timestamps)
+      return ::send(sockfd, data, size, MSG_NOSIGNAL) >= 0;
+
+    Timestamp start = SocketTimestamps::now();
+    if (::send(sockfd, data, size, MSG_NOSIGNAL) < 0)
+      return false;
+    timestamps->sent(size, start);
+    return true;
+  }
+
+  // record a frame, without its header; called with mut held so that frames
+  // are recorded in the order they are sent
+  void record(const char *data, size_t size) {
+    if (size >= 3)
+      recorder->record(FrameDirection::Out, (const uint8_t *)data + 3,
+                       size - 3);
+  }
+
+  void count_sent(size_t size) {
+    last_sent_ticks.store(
+        std::chrono::steady_clock::now().time_since_epoch().count(),
+        std::memory_order_relaxed);
+    metrics->bytes_out.fetch_add(size, std::memory_order_relaxed);
+    metrics->frames_out.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  std::shared_ptr<ClientMetrics> metrics;
+  std::shared_ptr<FlightRecorder> recorder;
+  std::mutex mut;
+  int sockfd = -1;
+  std::shared_ptr<ShmConnection> shm;
+  std::shared_ptr<UringConnection> uring;
+  std::shared_ptr<SocketTimestamps> timestamps;
+  uint16_t connection_id = 0;
+  std::atomic<std::chrono::steady_clock::rep> last_sent_ticks{0};
+};
+
+} // namespace detail
+} // namespace eshet
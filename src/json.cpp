@@ -0,0 +1,56 @@
+#include "json.hpp"
+#include "rapidjson/error/en.h"
+#include "utils.hpp"
+#include <sstream>
+
+namespace rj = rapidjson;
+
+msgpack::object json_to_msgpack(const rj::Value &v, msgpack::zone &zone) {
+  if (v.IsNull()) {
+    return msgpack::object();
+  } else if (v.IsBool()) {
+    return msgpack::object(v.GetBool());
+  } else if (v.IsDouble()) {
+    return msgpack::object(v.GetDouble());
+  } else if (v.IsFloat()) {
+    return msgpack::object(v.GetFloat());
+  } else if (v.IsInt64()) {
+    return msgpack::object(v.GetInt64());
+  } else if (v.IsString()) {
+    std::string s(v.GetString(), v.GetStringLength());
+    return msgpack::object(s, zone);
+  } else if (v.IsArray()) {
+    std::vector<msgpack::object> arr;
+    for (auto &el : v.GetArray())
+      arr.emplace_back(json_to_msgpack(el, zone));
+    return msgpack::object(arr, zone);
+  } else if (v.IsObject()) {
+    msgpack::type::assoc_vector<msgpack::object, msgpack::object> vec;
+    for (auto &entry : v.GetObject())
+      vec.emplace_back(std::make_pair(json_to_msgpack(entry.name, zone),
+                                      json_to_msgpack(entry.value, zone)));
+    return msgpack::object(vec, zone);
+  } else {
+    throw std::logic_error("unknown type");
+  }
+
+  return {};
+}
+
+msgpack::object json_str_to_msgpack(std::string json, msgpack::zone &zone) {
+  rj::Document d;
+  rj::ParseResult res = d.Parse(json.data(), json.size());
+  if (!res) {
+    std::stringstream ss;
+    ss << rj::GetParseError_En(res.Code()) << " (" << res.Offset() << ")";
+    throw error_message(ss.str());
+  }
+
+  return json_to_msgpack(d, zone);
+}
+
+msgpack::object_handle json_str_to_msgpack(std::string json) {
+  auto zone = std::make_unique<msgpack::zone>();
+  msgpack::object obj = json_str_to_msgpack(json, *zone);
+  return {obj, std::move(zone)};
+}
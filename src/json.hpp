@@ -0,0 +1,12 @@
+#pragma once
+#include "msgpack.hpp"
+#include "rapidjson/document.h"
+#include <string>
+
+/// convert a JSON value to msgpack, allocating any storage needed in zone
+msgpack::object json_to_msgpack(const rapidjson::Value &v, msgpack::zone &zone);
+
+/// parse a JSON string and convert it to msgpack, throwing error_message if
+/// it's not valid
+msgpack::object json_str_to_msgpack(std::string json, msgpack::zone &zone);
+msgpack::object_handle json_str_to_msgpack(std::string json);
@@ -0,0 +1,55 @@
+#include "CLI11.hpp"
+#include "eshet/server/relay.hpp"
+#include <csignal>
+#include <iostream>
+
+using namespace eshet::server;
+
+static Relay *running_relay = nullptr;
+
+static void handle_signal(int) {
+  if (running_relay)
+    running_relay->stop();
+}
+
+int main(int argc, char **argv) {
+  CLI::App app{"share one ESHET server connection between local clients"};
+
+  RelayConfig config;
+  app.add_option("-u,--unix", config.listen.unix_path,
+                 "Unix socket to listen on, or empty to disable")
+      ->capture_default_str();
+  app.add_option("--shm", config.listen.shm_path,
+                 "Unix socket to accept shared memory clients on");
+  app.add_option("-b,--bind", config.listen.bind_address,
+                 "address to listen on for TCP clients")
+      ->capture_default_str();
+  app.add_option("-p,--port", config.listen.port,
+                 "port to listen on for TCP clients, or -1 to disable")
+      ->capture_default_str();
+  app.add_option("--server-host", config.upstream_host, "server to connect to")
+      ->capture_default_str();
+  app.add_option("--server-port", config.upstream_port)
+      ->capture_default_str();
+
+  try {
+    app.parse(argc, argv);
+  } catch (const CLI::ParseError &e) {
+    return app.exit(e);
+  }
+
+  try {
+    Relay relay(config);
+    running_relay = &relay;
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    relay.run();
+
+    running_relay = nullptr;
+  } catch (const std::system_error &e) {
+    std::cerr << "error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,60 @@
+#include "CLI11.hpp"
+#include "eshet/server/server.hpp"
+#include <csignal>
+#include <iostream>
+
+using namespace eshet::server;
+
+static Server *running_server = nullptr;
+
+static void handle_signal(int) {
+  if (running_server)
+    running_server->stop();
+}
+
+int main(int argc, char **argv) {
+  CLI::App app{"ESHET server"};
+
+  ServerConfig config;
+  app.add_option("-b,--bind", config.bind_address, "address to listen on")
+      ->capture_default_str();
+  app.add_option("-p,--port", config.port,
+                 "TCP port to listen on, or -1 for none")
+      ->capture_default_str();
+  app.add_option("-u,--unix", config.unix_path,
+                 "also listen on a Unix socket at this path");
+  app.add_option("--shm", config.shm_path,
+                 "also accept shared memory clients on a Unix socket at this "
+                 "path");
+  app.add_option("--max-output-buffer", config.max_output_buffer,
+                 "close clients with more than this many bytes unsent")
+      ->capture_default_str();
+
+  try {
+    app.parse(argc, argv);
+  } catch (const CLI::ParseError &e) {
+    return app.exit(e);
+  }
+
+  try {
+    Server server(config);
+    running_server = &server;
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    if (config.port >= 0)
+      std::cerr << "listening on " << config.bind_address << ":"
+                << server.port() << std::endl;
+    if (!config.unix_path.empty())
+      std::cerr << "listening on unix:" << config.unix_path << std::endl;
+    if (!config.shm_path.empty())
+      std::cerr << "listening on shm:" << config.shm_path << std::endl;
+    server.run();
+
+    running_server = nullptr;
+  } catch (const std::system_error &e) {
+    std::cerr << "error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include "utils.hpp"
+#include "eshet/endpoint.hpp"
 
 std::pair<std::string, int> get_host_port() {
   std::string host = "localhost";
@@ -8,6 +9,9 @@ std::pair<std::string, int> get_host_port() {
   if (hostport_chr != NULL) {
     std::string hostport(hostport_chr);
 
+    if (eshet::is_unix_endpoint(hostport) || eshet::is_shm_endpoint(hostport))
+      return {hostport, 0};
+
     size_t colon_pos = hostport.find(':');
     if (colon_pos == std::string::npos) {
       host = hostport;
@@ -1,8 +1,17 @@
 #pragma once
+#include <exception>
 #include <string>
 #include <utility>
 
+/// an error to be shown to the user
+struct error_message : public std::exception {
+  error_message(std::string message) : message(std::move(message)) {}
+  const char *what() const throw() { return message.c_str(); }
+  std::string message;
+};
+
 /// get the ESHET host and port from the ESHET_SERVER environment variable,
 /// which should either contain just a host name (for port 11236), or a host
-/// name and port number separated by a colon
+/// name and port number separated by a colon, or "unix:" or "shm:" followed by
+/// the path of a server's Unix or shared memory socket
 std::pair<std::string, int> get_host_port();
@@ -83,3 +83,104 @@ TEST_CASE("disconnected reply") {
 
   REQUIRE(call_result.read() == Result(Error("disconnected")));
 }
+
+TEST_CASE("thread pool action") {
+  ThreadPool pool(4);
+  ESHETClient client1("localhost", 11236);
+  ESHETClient client2("localhost", 11236);
+
+  // calls block until released, so we can see how many run at once
+  std::atomic<int> running{0};
+  std::atomic<int> max_running{0};
+  std::atomic<bool> release{false};
+
+  ActionOptions options;
+  options.max_concurrency = 2;
+  options.max_queued = 2;
+
+  Channel<Result> result_chan;
+  client1.action_register(
+      NS "/pool_action", result_chan, pool,
+      [&](Call &call) {
+        int now = ++running;
+        int max = max_running;
+        while (now > max && !max_running.compare_exchange_weak(max, now))
+          ;
+        while (!release)
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        running--;
+        return Result(Success(std::get<0>(call.as<std::tuple<int>>())));
+      },
+      options);
+  REQUIRE(std::holds_alternative<Success>(result_chan.read()));
+
+  // 2 running, 2 queued and 1 rejected
+  std::vector<Channel<Result>> call_results(5);
+  for (auto &call_result : call_results) {
+    client2.action_call_pack(NS "/pool_action", call_result,
+                             std::make_tuple(5));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+
+  REQUIRE(call_results[4].read() == Result(Error("busy")));
+  release = true;
+
+  for (size_t i = 0; i < 4; i++) {
+    Result result = call_results[i].read();
+    REQUIRE(std::holds_alternative<Success>(result));
+    REQUIRE(std::get<Success>(result).as<int>() == 5);
+  }
+  REQUIRE(max_running == 2);
+}
+
+TEST_CASE("direct reply") {
+  ESHETClient client1("localhost", 11236);
+  ESHETClient client2("localhost", 11236);
+
+  ActionOptions options;
+  options.direct_reply = true;
+
+  Channel<Result> result_chan;
+  Channel<Call> action_chan;
+  client1.action_register(NS "/direct_action", result_chan, action_chan,
+                          options);
+  REQUIRE(std::holds_alternative<Success>(result_chan.read()));
+
+  auto do_call = [&]() {
+    Channel<Result> call_result;
+    client2.action_call_pack(NS "/direct_action", call_result,
+                             std::make_tuple(5));
+
+    Call call = action_chan.read();
+    REQUIRE(std::get<0>(call.as<std::tuple<int>>()) == 5);
+    call.reply(Success(6));
+
+    Result result = call_result.read();
+    REQUIRE(std::holds_alternative<Success>(result));
+    REQUIRE(std::get<Success>(result).as<int>() == 6);
+  };
+
+  do_call();
+
+  // replies to calls from before a reconnection are dropped, so the caller
+  // gets at most an error from the server, and the new connection stays up
+  Actor self;
+  Channel<Result> call_result(self);
+  client2.action_call_pack(NS "/direct_action", call_result,
+                           std::make_tuple(5));
+  Call stale_call = action_chan.read();
+  client1.test_disconnect();
+  std::this_thread::sleep_for(std::chrono::seconds(2));
+  uint64_t reconnects = client1.metrics().snapshot().reconnects;
+  stale_call.reply(Success(6));
+
+  int results = 0;
+  while (self.wait_for(std::chrono::milliseconds(500), call_result) == 0) {
+    REQUIRE(!std::holds_alternative<Success>(call_result.read()));
+    results++;
+  }
+  REQUIRE(results <= 1);
+
+  do_call();
+  REQUIRE(client1.metrics().snapshot().reconnects == reconnects);
+}
@@ -0,0 +1,167 @@
+#include "bench.hpp"
+#include "catch2/catch.hpp"
+#include "eshet.hpp"
+#include "standin_server.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+// check that the number of heap allocations per operation on the hot paths
+// stays within budget; this uses the stand-in server from bench/, whose
+// allocations are not counted
+//
+// Allocations on all client threads are counted, including the caller,
+// client and receive threads. The budgets have some headroom over the
+// expected counts, which are listed for each test.
+
+using namespace eshet;
+#define NS "/eshetcpp_test_allocations"
+
+static const int warmup_ops = 100;
+static const int measured_ops = 1000;
+
+// run op warmup_ops times, then measured_ops times, returning the average
+// number of allocations per op in the measured runs
+template <typename F> static double allocations_per_op(F op) {
+  for (int i = 0; i < warmup_ops; i++)
+    op(i);
+
+  bench::AllocationCounts before = bench::allocations();
+  for (int i = 0; i < measured_ops; i++)
+    op(warmup_ops + i);
+  bench::AllocationCounts after = bench::allocations();
+
+  return (double)(after.count - before.count) / measured_ops;
+}
+
+// a connection to the server which publishes state changes without using the
+// client, so that only the observing side is measured
+class RawPublisher {
+public:
+  RawPublisher(int port, std::string path)
+      : path(std::move(path)), buf(128) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    REQUIRE(connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+
+    buf.write_hello({}, 30);
+    send_buf();
+    REQUIRE(read_message()[0] == 0x03);
+
+    buf.write_state_register(0, this->path);
+    send_buf();
+    REQUIRE(read_message()[0] == 0x05);
+  }
+
+  ~RawPublisher() { close(fd); }
+
+  // publish value without waiting for the reply, and without counting
+  // allocations
+  void publish(int value) {
+    bench::count_allocations_on_this_thread(false);
+    buf.write_state_changed(0, path, Known(value));
+    send_buf();
+    bench::count_allocations_on_this_thread(true);
+  }
+
+private:
+  void send_buf() {
+    REQUIRE(send(fd, buf.sbuf.data(), buf.sbuf.size(), MSG_NOSIGNAL) ==
+            (ssize_t)buf.sbuf.size());
+  }
+
+  std::vector<uint8_t> read_message() {
+    while (true) {
+      if (auto msg = unpacker.read())
+        return std::vector<uint8_t>(msg->begin(), msg->end());
+
+      std::vector<uint8_t> data(1024);
+      ssize_t n = recv(fd, data.data(), data.size(), 0);
+      REQUIRE(n > 0);
+      data.resize(n);
+      unpacker.push(std::move(data));
+    }
+  }
+
+  std::string path;
+  int fd;
+  detail::SendBuf buf;
+  detail::Unpacker unpacker;
+};
+
+TEST_CASE("outbound state_changed") {
+  // expected: value zone (2) and path string (1) in state_changed, pending
+  // reply map node (1), then for the reply: zone (2), plus amortised channel
+  // storage; the receive buffer and message come from the pool
+  bench::StandinServer server;
+  ESHETClient client("127.0.0.1", server.port());
+
+  Channel<Result> result;
+  client.state_register(NS "/outbound_state", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  double allocs = allocations_per_op([&](int i) {
+    client.state_changed(NS "/outbound_state", i, result);
+    result.read();
+  });
+  INFO("allocations per state_changed: " << allocs);
+  REQUIRE(allocs <= 10);
+}
+
+TEST_CASE("inbound state_changed delivery") {
+  // expected: path string (1) and zone (2), plus amortised channel storage;
+  // the receive buffer and message come from the pool
+  bench::StandinServer server;
+  RawPublisher publisher(server.port(), NS "/inbound_state");
+  ESHETClient client("127.0.0.1", server.port());
+
+  Channel<StateResult> observe_result;
+  Channel<StateUpdate> changes;
+  client.state_observe(NS "/inbound_state", observe_result, changes);
+  REQUIRE(std::holds_alternative<Unknown>(observe_result.read()));
+
+  double allocs = allocations_per_op([&](int i) {
+    publisher.publish(i);
+    changes.read();
+  });
+  INFO("allocations per state change received: " << allocs);
+  REQUIRE(allocs <= 6);
+}
+
+TEST_CASE("action_call_pack round trip") {
+  // expected: the caller's outbound and reply allocations as for
+  // state_changed (6), and on the action side the inbound call as for
+  // state_changed delivery (3) and the cloned reply value (2)
+  bench::StandinServer server;
+  ESHETClient caller("127.0.0.1", server.port());
+  ESHETClient callee("127.0.0.1", server.port());
+
+  Channel<Result> result;
+  Channel<Call> calls;
+  callee.action_register(NS "/action", result, calls);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  std::atomic<bool> stop{false};
+  std::thread handler([&]() {
+    while (true) {
+      Call call = calls.read();
+      if (stop)
+        return;
+      call.reply(Success(msgpack::clone(call.value.get())));
+    }
+  });
+
+  double allocs = allocations_per_op([&](int i) {
+    caller.action_call_pack(NS "/action", result, std::make_tuple(i));
+    result.read();
+  });
+
+  stop = true;
+  caller.action_call_pack(NS "/action", result, std::make_tuple(0));
+  handler.join();
+
+  INFO("allocations per action call: " << allocs);
+  REQUIRE(allocs <= 20);
+}
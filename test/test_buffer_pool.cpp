@@ -0,0 +1,168 @@
+#include "catch2/catch.hpp"
+#include "eshet/lazy_value.hpp"
+#include "eshet/unpack.hpp"
+
+using namespace eshet;
+using detail::Frame;
+using detail::Unpacker;
+
+static std::shared_ptr<BufferPool> make_pool(size_t buffer_size,
+                                             size_t buffers) {
+  BufferPoolConfig config;
+  config.buffer_size = buffer_size;
+  config.buffers = buffers;
+  return std::make_shared<BufferPool>(config);
+}
+
+static BufferRef chunk(BufferPool &pool, std::vector<uint8_t> data) {
+  BufferRef buf = pool.acquire();
+  memcpy(buf.data(), data.data(), data.size());
+  buf.resize(data.size());
+  return buf;
+}
+
+static std::vector<uint8_t> contents(const Frame &frame) {
+  return std::vector<uint8_t>(frame.begin(), frame.end());
+}
+
+TEST_CASE("buffers are reused once unreferenced") {
+  auto pool = make_pool(16, 2);
+
+  BufferRef a = pool->acquire();
+  const uint8_t *a_data = a.data();
+  BufferRef a2 = a;
+  a = BufferRef();
+  REQUIRE(pool->stats().in_use == 1);
+
+  // still referenced by a2
+  BufferRef b = pool->acquire();
+  REQUIRE(b.data() != a_data);
+  REQUIRE(pool->stats().in_use == 2);
+
+  a2 = BufferRef();
+  BufferRef c = pool->acquire();
+  REQUIRE(c.data() == a_data);
+  REQUIRE(c.size() == 0);
+
+  REQUIRE(pool->stats().acquired == 3);
+  REQUIRE(pool->stats().high_water == 2);
+  REQUIRE(pool->stats().overflows == 0);
+}
+
+TEST_CASE("buffers are allocated when the pool is empty") {
+  auto pool = make_pool(16, 1);
+
+  BufferRef a = pool->acquire();
+  BufferRef b = pool->acquire();
+  BufferRef large = pool->acquire(100);
+  REQUIRE(large.capacity() >= 100);
+  REQUIRE(pool->stats().overflows == 2);
+  REQUIRE(pool->stats().high_water == 3);
+
+  b = BufferRef();
+  large = BufferRef();
+  REQUIRE(pool->stats().in_use == 1);
+}
+
+TEST_CASE("buffers outlive their pool") {
+  auto pool = make_pool(16, 1);
+  BufferRef a = chunk(*pool, {1, 2, 3});
+  pool.reset();
+  REQUIRE(std::vector<uint8_t>(a.data(), a.data() + a.size()) ==
+          std::vector<uint8_t>{1, 2, 3});
+}
+
+TEST_CASE("unpacker frames refer to the received buffer") {
+  auto pool = make_pool(64, 4);
+  Unpacker unpacker(pool);
+
+  unpacker.push(chunk(*pool, {0x47, 0, 2, 5, 6, 0x47, 0, 1, 7}));
+  std::optional<Frame> a = unpacker.read();
+  std::optional<Frame> b = unpacker.read();
+  REQUIRE(!unpacker.read());
+
+  REQUIRE(contents(*a) == std::vector<uint8_t>{5, 6});
+  REQUIRE(contents(*b) == std::vector<uint8_t>{7});
+  REQUIRE(a->buf.data() == b->buf.data());
+
+  // the chunk is released by the unpacker once it has been read, and by the
+  // frames when they are destroyed
+  REQUIRE(pool->stats().in_use == 1);
+  a.reset();
+  b.reset();
+  REQUIRE(pool->stats().in_use == 0);
+}
+
+TEST_CASE("unpacker frames spanning chunks") {
+  auto pool = make_pool(64, 4);
+  Unpacker unpacker(pool);
+
+  // split within the header, then within the body
+  unpacker.push(chunk(*pool, {0x47, 0, 1, 9, 0x47}));
+  REQUIRE(contents(*unpacker.read()) == std::vector<uint8_t>{9});
+  REQUIRE(!unpacker.read());
+
+  unpacker.push(chunk(*pool, {0, 4, 1, 2}));
+  REQUIRE(!unpacker.read());
+  unpacker.push(chunk(*pool, {3}));
+  REQUIRE(!unpacker.read());
+  unpacker.push(chunk(*pool, {4, 0x47, 0, 0}));
+  REQUIRE(contents(*unpacker.read()) == std::vector<uint8_t>{1, 2, 3, 4});
+  REQUIRE(unpacker.read()->size() == 0);
+  REQUIRE(!unpacker.read());
+  REQUIRE(pool->stats().in_use == 0);
+
+  unpacker.push(std::vector<uint8_t>{0x48, 0, 0});
+  REQUIRE_THROWS_AS(unpacker.read(), ProtocolError);
+}
+
+TEST_CASE("msgpack values referring to a received buffer") {
+  auto pool = make_pool(64, 2);
+
+  msgpack::sbuffer sbuf;
+  msgpack::pack(sbuf, std::string(40, 'x'));
+  BufferRef buf = pool->acquire();
+  memcpy(buf.data(), sbuf.data(), sbuf.size());
+  buf.resize(sbuf.size());
+  const uint8_t *buf_data = buf.data();
+
+  detail::Parser p(buf.data(), buf.size());
+  msgpack::object_handle oh = p.read_msgpack_ref(buf);
+  p.check_empty();
+
+  // the string is not copied, and the buffer is held by the value
+  REQUIRE(oh->type == msgpack::type::STR);
+  REQUIRE((const uint8_t *)oh->via.str.ptr > buf_data);
+  REQUIRE((const uint8_t *)oh->via.str.ptr < buf_data + buf.size());
+
+  buf = BufferRef();
+  REQUIRE(pool->stats().in_use == 1);
+  REQUIRE(oh->as<std::string>() == std::string(40, 'x'));
+
+  oh = msgpack::object_handle();
+  REQUIRE(pool->stats().in_use == 0);
+}
+
+TEST_CASE("lazy values are unpacked on first use") {
+  auto pool = make_pool(64, 2);
+
+  msgpack::sbuffer sbuf;
+  msgpack::pack(sbuf, std::make_tuple(1, std::string("two")));
+  BufferRef buf = pool->acquire();
+  memcpy(buf.data(), sbuf.data(), sbuf.size());
+  buf.resize(sbuf.size());
+
+  std::string_view raw((const char *)buf.data(), buf.size());
+  LazyValue value(std::move(buf), raw);
+  REQUIRE(!value.unpacked());
+  REQUIRE(pool->stats().in_use == 1);
+
+  auto t = value.as<std::tuple<int, std::string>>();
+  REQUIRE(value.unpacked());
+  REQUIRE(std::get<0>(t) == 1);
+  REQUIRE(std::get<1>(t) == "two");
+  REQUIRE(value->type == msgpack::type::ARRAY);
+
+  value = LazyValue();
+  REQUIRE(pool->stats().in_use == 0);
+}
@@ -1,5 +1,7 @@
 #include "catch2/catch.hpp"
 #include "eshet.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
 using namespace eshet;
 #define NS "/eshetcpp_test_event"
@@ -32,3 +34,141 @@ TEST_CASE("make an event and observe") {
   REQUIRE(std::holds_alternative<Success>(emit_result.read()));
   REQUIRE(event_chan.read()->as<int>() == 6);
 }
+
+TEST_CASE("listen in batches") {
+  ESHETClient client("localhost", 11236);
+
+  Actor self;
+  Channel<Result> result(self);
+  client.event_register(NS "/batch_event", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  ESHETClient client2("localhost", 11236);
+  Channel<EventBatch> batch_chan(self);
+  client2.event_listen(NS "/batch_event", batch_chan, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  // emit without waiting for results; events may arrive in any number of
+  // batches, but all should arrive in order
+  Channel<Result> emit_result(self);
+  for (int i = 0; i < 100; i++)
+    client.event_emit(NS "/batch_event", i, emit_result);
+
+  int next = 0;
+  while (next < 100) {
+    EventBatch batch = batch_chan.read();
+    REQUIRE(batch.size() > 0);
+    for (auto &event : batch)
+      REQUIRE(event->as<int>() == next++);
+  }
+
+  for (int i = 0; i < 100; i++)
+    REQUIRE(std::holds_alternative<Success>(emit_result.read()));
+}
+
+// a server on a free loopback port which is driven by the test, to send
+// messages that a real server wouldn't
+class ScriptedServer {
+public:
+  ScriptedServer() : buf(128) {
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    REQUIRE(bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+    REQUIRE(listen(listen_fd, 4) == 0);
+    socklen_t len = sizeof(addr);
+    REQUIRE(getsockname(listen_fd, (sockaddr *)&addr, &len) == 0);
+    port = ntohs(addr.sin_port);
+  }
+
+  ~ScriptedServer() {
+    if (fd != -1)
+      close(fd);
+    close(listen_fd);
+  }
+
+  void accept_client() {
+    fd = accept(listen_fd, nullptr, nullptr);
+    REQUIRE(fd != -1);
+  }
+
+  std::vector<uint8_t> read_message() {
+    while (true) {
+      if (auto msg = unpacker.read())
+        return std::vector<uint8_t>(msg->begin(), msg->end());
+
+      std::vector<uint8_t> data(1024);
+      ssize_t n = recv(fd, data.data(), data.size(), 0);
+      REQUIRE(n > 0);
+      data.resize(n);
+      unpacker.push(std::move(data));
+    }
+  }
+
+  // add the message in buf to those sent by send
+  void queue() { out.append(buf.sbuf.data(), buf.sbuf.size()); }
+
+  void send() {
+    REQUIRE(::send(fd, out.data(), out.size(), MSG_NOSIGNAL) ==
+            (ssize_t)out.size());
+    out.clear();
+  }
+
+  int port;
+  detail::SendBuf buf;
+
+private:
+  int listen_fd;
+  int fd = -1;
+  detail::Unpacker unpacker;
+  std::string out;
+};
+
+TEST_CASE("batches are delivered when the connection fails") {
+  ScriptedServer server;
+  ESHETClient client("127.0.0.1", server.port);
+
+  server.accept_client();
+  REQUIRE(server.read_message()[0] == 0x01);
+  server.buf.start_msg(0x03);
+  server.buf.write_size();
+  server.queue();
+  server.send();
+
+  Actor self;
+  Channel<EventBatch> batch_chan(self);
+  Channel<Result> result(self);
+  client.event_listen(NS "/batch_event", batch_chan, result);
+
+  std::vector<uint8_t> listen = server.read_message();
+  REQUIRE(listen[0] == 0x32);
+  server.buf.write_reply((uint16_t)((listen[1] << 8) | listen[2]),
+                         Success(msgpack::type::nil_t()));
+  server.queue();
+  server.send();
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  // two events, then a hello, which isn't allowed here, all in one write so
+  // that they are handled in one pass
+  for (int i = 0; i < 2; i++) {
+    server.buf.start_msg(0x33);
+    server.buf.write_string(NS "/batch_event");
+    server.buf.write_msgpack(i);
+    server.buf.write_size();
+    server.queue();
+  }
+  server.buf.start_msg(0x03);
+  server.buf.write_size();
+  server.queue();
+  server.send();
+
+  // the client will now try to reconnect, which is never accepted; the events
+  // which arrived before the error should still be delivered
+  REQUIRE(self.wait_for(std::chrono::seconds(5), batch_chan) == 0);
+  EventBatch batch = batch_chan.read();
+  REQUIRE(batch.size() == 2);
+  REQUIRE(batch[0]->as<int>() == 0);
+  REQUIRE(batch[1]->as<int>() == 1);
+}
@@ -0,0 +1,53 @@
+#include "catch2/catch.hpp"
+#include "eshet/flight_recorder.hpp"
+
+using namespace eshet;
+
+static void record(FlightRecorder &recorder, FrameDirection direction,
+                   std::vector<uint8_t> data) {
+  recorder.record(direction, data.data(), data.size());
+}
+
+TEST_CASE("keeps the latest frames in each direction") {
+  FlightRecorder recorder({3, 4});
+  for (uint8_t i = 0; i < 5; i++)
+    record(recorder, FrameDirection::In, {i});
+  record(recorder, FrameDirection::Out, {9});
+
+  auto frames = recorder.frames();
+  REQUIRE(frames.size() == 4);
+  REQUIRE(frames[0].data == std::vector<uint8_t>{2});
+  REQUIRE(frames[1].data == std::vector<uint8_t>{3});
+  REQUIRE(frames[2].data == std::vector<uint8_t>{4});
+  REQUIRE(frames[3].direction == FrameDirection::Out);
+  REQUIRE(frames[3].data == std::vector<uint8_t>{9});
+}
+
+TEST_CASE("truncates long frames") {
+  FlightRecorder recorder({3, 4});
+  record(recorder, FrameDirection::Out, {1, 2, 3, 4, 5, 6});
+
+  auto frames = recorder.frames();
+  REQUIRE(frames.size() == 1);
+  REQUIRE(frames[0].size == 6);
+  REQUIRE(frames[0].data == std::vector<uint8_t>{1, 2, 3, 4});
+
+  std::string dump = recorder.dump();
+  REQUIRE(dump.find("out 6 bytes: 01 02 03 04 ...\n") != std::string::npos);
+}
+
+TEST_CASE("configure clears frames") {
+  FlightRecorder recorder;
+  record(recorder, FrameDirection::In, {1});
+  recorder.configure({2, 2, true});
+
+  REQUIRE(recorder.frames().empty());
+  REQUIRE(recorder.config().dump_on_disconnect);
+}
+
+TEST_CASE("zero frames records nothing") {
+  FlightRecorder recorder({0, 0});
+  record(recorder, FrameDirection::In, {1});
+  REQUIRE(recorder.frames().empty());
+  REQUIRE(recorder.dump() == "0 recorded frames:\n");
+}
@@ -0,0 +1,64 @@
+#include "catch2/catch.hpp"
+#include "eshet/histogram.hpp"
+
+using namespace eshet;
+
+TEST_CASE("bucket bounds") {
+  for (uint64_t v : {0ull, 1ull, 15ull, 16ull, 17ull, 31ull, 32ull, 1000ull,
+                     123456789ull, ~0ull}) {
+    size_t i = HistogramBuckets::index(v);
+    REQUIRE(i < HistogramBuckets::num_buckets);
+    REQUIRE(HistogramBuckets::lower_bound(i) <= v);
+    REQUIRE(HistogramBuckets::upper_bound(i) >= v);
+  }
+
+  // buckets are contiguous
+  for (size_t i = 1; i < HistogramBuckets::num_buckets; i++)
+    REQUIRE(HistogramBuckets::lower_bound(i) ==
+            HistogramBuckets::upper_bound(i - 1) + 1);
+}
+
+TEST_CASE("percentiles") {
+  LatencyHistogram h;
+  for (uint64_t i = 1; i <= 10000; i++)
+    h.record(i * 1000);
+
+  HistogramSnapshot s = h.snapshot();
+  REQUIRE(s.count == 10000);
+  REQUIRE(s.max == 10000000);
+  REQUIRE(s.mean() == Approx(5000500.0));
+
+  // within the 1/16 relative error of the buckets
+  REQUIRE(s.percentile(50) == Approx(5000000).epsilon(1.0 / 16));
+  REQUIRE(s.percentile(99) == Approx(9900000).epsilon(1.0 / 16));
+  REQUIRE(s.percentile(100) == 10000000);
+
+  h.reset();
+  REQUIRE(h.snapshot().count == 0);
+  REQUIRE(h.snapshot().percentile(99) == 0);
+}
+
+TEST_CASE("merge and difference") {
+  LatencyHistogram a, b;
+  a.record(10);
+  b.record(1000);
+  HistogramSnapshot before = a.snapshot();
+
+  a.record(100);
+  a.record(100);
+
+  HistogramSnapshot diff = a.snapshot().since(before);
+  REQUIRE(diff.count == 2);
+  REQUIRE(diff.sum == 200);
+  REQUIRE(diff.percentile(50) == 100);
+
+  HistogramSnapshot merged = a.snapshot();
+  merged.add(b.snapshot());
+  REQUIRE(merged.count == 4);
+  REQUIRE(merged.max == 1000);
+
+  // after a reset, everything since is included
+  a.reset();
+  a.record(5);
+  REQUIRE(a.snapshot().since(before).count == 1);
+}
@@ -0,0 +1,43 @@
+#include "catch2/catch.hpp"
+#include "eshet/lanes.hpp"
+
+using namespace eshet;
+using detail::LaneScheduler;
+
+TEST_CASE("strict priority within weights") {
+  LaneScheduler scheduler({2, 1, 1, 1});
+
+  REQUIRE(scheduler.pick({false, false, false, false}) == -1);
+  REQUIRE(scheduler.pick({false, false, true, true}) == 2);
+  REQUIRE(scheduler.pick({true, false, true, true}) == 0);
+  REQUIRE(scheduler.pick({true, false, true, true}) == 0);
+}
+
+TEST_CASE("lower lanes are not starved") {
+  LaneScheduler scheduler({4, 2, 1, 1});
+
+  std::array<int, num_lanes> counts = {0, 0, 0, 0};
+  for (int i = 0; i < 80; i++)
+    counts[scheduler.pick({true, true, true, true})]++;
+
+  REQUIRE(counts[0] == 40);
+  REQUIRE(counts[1] == 20);
+  REQUIRE(counts[2] == 10);
+  REQUIRE(counts[3] == 10);
+}
+
+TEST_CASE("idle lanes don't hold up a round") {
+  LaneScheduler scheduler({1, 1, 1, 1});
+
+  for (int i = 0; i < 10; i++)
+    REQUIRE(scheduler.pick({false, false, false, true}) == 3);
+}
+
+TEST_CASE("zero weights are rejected") {
+  REQUIRE_THROWS_AS(LaneScheduler({1, 1, 0, 1}), std::invalid_argument);
+
+  LaneScheduler scheduler;
+  REQUIRE_THROWS_AS(scheduler.set_weights({0, 1, 1, 1}), std::invalid_argument);
+  // the old weights are kept
+  REQUIRE(scheduler.pick({true, false, false, false}) == 0);
+}
@@ -0,0 +1,58 @@
+#include "catch2/catch.hpp"
+#include "eshet/publish_policy.hpp"
+
+using namespace eshet;
+using detail::should_publish;
+
+TEST_CASE("default policy publishes everything") {
+  PublishPolicy policy;
+  REQUIRE(should_publish(policy, Known(5), Known(5)));
+  REQUIRE(should_publish(policy, Unknown(), Unknown()));
+}
+
+TEST_CASE("dedupe") {
+  PublishPolicy policy;
+  policy.dedupe = true;
+
+  REQUIRE(!should_publish(policy, Known(5), Known(5)));
+  REQUIRE(should_publish(policy, Known(5), Known(6)));
+  REQUIRE(should_publish(policy, Known(5), Unknown()));
+  REQUIRE(should_publish(policy, Unknown(), Known(5)));
+  REQUIRE(!should_publish(policy, Unknown(), Unknown()));
+}
+
+TEST_CASE("deadband") {
+  PublishPolicy policy;
+  policy.deadband = 0.5;
+
+  REQUIRE(!should_publish(policy, Known(1.0), Known(1.2)));
+  REQUIRE(!should_publish(policy, Known(1.0), Known(0.8)));
+  REQUIRE(should_publish(policy, Known(1.0), Known(1.5)));
+  REQUIRE(should_publish(policy, Known(1.0), Known(0.5)));
+
+  // mixed integer and float
+  REQUIRE(!should_publish(policy, Known(1), Known(1.2)));
+  REQUIRE(should_publish(policy, Known(-1), Known(2)));
+
+  // transitions to and from unknown are always published
+  REQUIRE(should_publish(policy, Known(1.0), Unknown()));
+  REQUIRE(should_publish(policy, Unknown(), Known(1.0)));
+
+  // non-numeric values fall back to dedupe, if enabled
+  REQUIRE(should_publish(policy, Known(true), Known(true)));
+  policy.dedupe = true;
+  REQUIRE(!should_publish(policy, Known(true), Known(true)));
+  REQUIRE(should_publish(policy, Known(true), Known(false)));
+}
+
+TEST_CASE("max_rate") {
+  PublishPolicy policy;
+  policy.max_rate(4);
+  REQUIRE(policy.min_interval == std::chrono::milliseconds(250));
+
+  REQUIRE_THROWS_AS(policy.max_rate(0), std::invalid_argument);
+  REQUIRE_THROWS_AS(policy.max_rate(-1), std::invalid_argument);
+  REQUIRE_THROWS_AS(policy.max_rate(NAN), std::invalid_argument);
+  REQUIRE_THROWS_AS(policy.max_rate(1e-300), std::invalid_argument);
+  REQUIRE(policy.min_interval == std::chrono::milliseconds(250));
+}
@@ -0,0 +1,151 @@
+#include "catch2/catch.hpp"
+#include "eshet.hpp"
+#include "eshet/server/relay.hpp"
+#include "eshet/server/server.hpp"
+#include <thread>
+
+// tests of the relay, between clients and the built-in server
+
+using namespace eshet;
+#define NS "/eshetcpp_test_relay"
+
+// run a server, and a relay connected to it, on free loopback ports
+class TestRelay {
+public:
+  TestRelay()
+      : server(server_config()), server_thread([this]() { server.run(); }),
+        relay(relay_config(server.port())),
+        relay_thread([this]() { relay.run(); }) {}
+
+  ~TestRelay() {
+    relay.stop();
+    relay_thread.join();
+    server.stop();
+    server_thread.join();
+  }
+
+  int server_port() const { return server.port(); }
+  int relay_port() const { return relay.port(); }
+  const server::RelayCounters &counters() const { return relay.counters(); }
+
+private:
+  static server::ServerConfig server_config() {
+    server::ServerConfig config;
+    config.bind_address = "127.0.0.1";
+    config.port = 0;
+    return config;
+  }
+
+  static server::RelayConfig relay_config(int server_port) {
+    server::RelayConfig config;
+    config.listen = server_config();
+    config.upstream_host = "127.0.0.1";
+    config.upstream_port = server_port;
+    return config;
+  }
+
+  server::Server server;
+  std::thread server_thread;
+  server::Relay relay;
+  std::thread relay_thread;
+};
+
+TEST_CASE("relay shares observes") {
+  TestRelay relay;
+  ESHETClient owner("127.0.0.1", relay.server_port());
+  ESHETClient client1("127.0.0.1", relay.relay_port());
+  ESHETClient client2("127.0.0.1", relay.relay_port());
+
+  Actor self;
+  Channel<Result> result(self);
+  owner.state_register(NS "/state", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  owner.state_changed(NS "/state", 5, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<StateResult> observe_result(self);
+  Channel<StateUpdate> changes1(self), changes2(self);
+  client1.state_observe(NS "/state", observe_result, changes1);
+  REQUIRE(observe_result.read() == StateResult(Known(5)));
+  client2.state_observe(NS "/state", observe_result, changes2);
+  REQUIRE(observe_result.read() == StateResult(Known(5)));
+
+  REQUIRE(relay.counters().observes_forwarded == 1);
+  REQUIRE(relay.counters().observes_shared == 1);
+
+  owner.state_changed(NS "/state", 6, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  REQUIRE(changes1.read() == StateUpdate(Known(6)));
+  REQUIRE(changes2.read() == StateUpdate(Known(6)));
+}
+
+TEST_CASE("relay shares listens") {
+  TestRelay relay;
+  ESHETClient emitter("127.0.0.1", relay.server_port());
+  ESHETClient client1("127.0.0.1", relay.relay_port());
+  ESHETClient client2("127.0.0.1", relay.relay_port());
+
+  Actor self;
+  Channel<Result> result(self);
+  emitter.event_register(NS "/event", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<msgpack::object_handle> events1(self), events2(self);
+  client1.event_listen(NS "/event", events1, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  client2.event_listen(NS "/event", events2, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  REQUIRE(relay.counters().listens_forwarded == 1);
+
+  emitter.event_emit(NS "/event", 5, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  REQUIRE(events1.read()->as<int>() == 5);
+  REQUIRE(events2.read()->as<int>() == 5);
+}
+
+TEST_CASE("relay states and actions") {
+  TestRelay relay;
+  ESHETClient direct("127.0.0.1", relay.server_port());
+  ESHETClient local1("127.0.0.1", relay.relay_port());
+  ESHETClient local2("127.0.0.1", relay.relay_port());
+
+  Actor self;
+  Channel<Result> result(self);
+
+  // a state owned by a local client
+  local1.state_register(NS "/local_state", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  local1.state_changed(NS "/local_state", 5, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<StateResult> observe_result(self);
+  Channel<StateUpdate> changes(self);
+  direct.state_observe(NS "/local_state", observe_result, changes);
+  REQUIRE(observe_result.read() == StateResult(Known(5)));
+
+  // other local clients can't change it, even though the relay owns it on
+  // the server
+  local2.state_changed(NS "/local_state", 6, result);
+  REQUIRE(result.read() == Result(Error("not_owner")));
+
+  // actions registered locally are called with the server's ids, and calls
+  // from several local clients are told apart
+  Channel<Call> calls;
+  local1.action_register(NS "/local_action", result, calls);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<Result> result1, result2;
+  direct.action_call_pack(NS "/local_action", result1, std::make_tuple(1));
+  local2.action_call_pack(NS "/local_action", result2, std::make_tuple(2));
+  for (int i = 0; i < 2; i++) {
+    Call call = calls.read();
+    call.reply(Success(std::get<0>(call.as<std::tuple<int>>()) * 10));
+  }
+  REQUIRE(result1.read() == Result(Success(10)));
+  REQUIRE(result2.read() == Result(Success(20)));
+
+  // when the owner disconnects, its state becomes unknown
+  local1.test_disconnect();
+  REQUIRE(changes.read() == StateUpdate(Unknown()));
+  REQUIRE(changes.read() == StateUpdate(Known(5)));
+}
@@ -0,0 +1,572 @@
+#include "catch2/catch.hpp"
+#include "eshet.hpp"
+#include "eshet/server/server.hpp"
+#include <thread>
+
+// tests of the built-in server, through the client; unlike the other tests,
+// these don't need an external server
+
+using namespace eshet;
+#define NS "/eshetcpp_test_server"
+
+// run a server on a free loopback port, and optionally Unix and shared memory
+// sockets, for the lifetime of this object
+class TestServer {
+public:
+  explicit TestServer(const std::string &unix_path = {},
+                      const std::string &shm_path = {})
+      : server(config(unix_path, shm_path)),
+        thread([this]() { server.run(); }) {}
+
+  ~TestServer() {
+    server.stop();
+    thread.join();
+  }
+
+  int port() const { return server.port(); }
+
+private:
+  static server::ServerConfig config(const std::string &unix_path,
+                                     const std::string &shm_path) {
+    server::ServerConfig config;
+    config.bind_address = "127.0.0.1";
+    config.port = 0;
+    config.unix_path = unix_path;
+    config.shm_path = shm_path;
+    return config;
+  }
+
+  server::Server server;
+  std::thread thread;
+};
+
+TEST_CASE("server state") {
+  TestServer server;
+  ESHETClient client("127.0.0.1", server.port());
+  ESHETClient client2("127.0.0.1", server.port());
+
+  Actor self;
+  Channel<Result> result(self);
+  client.state_register(NS "/state", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<StateResult> observe_result(self);
+  Channel<StateUpdate> on_change(self);
+  client2.state_observe(NS "/state", observe_result, on_change);
+  REQUIRE(std::holds_alternative<Unknown>(observe_result.read()));
+
+  client2.get(NS "/state", result);
+  REQUIRE(result.read() == Result(Error("unknown")));
+
+  client.state_changed(NS "/state", 5, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  REQUIRE(on_change.read() == StateUpdate(Known(5)));
+
+  client2.get(NS "/state", result);
+  REQUIRE(result.read() == Result(Success(5)));
+
+  // only the owner can change a state
+  client2.state_changed(NS "/state", 6, result);
+  REQUIRE(result.read() == Result(Error("not_owner")));
+
+  // when the owner disconnects the state becomes unknown, then the owner
+  // re-registers and sends the last value
+  client.test_disconnect();
+  REQUIRE(on_change.read() == StateUpdate(Unknown()));
+  REQUIRE(on_change.read() == StateUpdate(Known(5)));
+
+  client.state_unknown(NS "/state", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  REQUIRE(on_change.read() == StateUpdate(Unknown()));
+}
+
+TEST_CASE("server state time") {
+  using namespace std::chrono;
+  TestServer server;
+  ESHETClient client("127.0.0.1", server.port());
+
+  Actor self;
+  Channel<Result> result(self);
+  client.state_register(NS "/state_time", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  client.state_changed(NS "/state_time", 5, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  std::this_thread::sleep_for(milliseconds(200));
+
+  ESHETClient client2("127.0.0.1", server.port());
+  Channel<StateResult> observe_result(self);
+  Channel<StateUpdate> on_change(self);
+  client2.state_observe(NS "/state_time", observe_result, on_change);
+  Known known = std::get<Known>(observe_result.read());
+  REQUIRE(known.as<int>() == 5);
+  REQUIRE(known.t_since_change >= milliseconds(200));
+  REQUIRE(known.t_since_change < milliseconds(1000));
+}
+
+TEST_CASE("server action") {
+  TestServer server;
+  ESHETClient client1("127.0.0.1", server.port());
+  ESHETClient client2("127.0.0.1", server.port());
+
+  Channel<Result> result;
+  Channel<Call> calls;
+  client1.action_register(NS "/action", result, calls);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  client2.action_call_pack(NS "/action", result, std::make_tuple(5));
+  Call call = calls.read();
+  REQUIRE(std::get<0>(call.as<std::tuple<int>>()) == 5);
+  call.reply(Success(6));
+  REQUIRE(result.read() == Result(Success(6)));
+
+  client2.action_call_pack(NS "/other_action", result, std::make_tuple(5));
+  REQUIRE(result.read() == Result(Error("no_action")));
+
+  // calls waiting for a reply get an error if the action's owner disconnects
+  client2.action_call_pack(NS "/action", result, std::make_tuple(5));
+  calls.read();
+  client1.test_disconnect();
+  REQUIRE(result.read() == Result(Error("disconnected")));
+}
+
+TEST_CASE("server event") {
+  TestServer server;
+  ESHETClient client("127.0.0.1", server.port());
+  ESHETClient client2("127.0.0.1", server.port());
+  ESHETClient client3("127.0.0.1", server.port());
+
+  Actor self;
+  Channel<Result> result(self);
+  client.event_register(NS "/event", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<msgpack::object_handle> events2(self);
+  client2.event_listen(NS "/event", events2, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<msgpack::object_handle> events3(self);
+  client3.event_listen(NS "/event", events3, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  for (int i = 0; i < 10; i++) {
+    client.event_emit(NS "/event", i, result);
+    REQUIRE(std::holds_alternative<Success>(result.read()));
+  }
+  for (int i = 0; i < 10; i++) {
+    REQUIRE(events2.read()->as<int>() == i);
+    REQUIRE(events3.read()->as<int>() == i);
+  }
+}
+
+TEST_CASE("server set") {
+  TestServer server;
+  ESHETClient client("127.0.0.1", server.port());
+
+  Channel<Result> result;
+  client.set(NS "/prop", 5, result);
+  REQUIRE(result.read() == Result(Error("no_prop")));
+}
+
+TEST_CASE("server unix socket") {
+  std::string path = "/tmp/eshetcpp_test_server.sock";
+  TestServer server(path);
+  ESHETClient client("unix:" + path, 0);
+  ESHETClient client2("127.0.0.1", server.port());
+
+  Actor self;
+  Channel<Result> result(self);
+  client.state_register(NS "/unix_state", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  client.state_changed(NS "/unix_state", 5, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  client2.get(NS "/unix_state", result);
+  REQUIRE(result.read() == Result(Success(5)));
+
+  // reconnection works the same as over TCP
+  client.test_disconnect();
+  client.get(NS "/unix_state", result);
+  REQUIRE(result.read() == Result(Success(5)));
+}
+
+TEST_CASE("server io_uring") {
+  // this falls back to threads if io_uring is not available
+  SocketConfig socket_config;
+  socket_config.backend = SocketBackend::Uring;
+  TestServer server;
+  ESHETClient client("127.0.0.1", server.port(), std::nullopt,
+                     TimeoutConfig{}, socket_config);
+  ESHETClient client2("127.0.0.1", server.port(), std::nullopt,
+                      TimeoutConfig{}, socket_config);
+
+  Actor self;
+  Channel<Result> result(self);
+  Channel<Call> calls;
+  client.action_register(NS "/uring_action", result, calls);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  // many calls in flight at once, so that sends and receives are batched
+  for (int i = 0; i < 1000; i++)
+    client2.action_call_pack(NS "/uring_action", result, std::make_tuple(i));
+  for (int i = 0; i < 1000; i++) {
+    Call call = calls.read();
+    call.reply(Success(std::get<0>(call.as<std::tuple<int>>()) + 1));
+  }
+  for (int i = 0; i < 1000; i++)
+    REQUIRE(result.read() == Result(Success(i + 1)));
+
+  // calls waiting for a reply get an error if the action's owner disconnects,
+  // and the owner reconnects
+  client2.action_call_pack(NS "/uring_action", result, std::make_tuple(5));
+  calls.read();
+  client.test_disconnect();
+  REQUIRE(result.read() == Result(Error("disconnected")));
+  client.get(NS "/uring_action", result);
+  REQUIRE(result.read() == Result(Error("no_state")));
+}
+
+TEST_CASE("server latency profile") {
+  // options which need privileges (SO_BUSY_POLL above the system default)
+  // are logged and ignored
+  SocketConfig socket_config;
+  socket_config.latency = LatencyProfile::low_latency();
+  socket_config.latency.send_buffer = 1 << 16;
+  socket_config.latency.recv_buffer = 1 << 16;
+  TestServer server;
+  ESHETClient client("127.0.0.1", server.port(), std::nullopt,
+                     TimeoutConfig{}, socket_config);
+  ESHETClient client2("127.0.0.1", server.port(), std::nullopt,
+                      TimeoutConfig{}, socket_config);
+
+  Actor self;
+  Channel<Result> result(self);
+  Channel<Call> calls;
+  client.action_register(NS "/latency_action", result, calls);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  // one call at a time, so that both sides go back to spinning in between
+  for (int i = 0; i < 100; i++) {
+    client2.action_call_pack(NS "/latency_action", result, std::make_tuple(i));
+    Call call = calls.read();
+    call.reply(Success(std::get<0>(call.as<std::tuple<int>>()) + 1));
+    REQUIRE(result.read() == Result(Success(i + 1)));
+  }
+
+  // disconnection is noticed while spinning, and the client reconnects
+  client2.action_call_pack(NS "/latency_action", result, std::make_tuple(5));
+  calls.read();
+  client.test_disconnect();
+  REQUIRE(result.read() == Result(Error("disconnected")));
+  client.get(NS "/latency_action", result);
+  REQUIRE(result.read() == Result(Error("no_state")));
+}
+
+TEST_CASE("server timestamping") {
+  SocketConfig socket_config;
+  socket_config.timestamping = true;
+  TestServer server;
+  ESHETClient client("127.0.0.1", server.port());
+  ESHETClient client2("127.0.0.1", server.port(), std::nullopt,
+                      TimeoutConfig{}, socket_config);
+
+  Actor self;
+  Channel<Result> result(self);
+  client.state_register(NS "/ts_state", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  client.event_register(NS "/ts_event", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<StateResult> state_result(self);
+  Channel<StateUpdate> state_changes(self);
+  client2.state_observe(NS "/ts_state", state_result, state_changes);
+  REQUIRE(std::holds_alternative<Unknown>(state_result.read()));
+
+  Channel<TimestampedEvent> events(self);
+  client2.event_listen(NS "/ts_event", events, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  // timestamps are from the kernel's real-time clock, so should be a little
+  // before now
+  auto check_recent = [](std::optional<Timestamp> t) {
+    REQUIRE(t);
+    auto age = std::chrono::system_clock::now() - *t;
+    REQUIRE(age >= std::chrono::seconds(0));
+    REQUIRE(age < std::chrono::seconds(5));
+  };
+
+  client.state_changed(NS "/ts_state", 5, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  StateUpdate update = state_changes.read();
+  REQUIRE(update == StateUpdate(Known(5)));
+  check_recent(std::get<Known>(update).rx_time);
+
+  client.event_emit(NS "/ts_event", 6, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  TimestampedEvent event = events.read();
+  REQUIRE(event.value.get().as<int>() == 6);
+  check_recent(event.rx_time);
+
+  // each sent frame's delay is recorded when its transmit timestamp is read,
+  // which happens before the reply to it is handled
+  MetricsSnapshot metrics = client2.metrics().snapshot();
+  REQUIRE(metrics.rx_delay_ns.count > 0);
+  REQUIRE(metrics.tx_delay_ns.count > 0);
+
+  // without timestamping, nothing is recorded
+  client2.get(NS "/ts_state", result);
+  REQUIRE(result.read() == Result(Success(5)));
+  REQUIRE(client.metrics().snapshot().rx_delay_ns.count == 0);
+}
+
+TEST_CASE("server zero copy") {
+  TestServer server;
+  ESHETClient client("127.0.0.1", server.port());
+  ESHETClient client2("127.0.0.1", server.port());
+
+  Actor self;
+  Channel<Result> result(self);
+  client.state_register(NS "/zc_state", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  client.event_register(NS "/zc_event", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  SubscribeOptions options;
+  options.zero_copy = true;
+
+  Channel<StateResult> state_result(self);
+  Channel<StateUpdate> state_changes(self);
+  client2.state_observe(NS "/zc_state", state_result, state_changes, options);
+  REQUIRE(std::holds_alternative<Unknown>(state_result.read()));
+
+  Channel<msgpack::object_handle> events(self);
+  client2.event_listen(NS "/zc_event", events, result, options);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  // larger than a receive buffer, so each of these spans several reads
+  std::vector<char> blob(30000);
+  for (size_t i = 0; i < blob.size(); i++)
+    blob[i] = (char)i;
+
+  std::vector<msgpack::object_handle> received;
+  for (int i = 0; i < 10; i++) {
+    client.event_emit(NS "/zc_event", blob, result);
+    REQUIRE(std::holds_alternative<Success>(result.read()));
+    received.push_back(events.read());
+  }
+  // values stay valid while their buffers are held
+  for (auto &oh : received)
+    REQUIRE(oh->as<std::vector<char>>() == blob);
+
+  client.state_changed(NS "/zc_state", std::string("value"), result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  REQUIRE(state_changes.read() == StateUpdate(Known(std::string("value"))));
+}
+
+TEST_CASE("server lazy values") {
+  TestServer server;
+  ESHETClient client("127.0.0.1", server.port());
+  ESHETClient client2("127.0.0.1", server.port());
+
+  Actor self;
+  Channel<Result> result(self);
+  client.state_register(NS "/lazy_state", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  client.event_register(NS "/lazy_event", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<LazyCall> calls(self);
+  client.action_register(NS "/lazy_action", result, calls);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<StateResult> state_result(self);
+  Channel<LazyStateUpdate> state_changes(self);
+  client2.state_observe(NS "/lazy_state", state_result, state_changes);
+  REQUIRE(std::holds_alternative<Unknown>(state_result.read()));
+
+  Channel<LazyValue> events(self);
+  client2.event_listen(NS "/lazy_event", events, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  client.event_emit(NS "/lazy_event", std::string("event"), result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  LazyValue event = events.read();
+  REQUIRE(!event.unpacked());
+  REQUIRE(event.as<std::string>() == "event");
+  REQUIRE(event.unpacked());
+
+  client.state_changed(NS "/lazy_state", 5, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  LazyStateUpdate update = state_changes.read();
+  REQUIRE(std::get<LazyKnown>(update).value.as<int>() == 5);
+
+  client2.action_call_pack(NS "/lazy_action", result, std::make_tuple(5));
+  LazyCall call = calls.read();
+  REQUIRE(std::get<0>(call.args.as<std::tuple<int>>()) == 5);
+  call.reply(Success(6));
+  REQUIRE(result.read() == Result(Success(6)));
+
+  // after reconnecting, the current state is sent again
+  client2.test_disconnect();
+  REQUIRE(std::holds_alternative<Unknown>(state_changes.read()));
+  update = state_changes.read();
+  REQUIRE(std::get<LazyKnown>(update).value.as<int>() == 5);
+}
+
+struct TestPose {
+  double x = 0;
+  double y = 0;
+  std::string frame;
+  MSGPACK_DEFINE(x, y, frame);
+};
+
+TEST_CASE("server typed") {
+  TestServer server;
+  ESHETClient client("127.0.0.1", server.port());
+  ESHETClient client2("127.0.0.1", server.port());
+
+  constexpr TypedEvent<TestPose> pose_event{NS "/typed_event"};
+  constexpr TypedState<int> count_state{NS "/typed_state"};
+
+  Actor self;
+  Channel<Result> result(self);
+  client.event_register(pose_event, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  client.state_register(count_state, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<TestPose> poses(self);
+  client2.event_listen(pose_event, poses, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<StateResult> state_result(self);
+  Channel<std::optional<int>> counts(self);
+  client2.state_observe(count_state, state_result, counts);
+  REQUIRE(std::holds_alternative<Unknown>(state_result.read()));
+
+  client.event_emit(pose_event, TestPose{1, 2, "map"}, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  TestPose pose = poses.read();
+  REQUIRE(pose.x == 1);
+  REQUIRE(pose.y == 2);
+  REQUIRE(pose.frame == "map");
+
+  client.state_changed(count_state, 5, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  REQUIRE(counts.read() == 5);
+
+  // values of the wrong type are dropped
+  client.event_emit(NS "/typed_event", std::string("pose"), result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  client.event_emit(pose_event, TestPose{3, 4, "map"}, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  REQUIRE(poses.read().x == 3);
+
+  // when the owner disconnects the state becomes unknown, then it is
+  // re-registered with the last value
+  client.test_disconnect();
+  REQUIRE(counts.read() == std::nullopt);
+  REQUIRE(counts.read() == 5);
+}
+
+TEST_CASE("server shared memory") {
+  std::string path = "/tmp/eshetcpp_test_server_shm.sock";
+  TestServer server({}, path);
+  ESHETClient client("shm:" + path, 0);
+  ESHETClient client2("shm:" + path, 0);
+
+  Actor self;
+  Channel<Result> result(self);
+  client.event_register(NS "/shm_event", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  Channel<msgpack::object_handle> events(self);
+  client2.event_listen(NS "/shm_event", events, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  // enough data to wrap around the rings several times, and fill them while
+  // the other side is busy
+  std::string padding(1000, 'x');
+  for (int i = 0; i < 10000; i++)
+    client.event_emit(NS "/shm_event", std::make_tuple(i, padding), result);
+  for (int i = 0; i < 10000; i++)
+    REQUIRE(std::holds_alternative<Success>(result.read()));
+  for (int i = 0; i < 10000; i++) {
+    auto value = events.read()->as<std::tuple<int, std::string>>();
+    REQUIRE(std::get<0>(value) == i);
+    REQUIRE(std::get<1>(value) == padding);
+  }
+
+  // reconnection works the same as over a socket
+  client.state_register(NS "/shm_state", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  client.state_changed(NS "/shm_state", 5, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  client.test_disconnect();
+  client.get(NS "/shm_state", result);
+  REQUIRE(result.read() == Result(Success(5)));
+}
+
+// records the frames sent by a Broker to each connection, without their
+// headers
+class RecordingOutput : public server::BrokerOutput {
+public:
+  void send(server::ConnId conn, const uint8_t *data, size_t size) override {
+    frames[conn].emplace_back(data + 3, data + size);
+  }
+
+  std::map<server::ConnId, std::vector<std::vector<uint8_t>>> frames;
+};
+
+TEST_CASE("server action owner which never replies") {
+  RecordingOutput output;
+  server::Broker broker(output);
+  detail::SendBuf buf(128);
+  auto handle = [&](server::ConnId conn) {
+    broker.handle(conn, (const uint8_t *)buf.sbuf.data() + 3,
+                  buf.sbuf.size() - 3);
+  };
+
+  const server::ConnId owner = 1, caller = 2;
+  for (server::ConnId conn : {owner, caller}) {
+    broker.connected(conn);
+    buf.write_hello({}, 30);
+    handle(conn);
+  }
+  buf.write_action_register(0, NS "/busy");
+  handle(owner);
+  output.frames.clear();
+
+  // fill the owner's call ids
+  for (uint32_t i = 0; i <= UINT16_MAX; i++) {
+    buf.write_action_call((uint16_t)i, NS "/busy", msgpack::object(i));
+    handle(caller);
+  }
+  REQUIRE(output.frames[owner].size() == UINT16_MAX + 1);
+  REQUIRE(output.frames[caller].empty());
+
+  // further calls get an error rather than waiting for a free id
+  buf.write_action_call(7, NS "/busy", msgpack::object(0));
+  handle(caller);
+  REQUIRE(output.frames[owner].size() == UINT16_MAX + 1);
+  REQUIRE(output.frames[caller].size() == 1);
+  detail::Parser error(output.frames[caller][0].data(),
+                       output.frames[caller][0].size());
+  REQUIRE(error.read8() == 0x06);
+  REQUIRE(error.read16() == 7);
+  REQUIRE(error.read_msgpack()->as<std::string>() == "busy");
+
+  // once the owner replies to one, there's room for another
+  detail::Parser first(output.frames[owner][0].data(),
+                       output.frames[owner][0].size());
+  REQUIRE(first.read8() == 0x11);
+  buf.write_reply(first.read16(), Success(5));
+  handle(owner);
+  REQUIRE(output.frames[caller].size() == 2);
+  REQUIRE(output.frames[caller][1][0] == 0x05);
+
+  buf.write_action_call(8, NS "/busy", msgpack::object(0));
+  handle(caller);
+  REQUIRE(output.frames[owner].size() == UINT16_MAX + 2);
+  REQUIRE(output.frames[caller].size() == 2);
+}
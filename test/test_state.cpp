@@ -123,3 +123,78 @@ TEST_CASE("test_time") {
   auto diff_ms = duration_cast<milliseconds>(diff).count();
   REQUIRE(std::abs(diff_ms) < 50);
 }
+
+TEST_CASE("test_publish_policy") {
+  ESHETClient client("localhost", 11236);
+
+  Actor self;
+  Channel<Result> result(self);
+
+  PublishPolicy policy;
+  policy.dedupe = true;
+  policy.min_interval = std::chrono::milliseconds(500);
+  client.state_register(NS "/state4", result, policy);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  ESHETClient client2("localhost", 11236);
+  Channel<StateResult> state_result(self);
+  Channel<StateUpdate> on_change(self);
+  client2.state_observe(NS "/state4", state_result, on_change);
+  REQUIRE(std::holds_alternative<Unknown>(state_result.read()));
+
+  // first change is published immediately
+  client.state_changed(NS "/state4", 5, result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+  REQUIRE(on_change.read() == StateUpdate(Known(5)));
+
+  // duplicates are dropped, and changes within min_interval are coalesced,
+  // with the latest published at the end of the interval
+  for (int i : {5, 6, 7, 8}) {
+    client.state_changed(NS "/state4", i, result);
+    REQUIRE(std::holds_alternative<Success>(result.read()));
+  }
+  REQUIRE(on_change.read() == StateUpdate(Known(8)));
+  REQUIRE(self.wait_for(std::chrono::seconds(1), on_change) == -1);
+}
+
+TEST_CASE("test_metrics") {
+  ESHETClient client("localhost", 11236);
+
+  Actor self;
+  Channel<Result> result(self);
+  client.state_register(NS "/state5", result);
+  REQUIRE(std::holds_alternative<Success>(result.read()));
+
+  client.metrics().reset();
+
+  for (int i = 0; i < 10; i++) {
+    client.state_changed(NS "/state5", i, result);
+    REQUIRE(std::holds_alternative<Success>(result.read()));
+  }
+
+  MetricsSnapshot s = client.metrics().snapshot();
+  REQUIRE(s.latency(CommandType::StateChanged).count == 10);
+  REQUIRE(s.latency(CommandType::StateChanged).percentile(99) > 0);
+  REQUIRE(s.frames_out == 10);
+  REQUIRE(s.frames_in == 10);
+  REQUIRE(s.in_flight == 0);
+  REQUIRE(s.lanes[(size_t)Lane::State].depth == 0);
+}
+
+TEST_CASE("test_publish_metrics") {
+  ESHETClient client("localhost", 11236);
+  client.publish_metrics({NS "/meta", std::chrono::milliseconds(200)});
+
+  // wait for the states to be registered and published
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  ESHETClient client2("localhost", 11236);
+  Actor self;
+  Channel<StateResult> state_result(self);
+  Channel<StateUpdate> on_change(self);
+  client2.state_observe(NS "/meta/reconnects", state_result, on_change);
+
+  StateResult result = state_result.read();
+  REQUIRE(std::holds_alternative<Known>(result));
+  REQUIRE(std::get<Known>(result).as<double>() == 0.0);
+}
@@ -0,0 +1,52 @@
+#include "catch2/catch.hpp"
+#include "eshet/thread_pool.hpp"
+#include <chrono>
+
+using namespace eshet;
+
+TEST_CASE("runs all tasks") {
+  std::atomic<int> count{0};
+  {
+    ThreadPool pool(4);
+    for (int i = 0; i < 1000; i++)
+      pool.submit([&]() { count++; });
+  }
+  REQUIRE(count == 1000);
+}
+
+TEST_CASE("tasks submitted from tasks") {
+  std::atomic<int> count{0};
+  {
+    ThreadPool pool(4);
+    for (int i = 0; i < 10; i++)
+      pool.submit([&]() {
+        for (int j = 0; j < 10; j++)
+          pool.submit([&]() { count++; });
+      });
+
+    // wait for the outer tasks to have submitted everything, as destruction
+    // only waits for tasks which have already been submitted
+    while (count < 100)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  REQUIRE(count == 100);
+}
+
+TEST_CASE("idle workers steal") {
+  ThreadPool pool(2);
+
+  // block one worker; tasks queued behind it should still run
+  std::atomic<bool> release{false};
+  std::atomic<int> count{0};
+  pool.submit([&]() {
+    pool.submit([&]() { count++; });
+    while (!release)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  });
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (count < 1 && std::chrono::steady_clock::now() < deadline)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  release = true;
+  REQUIRE(count == 1);
+}
@@ -0,0 +1,94 @@
+#include "catch2/catch.hpp"
+#include "eshet/trace.hpp"
+#include <sstream>
+#include <thread>
+
+using namespace eshet;
+
+// TraceSpan records into the global sink, whose capacity is set by the first
+// test to start it, so tests which don't need it use their own sink; the
+// global one is always started with the same capacity
+
+TEST_CASE("nothing is recorded while stopped") {
+  TraceSink &sink = TraceSink::global();
+  sink.stop();
+  sink.clear();
+  { detail::TraceSpan span("a", "test"); }
+  REQUIRE(sink.events().empty());
+
+  sink.start(8);
+  sink.stop();
+  { detail::TraceSpan span("a", "test"); }
+  REQUIRE(sink.events().empty());
+}
+
+TEST_CASE("spans") {
+  TraceSink &sink = TraceSink::global();
+  sink.clear();
+  sink.start(8);
+  { detail::TraceSpan span("a", "test", "id", 5); }
+  { detail::TraceSpan span("b", "test"); }
+  sink.stop();
+
+  auto events = sink.events();
+  REQUIRE(events.size() == 2);
+  REQUIRE(std::string(events[0].name) == "a");
+  REQUIRE(std::string(events[0].cat) == "test");
+  REQUIRE(std::string(events[0].arg_name) == "id");
+  REQUIRE(events[0].arg == 5);
+  REQUIRE(std::string(events[1].name) == "b");
+  REQUIRE(events[1].arg_name == nullptr);
+  REQUIRE(events[0].start_ns <= events[1].start_ns);
+}
+
+TEST_CASE("only the latest events are kept") {
+  TraceSink sink;
+  sink.start(8);
+  for (uint64_t i = 0; i < 20; i++)
+    sink.record("a", "test", i, i + 1, "i", i);
+  sink.stop();
+
+  auto events = sink.events();
+  REQUIRE(events.size() == 8);
+  for (size_t i = 0; i < 8; i++)
+    REQUIRE(events[i].arg == 12 + i);
+}
+
+TEST_CASE("concurrent recording") {
+  TraceSink sink;
+  sink.start(8);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++)
+    threads.emplace_back([&]() {
+      for (int i = 0; i < 1000; i++)
+        sink.record("a", "test", 1, 2);
+    });
+  for (auto &thread : threads)
+    thread.join();
+  sink.stop();
+
+  auto events = sink.events();
+  REQUIRE(events.size() == 8);
+  for (auto &event : events)
+    REQUIRE(event.dur_ns == 1);
+}
+
+TEST_CASE("chrome json") {
+  TraceSink sink;
+  sink.set_thread_name("main \"thread\"");
+  sink.start();
+  sink.record("a", "test", 1000, 3500, "id", 7);
+  sink.stop();
+
+  std::ostringstream out;
+  sink.write_chrome_json(out);
+  std::string json = out.str();
+
+  REQUIRE(json.find("\"name\":\"a\",\"cat\":\"test\",\"ph\":\"X\"") !=
+          std::string::npos);
+  REQUIRE(json.find("\"ts\":0.000,\"dur\":2.500,\"args\":{\"id\":7}") !=
+          std::string::npos);
+  REQUIRE(json.find("\"args\":{\"name\":\"main \\\"thread\\\"\"}") !=
+          std::string::npos);
+}
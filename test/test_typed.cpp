@@ -0,0 +1,152 @@
+#include "catch2/catch.hpp"
+#include "eshet/typed.hpp"
+
+using namespace eshet;
+using detail::decode_msgpack;
+
+struct Point {
+  double x = 0;
+  double y = 0;
+  MSGPACK_DEFINE(x, y);
+
+  bool operator==(const Point &other) const {
+    return x == other.x && y == other.y;
+  }
+};
+
+struct Shape {
+  std::string name;
+  std::vector<Point> points;
+  std::optional<int> colour;
+  MSGPACK_DEFINE(name, points, colour);
+};
+
+struct NamedPoint {
+  int x = 0;
+  int y = 0;
+  MSGPACK_DEFINE_MAP(x, y);
+};
+
+struct PointV1 {
+  double x = 0;
+  MSGPACK_DEFINE(x);
+
+  bool operator==(const PointV1 &other) const { return x == other.x; }
+};
+
+// check that decoding value directly gives the same result as converting it
+// via a msgpack::object
+template <typename T, typename V> T round_trip(const V &value) {
+  msgpack::sbuffer sbuf;
+  msgpack::pack(sbuf, value);
+  T direct = decode_msgpack<T>(sbuf.data(), sbuf.size());
+  T converted = msgpack::unpack(sbuf.data(), sbuf.size())->as<T>();
+  REQUIRE(direct == converted);
+  return direct;
+}
+
+TEST_CASE("decode scalars") {
+  REQUIRE(round_trip<int>(5) == 5);
+  REQUIRE(round_trip<int>(-100000) == -100000);
+  REQUIRE(round_trip<uint64_t>(UINT64_MAX) == UINT64_MAX);
+  REQUIRE(round_trip<int64_t>(INT64_MIN) == INT64_MIN);
+  REQUIRE(round_trip<bool>(true) == true);
+  REQUIRE(round_trip<double>(1.5) == 1.5);
+  REQUIRE(round_trip<double>(3) == 3.0);
+  REQUIRE(round_trip<float>(2.5f) == 2.5f);
+  REQUIRE(round_trip<std::string>(std::string(300, 'a')) ==
+          std::string(300, 'a'));
+
+  auto type_error = [](auto value, auto target) {
+    msgpack::sbuffer sbuf;
+    msgpack::pack(sbuf, value);
+    REQUIRE_THROWS_AS(
+        decode_msgpack<decltype(target)>(sbuf.data(), sbuf.size()),
+        msgpack::type_error);
+  };
+  type_error(300, uint8_t{});
+  type_error(-1, 0u);
+  type_error(std::string("x"), 0);
+  type_error(1.5, 0);
+}
+
+TEST_CASE("decode containers") {
+  std::vector<char> bin{1, 2, 3};
+  REQUIRE(round_trip<std::vector<char>>(bin) == bin);
+
+  std::map<std::string, std::vector<int>> map{{"a", {1, 2}}, {"b", {}}};
+  REQUIRE((round_trip<std::map<std::string, std::vector<int>>>(map)) == map);
+
+  std::tuple<int, std::string, bool> t{1, "two", true};
+  REQUIRE((round_trip<std::tuple<int, std::string, bool>>(t)) == t);
+  REQUIRE((round_trip<std::tuple<int, std::string, bool>>(std::make_tuple(
+              1, std::string("two")))) == std::make_tuple(1, "two", false));
+  REQUIRE((round_trip<std::tuple<int>>(t)) == std::make_tuple(1));
+
+  REQUIRE((round_trip<std::pair<int, int>>(std::make_pair(1, 2))) ==
+          std::make_pair(1, 2));
+  REQUIRE(round_trip<std::optional<int>>(msgpack::type::nil_t()) ==
+          std::nullopt);
+  REQUIRE(round_trip<std::optional<int>>(5) == 5);
+}
+
+TEST_CASE("decode structs") {
+  Shape shape{"triangle", {{0, 0}, {1, 0}, {0, 1}}, std::nullopt};
+  msgpack::sbuffer sbuf;
+  msgpack::pack(sbuf, shape);
+  Shape decoded = decode_msgpack<Shape>(sbuf.data(), sbuf.size());
+  REQUIRE(decoded.name == "triangle");
+  REQUIRE(decoded.points == shape.points);
+  REQUIRE(!decoded.colour);
+
+  // as with msgpack::object::convert, extra elements are ignored, and missing
+  // ones are left at their defaults
+  REQUIRE(round_trip<PointV1>(Point{1, 2}).x == 1);
+  Point point = round_trip<Point>(PointV1{3});
+  REQUIRE(point.x == 3);
+  REQUIRE(point.y == 0);
+
+  // MSGPACK_DEFINE_MAP is converted via an object
+  msgpack::sbuffer map_sbuf;
+  msgpack::pack(map_sbuf, NamedPoint{1, 2});
+  NamedPoint named =
+      decode_msgpack<NamedPoint>(map_sbuf.data(), map_sbuf.size());
+  REQUIRE(named.x == 1);
+  REQUIRE(named.y == 2);
+}
+
+TEST_CASE("decode malformed") {
+  msgpack::sbuffer sbuf;
+  msgpack::pack(sbuf, std::make_tuple(1, std::string("abc")));
+  REQUIRE_THROWS_AS(
+      (decode_msgpack<std::tuple<int, std::string>>(sbuf.data(),
+                                                    sbuf.size() - 1)),
+      ProtocolError);
+
+  msgpack::pack(sbuf, 5);
+  REQUIRE_THROWS_AS(
+      (decode_msgpack<std::tuple<int, std::string>>(sbuf.data(), sbuf.size())),
+      ProtocolError);
+
+  // a huge array length is rejected before allocating anything
+  const char huge[] = {(char)0xdd, (char)0xff, (char)0xff, (char)0xff,
+                       (char)0xff, 1};
+  REQUIRE_THROWS_AS(decode_msgpack<std::vector<int>>(huge, sizeof(huge)),
+                    ProtocolError);
+}
+
+TEST_CASE("path names") {
+  constexpr PathName path("/a/b");
+  static_assert(path.str() == "/a/b");
+  static_assert(path.hash() == detail::fnv1a("/a/b"));
+  static_assert(path != PathName("/a/c"));
+
+  constexpr TypedEvent<Point> event{"/points"};
+  static_assert(event.path() == PathName("/points"));
+
+  static_assert(!std::is_constructible<PathName, const char *>::value);
+
+  REQUIRE_THROWS_AS(PathName("a/b"), std::invalid_argument);
+  REQUIRE_THROWS_AS(PathName("/a/"), std::invalid_argument);
+  REQUIRE_THROWS_AS(PathName("/a//b"), std::invalid_argument);
+}